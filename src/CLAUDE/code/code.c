@@ -4,6 +4,7 @@
 #include <RTClib.h>
 #include <WiFi.h>
 #include <EEPROM.h>
+#include <esp_system.h>
 
 // WiFi Credentials for RoboRemo
 const char* ssid = "RobotTeach";
@@ -61,6 +62,12 @@ bool isTeaching = false;
 bool isPlaying = false;
 int teachIndex = 0;
 
+// Playback timing (non-blocking, frozen while an obstacle blocks the path)
+int lastStepIndex = -1;
+unsigned long stepStartTime = 0;
+bool playPaused = false;
+unsigned long pausedAt = 0;
+
 // Current positions (wiper + 6 arm servos)
 int servoPositions[7] = {450, 300, 300, 300, 300, 300, 300}; // Wiper up, arm center
 int motorSpeed = 0;
@@ -87,8 +94,53 @@ Schedule schedules[] = {
 };
 int scheduleCount = 8;
 
+// Flight Recorder (binary event log)
+// Control code only stores a fixed-size record (event id + args) into a
+// lock-free ring; a low-priority task ships the records as binary frames and
+// src/tools/heba_log_decode.py turns them back into text on the PC.
+// The ring lives in RTC memory, so the last LOG_RING_SIZE records survive a
+// crash/brownout reset and are re-sent after the next boot.
+// Keep the ids in sync with EVENTS in heba_log_decode.py.
+enum LogEvent : uint8_t {
+  EV_LOG_LOST = 0,     // records overwritten before they were sent (count)
+  EV_BOOT,             // reset reason, boot number
+  EV_READY,            // AP IP a.b.c.d
+  EV_CMD,              // first 10 chars of the command
+  EV_TEACH_START,      // mode
+  EV_TEACH_STEP,       // step number
+  EV_TEACH_SERVOS_A,   // servo 0..4
+  EV_TEACH_SERVOS_B,   // servo 5..6
+  EV_TEACH_END,        // mode, steps
+  EV_PLAY_START,       // mode
+  EV_SEQ_SAVED,
+  EV_SEQ_LOADED
+};
+
+#define LOG_RING_SIZE 64   // power of 2, 20 bytes each
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_MAGIC 0x4845424CUL  // "HEBL"
+#define LOG_SYNC1 0xA5
+#define LOG_SYNC2 0x5A
+
+struct LogRecord {
+  uint32_t seq;      // index + 1, 0 while the slot is being written
+  uint32_t ms;       // millis() when logged
+  uint8_t  id;       // LogEvent
+  uint8_t  boot;     // boot number (low 8 bits)
+  int16_t  arg[5];
+};
+
+RTC_NOINIT_ATTR LogRecord logRing[LOG_RING_SIZE];
+RTC_NOINIT_ATTR uint32_t logMagic;
+RTC_NOINIT_ATTR uint32_t logBootCount;
+uint32_t logHead = 0;      // next index to write (atomic)
+uint32_t logBootHead = 0;  // first index written by this boot
+
+void logEvent(uint8_t id, int16_t a0 = 0, int16_t a1 = 0, int16_t a2 = 0, int16_t a3 = 0, int16_t a4 = 0);
+
 void setup() {
   Serial.begin(115200);
+  logBegin();
   
   // Initialize I2C
   Wire.begin(21, 22);
@@ -153,8 +205,8 @@ void setup() {
   lcd.setCursor(0, 0);
   lcd.print("Ready! 6-Servo");
   
-  Serial.println("Robot Ready! (6 Servo Arm)");
-  Serial.println("IP: " + WiFi.softAPIP().toString());
+  IPAddress ip = WiFi.softAPIP();
+  logEvent(EV_READY, ip[0], ip[1], ip[2], ip[3]);
 }
 
 void loop() {
@@ -163,13 +215,15 @@ void loop() {
   
   // Check obstacle
   if (checkObstacle()) {
+    pausePlayback();
     stopMotors();
     setLED('R');
     lcd.setCursor(0, 1);
     lcd.print("OBSTACLE!       ");
-    delay(500);
+    delay(50);  // re-check at loop rate so we resume as soon as it clears
     return;
   }
+  resumePlayback();
   
   // Handle WiFi commands
   handleWiFi();
@@ -207,7 +261,7 @@ void handleWiFi() {
 
 void processCommand(String cmd) {
   cmd.trim();
-  Serial.println("CMD: " + cmd);
+  logCommand(cmd);
   
   // Teaching commands
   if (cmd.startsWith("TEACH_START:")) {
@@ -266,7 +320,7 @@ void startTeaching(int mode) {
   lcd.setCursor(0, 1);
   lcd.print("Step: 0         ");
   
-  Serial.println("Teaching mode: " + String(modeNames[mode]));
+  logEvent(EV_TEACH_START, mode);
 }
 
 void recordTeachStep() {
@@ -290,13 +344,10 @@ void recordTeachStep() {
   lcd.print(teachIndex);
   lcd.print("        ");
   
-  Serial.println("Recorded step: " + String(teachIndex));
-  Serial.print("Servos: ");
-  for(int i = 0; i < 7; i++) {
-    Serial.print(servoPositions[i]);
-    Serial.print(" ");
-  }
-  Serial.println();
+  logEvent(EV_TEACH_STEP, teachIndex);
+  logEvent(EV_TEACH_SERVOS_A, step.servoPos[0], step.servoPos[1], step.servoPos[2],
+           step.servoPos[3], step.servoPos[4]);
+  logEvent(EV_TEACH_SERVOS_B, step.servoPos[5], step.servoPos[6]);
 }
 
 void endTeaching() {
@@ -313,10 +364,10 @@ void endTeaching() {
   lcd.print("Steps: ");
   lcd.print(sequences[currentMode].stepCount);
   
+  logEvent(EV_TEACH_END, currentMode, sequences[currentMode].stepCount);
+  
   delay(2000);
   currentMode = -1;
-  
-  Serial.println("Teaching ended and saved");
 }
 
 void startPlaying(int mode) {
@@ -326,6 +377,8 @@ void startPlaying(int mode) {
   isTeaching = false;
   currentMode = mode;
   teachIndex = 0;
+  lastStepIndex = -1;
+  playPaused = false;
   
   setLED('G');
   lcd.clear();
@@ -333,7 +386,7 @@ void startPlaying(int mode) {
   lcd.print("Mode: ");
   lcd.print(modeNames[mode]);
   
-  Serial.println("Playing: " + String(modeNames[mode]));
+  logEvent(EV_PLAY_START, mode);
 }
 
 void playSequence(int mode) {
@@ -348,24 +401,57 @@ void playSequence(int mode) {
     return;
   }
   
-  TeachStep step = sequences[mode].steps[teachIndex];
+  TeachStep &step = sequences[mode].steps[teachIndex];
+  unsigned long now = millis();
   
-  // Move all 7 servos
-  for(int i = 0; i < 7; i++) {
-    pwm.setPWM(i, 0, step.servoPos[i]);
+  // Apply the step once when the index changes
+  if (teachIndex != lastStepIndex) {
+    // Move all 7 servos
+    for(int i = 0; i < 7; i++) {
+      pwm.setPWM(i, 0, step.servoPos[i]);
+    }
+    
+    // Move motors
+    moveMotors(step.motorL, step.motorR);
+    showPlayStep(mode);
+    
+    stepStartTime = now;
+    lastStepIndex = teachIndex;
   }
   
-  // Move motors
-  moveMotors(step.motorL, step.motorR);
-  
+  if (now - stepStartTime >= (unsigned long)step.duration) {
+    teachIndex++;
+  }
+}
+
+void showPlayStep(int mode) {
   lcd.setCursor(0, 1);
   lcd.print("Step: ");
   lcd.print(teachIndex + 1);
   lcd.print("/");
   lcd.print(sequences[mode].stepCount);
+  lcd.print("     ");
+}
+
+// Obstacle: freeze the step clock. Drive is open loop, so the time left in
+// the step is the distance left; resuming re-applies the step's motor speeds
+// for exactly that remaining time.
+void pausePlayback() {
+  if (!isPlaying || playPaused || lastStepIndex < 0) return;
+  playPaused = true;
+  pausedAt = millis();
+}
+
+void resumePlayback() {
+  if (!playPaused) return;
+  playPaused = false;
+  if (!isPlaying || currentMode < 0) return;  // stopped while paused
   
-  delay(step.duration);
-  teachIndex++;
+  stepStartTime += millis() - pausedAt;
+  TeachStep &step = sequences[currentMode].steps[lastStepIndex];
+  moveMotors(step.motorL, step.motorR);
+  setLED('G');
+  showPlayStep(currentMode);
 }
 
 void checkSchedule() {
@@ -484,7 +570,7 @@ void saveSequences() {
     addr += sizeof(TeachSequence);
   }
   EEPROM.commit();
-  Serial.println("Sequences saved to EEPROM");
+  logEvent(EV_SEQ_SAVED);
 }
 
 void loadSequences() {
@@ -493,7 +579,118 @@ void loadSequences() {
     EEPROM.get(addr, sequences[i]);
     addr += sizeof(TeachSequence);
   }
-  Serial.println("Sequences loaded from EEPROM");
+  logEvent(EV_SEQ_LOADED);
+}
+
+// Called once at boot, before anything logs.
+void logBegin() {
+  esp_reset_reason_t reason = esp_reset_reason();
+  
+  if (logMagic != LOG_MAGIC || reason == ESP_RST_POWERON) {
+    // RTC memory holds garbage after power-on: start an empty ring
+    memset(logRing, 0, sizeof(logRing));
+    logMagic = LOG_MAGIC;
+    logBootCount = 0;
+    logHead = 0;
+  } else {
+    // Warm reset: keep the previous boot's records and continue numbering
+    logBootCount++;
+    for(int i = 0; i < LOG_RING_SIZE; i++) {
+      if (logRing[i].seq > logHead) logHead = logRing[i].seq;
+    }
+  }
+  logBootHead = logHead;
+  
+  // Drain on core 0, below the WiFi stack and next to the idle task
+  xTaskCreatePinnedToCore(logDrainTask, "logDrain", 3072, NULL, 1, NULL, 0);
+  logEvent(EV_BOOT, reason, logBootCount);
+}
+
+// Lock-free, never blocks: safe from loop(), other tasks and ISRs.
+// When the drain falls behind the oldest records are overwritten.
+void IRAM_ATTR logEvent(uint8_t id, int16_t a0, int16_t a1, int16_t a2, int16_t a3, int16_t a4) {
+  uint32_t idx = __atomic_fetch_add(&logHead, 1, __ATOMIC_RELAXED);
+  LogRecord &r = logRing[idx & LOG_RING_MASK];
+  
+  __atomic_store_n(&r.seq, 0, __ATOMIC_RELEASE);
+  r.ms = millis();
+  r.id = id;
+  r.boot = logBootCount;
+  r.arg[0] = a0;
+  r.arg[1] = a1;
+  r.arg[2] = a2;
+  r.arg[3] = a3;
+  r.arg[4] = a4;
+  __atomic_store_n(&r.seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+// Commands are packed as raw text (up to 10 chars) into the args
+void logCommand(const String &cmd) {
+  int16_t a[5] = {0, 0, 0, 0, 0};
+  memcpy(a, cmd.c_str(), min((unsigned int)sizeof(a), cmd.length()));
+  logEvent(EV_CMD, a[0], a[1], a[2], a[3], a[4]);
+}
+
+// Frame: sync1 sync2 <20 byte record> xor-checksum
+void logWriteFrame(const LogRecord &r) {
+  uint8_t frame[sizeof(LogRecord) + 3];
+  frame[0] = LOG_SYNC1;
+  frame[1] = LOG_SYNC2;
+  memcpy(&frame[2], &r, sizeof(LogRecord));
+  
+  uint8_t sum = 0;
+  for(unsigned int i = 2; i < sizeof(LogRecord) + 2; i++) sum ^= frame[i];
+  frame[sizeof(LogRecord) + 2] = sum;
+  
+  Serial.write(frame, sizeof(frame));
+}
+
+void logDrainTask(void* arg) {
+  // Start with whatever the previous boot left in RTC memory
+  uint32_t tail = logBootHead > LOG_RING_SIZE ? logBootHead - LOG_RING_SIZE : 0;
+  uint32_t lost = 0;
+  
+  for(;;) {
+    uint32_t head = __atomic_load_n(&logHead, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+      vTaskDelay(pdMS_TO_TICKS(20));
+      continue;
+    }
+    if (head - tail > LOG_RING_SIZE) {
+      lost += head - tail - LOG_RING_SIZE;
+      tail = head - LOG_RING_SIZE;
+    }
+    
+    LogRecord &slot = logRing[tail & LOG_RING_MASK];
+    uint32_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+    
+    if (seq != tail + 1) {
+      // Slot reserved but not finished yet: give the writer time
+      if (tail >= logBootHead && (int32_t)(seq - (tail + 1)) < 0) {
+        vTaskDelay(1);
+        continue;
+      }
+      // Overwritten, or torn by the reset
+      lost++;
+      tail++;
+      continue;
+    }
+    
+    LogRecord copy = slot;
+    if (__atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE) != seq) {
+      lost++;  // overwritten while copying
+      tail++;
+      continue;
+    }
+    
+    if (lost > 0) {
+      LogRecord note = {0, copy.ms, EV_LOG_LOST, copy.boot, {(int16_t)min(lost, (uint32_t)INT16_MAX), 0, 0, 0, 0}};
+      logWriteFrame(note);
+      lost = 0;
+    }
+    logWriteFrame(copy);
+    tail++;
+  }
 }
 
 
@@ -569,6 +766,22 @@ int sequenceLength = 0;
 bool isTraining = false;
 bool isPlaying = false;
 
+// Playback state (advanced from loop(), never blocks the web server)
+int playIndex = 0;
+int lastPlayIndex = -1;
+unsigned long frameStartTime = 0;
+int interruptedIndex = -1;  // where STOP hit, -1 = unknown / finished
+
+// Transition into the sequence (from wherever the arm is)
+#define TRANSITION_DEG_PER_SEC 60  // slowest joint sets the pace, MG996R safe
+#define TRANSITION_TICK_MS 20      // one servo period
+bool isTransitioning = false;
+int transitionFrom[6];
+int transitionTarget = 0;
+unsigned long transitionStart = 0;
+unsigned long transitionMs = 0;
+unsigned long lastTransitionTick = 0;
+
 int angleToPulse(int angle, int minPulse, int maxPulse) {
   angle = constrain(angle, 0, 180);
   return map(angle, 0, 180, minPulse, maxPulse);
@@ -625,28 +838,136 @@ void loadSequence() {
   Serial.println("✅ Sequence loaded: " + String(sequenceLength) + " positions");
 }
 
-void playSequence() {
-  if(sequenceLength == 0) return;
+// Largest joint move from the current arm state to a stored position
+int poseDistance(int index, int* sum) {
+  int maxDelta = 0;
+  *sum = 0;
+  for(int j = 0; j < 6; j++) {
+    int d = abs(trainedSequence[index].angles[j] - servos[j].angle);
+    maxDelta = max(maxDelta, d);
+    *sum += d;
+  }
+  return maxDelta;
+}
+
+// Nearest stored position in joint space. The largest joint delta decides
+// how long the transition takes, so rank by that (ties: total motion).
+// A linear scan is all 50 positions x 6 joints need.
+// After a STOP only positions from the interrupted one onward are considered,
+// so a pose repeated at the start/end of a sequence can't skip the mission.
+int findNearestPosition() {
+  int first = interruptedIndex > 0 ? interruptedIndex - 1 : 0;
+  int best = first;
+  int bestMax = 1000, bestSum = 0;
+  
+  for(int i = first; i < sequenceLength; i++) {
+    int sum;
+    int maxDelta = poseDistance(i, &sum);
+    if(maxDelta < bestMax || (maxDelta == bestMax && sum < bestSum)) {
+      best = i;
+      bestMax = maxDelta;
+      bestSum = sum;
+    }
+  }
+  return best;
+}
+
+// Velocity-limited move into position 'index', then normal playback from there
+void startTransition(int index) {
+  int sum;
+  int maxDelta = poseDistance(index, &sum);
   
+  for(int j = 0; j < 6; j++) {
+    transitionFrom[j] = servos[j].angle;
+  }
+  transitionTarget = index;
+  transitionMs = (unsigned long)maxDelta * 1000 / TRANSITION_DEG_PER_SEC;
+  transitionStart = millis();
+  lastTransitionTick = 0;
+  isTransitioning = true;
+  
+  playIndex = index;
+  lastPlayIndex = -1;
   isPlaying = true;
+}
+
+void startPlayback() {
+  if(sequenceLength == 0) return;
+  
+  interruptedIndex = -1;
+  startTransition(0);
   Serial.println("▶️ Playing sequence...");
+}
+
+// Continue from the stored position closest to where the arm is now
+void resumePlayback() {
+  if(sequenceLength == 0) return;
+  if(interruptedIndex >= sequenceLength) interruptedIndex = -1;
   
-  for(int i = 0; i < sequenceLength && isPlaying; i++) {
-    // Move all servos to position
+  int index = findNearestPosition();
+  startTransition(index);
+  Serial.println("⏯️ Resuming at position " + String(index + 1) + " (" + String(transitionMs) + " ms transition)");
+}
+
+void stopPlayback() {
+  if(!isPlaying) return;
+  isPlaying = false;
+  isTransitioning = false;
+  interruptedIndex = playIndex;
+  Serial.println("⏹️ Playback stopped at position " + String(playIndex + 1));
+}
+
+// Interpolate all joints so they arrive together
+void handleTransition(unsigned long now) {
+  if(now - lastTransitionTick < TRANSITION_TICK_MS) return;
+  lastTransitionTick = now;
+  
+  unsigned long elapsed = now - transitionStart;
+  if(elapsed >= transitionMs) {
+    isTransitioning = false;  // frame gets applied exactly by handlePlayback()
+    return;
+  }
+  
+  for(int j = 0; j < 6; j++) {
+    int target = trainedSequence[transitionTarget].angles[j];
+    int angle = transitionFrom[j] + (long)(target - transitionFrom[j]) * (long)elapsed / (long)transitionMs;
+    moveServo(j, angle);
+  }
+}
+
+// Playback step (called in loop)
+void handlePlayback() {
+  if(!isPlaying) return;
+  
+  unsigned long now = millis();
+  
+  if(isTransitioning) {
+    handleTransition(now);
+    if(isTransitioning) return;
+  }
+  
+  // Apply position once when index changes
+  if(playIndex != lastPlayIndex) {
     for(int j = 0; j < 6; j++) {
-      moveServo(j, trainedSequence[i].angles[j]);
+      moveServo(j, trainedSequence[playIndex].angles[j]);
     }
+    frameStartTime = now;
+    lastPlayIndex = playIndex;
     
     Serial.print("Position ");
-    Serial.print(i + 1);
+    Serial.print(playIndex + 1);
     Serial.print("/");
     Serial.println(sequenceLength);
-    
-    delay(trainedSequence[i].delayTime);
   }
   
-  isPlaying = false;
-  Serial.println("✅ Playback complete!");
+  if(now - frameStartTime >= (unsigned long)trainedSequence[playIndex].delayTime) {
+    playIndex++;
+    if(playIndex >= sequenceLength) {
+      isPlaying = false;
+      interruptedIndex = -1;
+      Serial.println("✅ Playback complete!");
+    }
+  }
 }
 
 String getHTML() {
@@ -686,7 +1007,7 @@ String getHTML() {
   // Info panel
   html += "<div class='info'>";
   html += "<strong>Saved Positions:</strong> " + String(sequenceLength) + "/" + String(MAX_POSITIONS);
-  html += "<br><strong>Status:</strong> " + String(isPlaying ? "Playing ▶️" : isTraining ? "Training 📝" : "Ready ✓");
+  html += "<br><strong>Status:</strong> <span id='status'>" + String(isPlaying ? "Playing ▶️" : isTraining ? "Training 📝" : "Ready ✓") + "</span>";
   html += "</div>";
   
   // Servo controls
@@ -705,6 +1026,7 @@ String getHTML() {
   html += "<button onclick='stopAll()'>⛔ STOP</button>";
   html += "<button class='train-btn' onclick='capturePosition()'>📸 CAPTURE</button>";
   html += "<button onclick='playSequence()'>▶️ PLAY</button>";
+  html += "<button onclick='resumeSequence()'>⏯️ RESUME</button>";
   html += "<button onclick='saveSequence()'>💾 SAVE</button>";
   html += "<button onclick='loadSequence()'>📂 LOAD</button>";
   html += "<button class='danger' onclick='clearSequence()'>🗑️ CLEAR</button>";
@@ -720,10 +1042,14 @@ String getHTML() {
   html += "function home(){fetch('/home').then(()=>location.reload());}";
   html += "function stopAll(){fetch('/stop').then(()=>location.reload());}";
   html += "function capturePosition(){fetch('/capture').then(r=>r.text()).then(t=>alert(t));}";
-  html += "function playSequence(){if(confirm('Play sequence?')){fetch('/play');alert('Playing...');}}";
+  html += "function playSequence(){if(confirm('Play sequence?')){fetch('/play');}}";
+  html += "function resumeSequence(){fetch('/resume');}";
   html += "function saveSequence(){fetch('/save').then(()=>alert('Saved!'));}";
   html += "function loadSequence(){fetch('/load').then(()=>location.reload());}";
   html += "function clearSequence(){if(confirm('Clear all positions?')){fetch('/clear').then(()=>location.reload());}}";
+  html += "setInterval(()=>fetch('/status').then(r=>r.json()).then(s=>{";
+  html += "document.getElementById('status').innerText=s.playing?'Playing ▶️ '+(s.position+1)+'/'+s.length:s.training?'Training 📝':'Ready ✓';";
+  html += "}),1000);";
   html += "</script></body></html>";
   
   return html;
@@ -756,7 +1082,7 @@ void handleHome() {
 }
 
 void handleStop() {
-  isPlaying = false;
+  stopPlayback();
   for(int i = 0; i < 16; i++) {
     pca.setPWM(i, 0, 0);
   }
@@ -778,23 +1104,54 @@ void handleCapture() {
   server.send(200, "text/plain", "Position " + String(sequenceLength) + " captured!");
 }
 
+// Returns immediately, loop() runs the sequence
 void handlePlay() {
-  playSequence();
+  if(sequenceLength == 0) {
+    server.send(400, "text/plain", "No positions captured!");
+    return;
+  }
+  startPlayback();
   server.send(200, "text/plain", "OK");
 }
 
+// Continue an interrupted sequence from the nearest position
+void handleResume() {
+  if(sequenceLength == 0) {
+    server.send(400, "text/plain", "No positions captured!");
+    return;
+  }
+  resumePlayback();
+  server.send(200, "text/plain", "Resuming at position " + String(playIndex + 1));
+}
+
+// Playback progress for the UI / scripts
+void handleStatus() {
+  String json = "{\"playing\":" + String(isPlaying ? "true" : "false");
+  json += ",\"training\":" + String(isTraining ? "true" : "false");
+  json += ",\"position\":" + String(playIndex);
+  json += ",\"length\":" + String(sequenceLength);
+  json += ",\"resuming\":" + String(isTransitioning ? "true" : "false");
+  json += ",\"elapsedMs\":" + String(isPlaying && !isTransitioning ? millis() - frameStartTime : 0);
+  json += "}";
+  server.send(200, "application/json", json);
+}
+
 void handleSave() {
   saveSequence();
   server.send(200, "text/plain", "OK");
 }
 
 void handleLoad() {
+  stopPlayback();
   loadSequence();
+  interruptedIndex = -1;
   server.send(200, "text/plain", "OK");
 }
 
 void handleClear() {
+  stopPlayback();
   sequenceLength = 0;
+  interruptedIndex = -1;
   preferences.begin("robotarm", false);
   preferences.clear();
   preferences.end();
@@ -857,6 +1214,8 @@ void setup() {
   server.on("/save", handleSave);
   server.on("/load", handleLoad);
   server.on("/clear", handleClear);
+  server.on("/status", handleStatus);
+  server.on("/resume", handleResume);
   
   server.begin();
   Serial.println("🌐 Web server started!");
@@ -866,4 +1225,5 @@ void setup() {
 
 void loop() {
   server.handleClient();
+  handlePlayback();
 }
\ No newline at end of file
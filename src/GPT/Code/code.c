@@ -4,6 +4,7 @@
 #include <Adafruit_PWMServoDriver.h>
 #include <RTClib.h>
 #include <LiquidCrystal_I2C.h>
+#include <Preferences.h>
 
 // ========== WiFi ==========
 const char* ssid     = "HEBA_Robot";
@@ -23,6 +24,7 @@ WebServer server(80);
 #define TRIG 5
 #define ECHO 18
 #define OBSTACLE_CM 25
+#define CLEAR_CM    30   // resume only once clearly past the threshold (no stop/go chatter)
 
 // ========== LEDs ==========
 #define LED_YELLOW 2
@@ -36,6 +38,7 @@ WebServer server(80);
 Adafruit_PWMServoDriver pca = Adafruit_PWMServoDriver(0x40);  // PCA9685 default
 RTC_DS3231 rtc;
 LiquidCrystal_I2C lcd(0x27, 16, 2);   // change to 0x3F if needed
+Preferences prefs;
 
 // Servo channels on PCA9685
 // 3× MG995
@@ -53,6 +56,16 @@ LiquidCrystal_I2C lcd(0x27, 16, 2);   // change to 0x3F if needed
 #define SERVO_MIN  120
 #define SERVO_MAX  600
 
+// Each channel's pulse starts at a different point of the 20 ms PCA9685
+// period (ON count) instead of all at count 0, so the 7 servos never draw
+// their pulse current at the same instant.
+#define PCA_COUNTS        4096
+#define SERVO_PHASE_STEP  (PCA_COUNTS / NUM_SERVOS)
+
+// Servo rail current budget (buck converter, see GPT/Diagram/battery_connection_diagram.md)
+#define SERVO_BUDGET_MA   2500   // rated 3 A, keep margin for ESP32 + LCD + sensors
+#define SERVO_SETTLE_MS   40     // extra time a joint draws after it should have arrived
+
 // Wiper timing (approx full cycle ~4s)
 #define WIPER_STEP_DEG        3
 #define WIPER_MIN_ANGLE       0
@@ -108,6 +121,12 @@ int           playIndex      = 0;
 int           lastFrameIndex = -1;
 unsigned long frameStartTime = 0;
 
+// Obstacle pause: frame/wait clocks and drive speeds are frozen, not lost
+bool          playbackPaused = false;
+unsigned long pausedAt       = 0;
+int16_t       pausedLeft     = 0;
+int16_t       pausedRight    = 0;
+
 // RTC scheduling
 int lastScheduleMinute = -1;
 
@@ -115,17 +134,141 @@ int lastScheduleMinute = -1;
 int           wiperAngle      = WIPER_MIN_ANGLE;
 int           wiperDir        = +1;   // +1 up, -1 down
 unsigned long lastWiperUpdate = 0;
+int16_t       wiperOverride   = -1;   // -1 auto (sweep in cleaning), 0..180 hold, WIPER_SWEEP always
+
+// Last ultrasonic reading (updated by checkObstacle)
+long lastDistanceCm = 400;
+
+// ========== Mission bytecode ==========
+// Compiled on the PC by src/tools/heba_mission.py, little-endian operands.
+// Keep the opcodes in sync with OPS in heba_mission.py.
+#define MISSION_VERSION   1
+#define MAX_MISSION_BYTES 256
+#define MISSION_SLOTS     4     // clean, water, med, garbage (same order as schedule)
+#define MISSION_MAX_DEPTH 4     // nested repeat blocks
+#define MISSION_OPS_PER_TICK 32
+#define WIPER_SWEEP       255
+
+enum MissionOp {
+  OP_END        = 0x00,  //
+  OP_POSE       = 0x01,  // a0..a5 (u8)        set arm pose
+  OP_DRIVE      = 0x02,  // l, r (i16), ms      set motors and hold for ms
+  OP_WAIT       = 0x03,  // ms (u16)
+  OP_WAIT_CLEAR = 0x04,  // cm (u8), ms (u16)   wait until path clear, 0 ms = forever
+  OP_REPEAT     = 0x05,  // n (u8)              repeat block up to OP_LOOP n times
+  OP_LOOP       = 0x06,  //
+  OP_WIPER      = 0x07,  // angle (u8)          WIPER_SWEEP = sweep, else hold angle
+  OP_SERVO      = 0x08   // ch, angle (u8)
+};
+
+uint8_t   missionProg[MISSION_SLOTS][MAX_MISSION_BYTES];
+uint16_t  missionLen[MISSION_SLOTS] = {0, 0, 0, 0};
+RobotMode missionModes[MISSION_SLOTS] = {MODE_CLEANING, MODE_WATER, MODE_MEDICINE, MODE_GARBAGE};
+
+// Interpreter state
+bool          missionRunning   = false;
+const uint8_t* missionCode     = nullptr;
+uint16_t      missionPc        = 0;
+uint8_t       missionWaitOp    = OP_END;  // op we are blocked on, OP_END = none
+uint8_t       missionClearCm   = 0;
+uint16_t      missionWaitMs    = 0;
+unsigned long missionWaitStart = 0;
+uint16_t      missionLoopPc[MISSION_MAX_DEPTH];
+uint8_t       missionLoopLeft[MISSION_MAX_DEPTH];
+uint8_t       missionDepth     = 0;
+
+// ========== Current-budget motion scheduler ==========
+// A servo draws its big current while it is moving (stall current at the
+// start), and only a small holding current once it has arrived. New
+// targets are queued and joints are started, heaviest first, only while
+// the estimated sum stays inside the budget. The rest start a few ms later
+// as earlier joints arrive. Every joint still moves at full speed.
+struct ServoPower {
+  uint16_t moveMa;     // while moving (start peak)
+  uint16_t holdMa;     // holding position
+  uint16_t degPerSec;  // no-load speed at 5 V
+};
+
+const ServoPower servoPower[NUM_SERVOS] = {
+  {1400, 150, 300},   // base      MG995
+  {1400, 150, 300},   // waist     MG995
+  {1400, 150, 300},   // arm2      MG995
+  { 650,  60, 600},   // end arm2  SG90
+  { 650,  60, 600},   // arm3      SG90
+  { 650,  60, 600},   // holder    SG90
+  { 650,  60, 600}    // wiper     SG90
+};
+
+uint16_t      servoBudgetMa = SERVO_BUDGET_MA;
+uint8_t       outputAngle[NUM_SERVOS];        // last angle written to the PCA
+bool          outputValid[NUM_SERVOS] = {false, false, false, false, false, false, false};
+bool          movePending[NUM_SERVOS] = {false, false, false, false, false, false, false};
+unsigned long moveEndsAt[NUM_SERVOS];
 
 // ========== Utility: map angle to PCA pulse ==========
 uint16_t angleToPulse(uint8_t angle) {
   return map(angle, 0, 180, SERVO_MIN, SERVO_MAX);
 }
 
-void setServo(uint8_t ch, uint8_t angle) {
+void writeServo(uint8_t ch, uint8_t angle) {
+  uint16_t on = ch * SERVO_PHASE_STEP;
+  uint16_t pulse = angleToPulse(angle);
+  pca.setPWM(ch, on, (on + pulse) % PCA_COUNTS);   // wraps past the period end
+}
+
+// Estimated servo rail current right now
+uint16_t servoCurrentMa(unsigned long now) {
+  uint16_t ma = 0;
+  for (int ch=0; ch<NUM_SERVOS; ch++) {
+    if (!outputValid[ch]) continue;
+    bool moving = (long)(moveEndsAt[ch] - now) > 0;
+    ma += moving ? servoPower[ch].moveMa : servoPower[ch].holdMa;
+  }
+  return ma;
+}
+
+// Start as many queued moves as the budget allows (called in loop and on every request)
+void updateMotionScheduler() {
+  unsigned long now = millis();
+  uint16_t used = servoCurrentMa(now);
+
+  for (;;) {
+    // heaviest pending joint first
+    int next = -1;
+    for (int ch=0; ch<NUM_SERVOS; ch++) {
+      if (movePending[ch] && (next < 0 || servoPower[ch].moveMa > servoPower[next].moveMa)) next = ch;
+    }
+    if (next < 0) return;
+
+    uint16_t extra = servoPower[next].moveMa - (outputValid[next] ? servoPower[next].holdMa : 0);
+    bool nothingMoving = true;
+    for (int ch=0; ch<NUM_SERVOS; ch++) {
+      if (outputValid[ch] && (long)(moveEndsAt[ch] - now) > 0) nothingMoving = false;
+    }
+    // A joint bigger than the whole budget still has to move eventually
+    if (used + extra > servoBudgetMa && !nothingMoving) return;
+
+    uint8_t target = currentServoAngles[next];
+    int delta = outputValid[next] ? abs((int)target - (int)outputAngle[next]) : 180;
+    writeServo(next, target);
+    outputAngle[next] = target;
+    outputValid[next] = true;
+    movePending[next] = false;
+    moveEndsAt[next]  = now + (unsigned long)delta * 1000 / servoPower[next].degPerSec + SERVO_SETTLE_MS;
+    used += extra;
+  }
+}
+
+// Queue a target without starting it (use for whole poses, then schedule once)
+void queueServo(uint8_t ch, uint8_t angle) {
   if (ch >= NUM_SERVOS) return;
   currentServoAngles[ch] = angle;
-  uint16_t pulse = angleToPulse(angle);
-  pca.setPWM(ch, 0, pulse);
+  movePending[ch] = !outputValid[ch] || outputAngle[ch] != angle;
+}
+
+void setServo(uint8_t ch, uint8_t angle) {
+  queueServo(ch, angle);
+  updateMotionScheduler();
 }
 
 // ========== Motors control ==========
@@ -299,6 +442,9 @@ void initDemoCleaningSequence() {
 // ========== Start playing a sequence ==========
 void startPlay(Pose* seq, int len, RobotMode mode) {
   if (len <= 0) return;
+  missionRunning = false;
+  wiperOverride  = -1;
+  playbackPaused = false;
   playSeq        = seq;
   playLen        = len;
   playIndex      = 0;
@@ -312,6 +458,7 @@ void startPlay(Pose* seq, int len, RobotMode mode) {
 // ========== Playback step (called in loop) ==========
 void handlePlayback() {
   if (!playing || playSeq == nullptr || playLen == 0) return;
+  if (playbackPaused) return;
 
   unsigned long now = millis();
   Pose &cur = playSeq[playIndex];
@@ -319,7 +466,8 @@ void handlePlayback() {
   // Apply current frame once when index changes
   if (playIndex != lastFrameIndex) {
     for (int i=0;i<NUM_ARM_SERVOS;i++)
-      setServo(i, cur.servo[i]);   // 0..5 arm only
+      queueServo(i, cur.servo[i]);   // 0..5 arm only
+    updateMotionScheduler();
     setMotors(cur.leftSpeed, cur.rightSpeed);
     frameStartTime = now;
     lastFrameIndex = playIndex;
@@ -340,10 +488,207 @@ void handlePlayback() {
   }
 }
 
+// ========== Mission interpreter (called in loop) ==========
+uint8_t missionOpSize(uint8_t op) {
+  switch (op) {
+    case OP_END:        return 1;
+    case OP_POSE:       return 1 + NUM_ARM_SERVOS;
+    case OP_DRIVE:      return 7;
+    case OP_WAIT:       return 3;
+    case OP_WAIT_CLEAR: return 4;
+    case OP_REPEAT:     return 2;
+    case OP_LOOP:       return 1;
+    case OP_WIPER:      return 2;
+    case OP_SERVO:      return 3;
+  }
+  return 0;  // unknown
+}
+
+// Checked once on upload so the interpreter can trust the program
+bool verifyMission(const uint8_t* code, uint16_t len) {
+  if (len < 2 || code[0] != MISSION_VERSION) return false;
+  int depth = 0;
+  uint16_t pc = 1;
+  while (pc < len) {
+    uint8_t op = code[pc];
+    uint8_t size = missionOpSize(op);
+    if (size == 0 || pc + size > len) return false;
+    if (op == OP_REPEAT) {
+      if (code[pc + 1] == 0 || ++depth > MISSION_MAX_DEPTH) return false;
+    } else if (op == OP_LOOP) {
+      if (--depth < 0) return false;
+    } else if (op == OP_POSE) {
+      for (int i=0;i<NUM_ARM_SERVOS;i++) if (code[pc + 1 + i] > 180) return false;
+    } else if (op == OP_SERVO) {
+      if (code[pc + 1] >= NUM_SERVOS || code[pc + 2] > 180) return false;
+    } else if (op == OP_END) {
+      return depth == 0;
+    }
+    pc += size;
+  }
+  return false;  // no OP_END
+}
+
+int16_t readI16(const uint8_t* p) { return (int16_t)(p[0] | (p[1] << 8)); }
+uint16_t readU16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+
+void startMission(int slot, RobotMode mode) {
+  if (missionLen[slot] == 0) return;
+  playing          = false;   // frame playback and missions never overlap
+  missionCode      = missionProg[slot];
+  missionPc        = 1;       // skip version byte
+  missionWaitOp    = OP_END;
+  missionDepth     = 0;
+  missionRunning   = true;
+  playbackPaused   = false;
+  currentMode      = mode;
+  updateLEDs();
+}
+
+void stopMission() {
+  missionRunning = false;
+  missionCode    = nullptr;
+  wiperOverride  = -1;
+  stopMotors();
+  currentMode = MODE_IDLE;
+  updateLEDs();
+}
+
+// Runs ops until one of them has to wait, at most MISSION_OPS_PER_TICK per call
+void runMission() {
+  if (!missionRunning) return;
+  // Timed ops are frozen while paused; wait-until-clear keeps its own timeout
+  if (playbackPaused && missionWaitOp != OP_WAIT_CLEAR) return;
+
+  unsigned long now = millis();
+
+  if (missionWaitOp == OP_WAIT_CLEAR) {
+    bool clear   = currentMode != MODE_OBSTACLE_STOP && lastDistanceCm > missionClearCm;
+    bool timeout = missionWaitMs > 0 && now - missionWaitStart >= missionWaitMs;
+    if (!clear && !timeout) return;
+    missionWaitOp = OP_END;
+  } else if (missionWaitOp != OP_END) {
+    if (now - missionWaitStart < missionWaitMs) return;
+    missionWaitOp = OP_END;
+  }
+
+  // Don't start new moves into an obstacle
+  if (currentMode == MODE_OBSTACLE_STOP) return;
+
+  for (int n = 0; n < MISSION_OPS_PER_TICK; n++) {
+    const uint8_t* ip = &missionCode[missionPc];
+    uint8_t op = ip[0];
+    missionPc += missionOpSize(op);
+
+    switch (op) {
+      case OP_END:
+        stopMission();
+        return;
+
+      case OP_POSE:
+        for (int i=0;i<NUM_ARM_SERVOS;i++) queueServo(i, ip[1 + i]);
+        updateMotionScheduler();
+        break;
+
+      case OP_DRIVE:
+        setMotors(readI16(&ip[1]), readI16(&ip[3]));
+        missionWaitOp    = OP_DRIVE;
+        missionWaitMs    = readU16(&ip[5]);
+        missionWaitStart = now;
+        return;
+
+      case OP_WAIT:
+        missionWaitOp    = OP_WAIT;
+        missionWaitMs    = readU16(&ip[1]);
+        missionWaitStart = now;
+        return;
+
+      case OP_WAIT_CLEAR:
+        missionWaitOp    = OP_WAIT_CLEAR;
+        missionClearCm   = ip[1];
+        missionWaitMs    = readU16(&ip[2]);
+        missionWaitStart = now;
+        return;
+
+      case OP_REPEAT:
+        missionLoopPc[missionDepth]   = missionPc;
+        missionLoopLeft[missionDepth] = ip[1];
+        missionDepth++;
+        break;
+
+      case OP_LOOP:
+        if (--missionLoopLeft[missionDepth - 1] > 0) {
+          missionPc = missionLoopPc[missionDepth - 1];
+        } else {
+          missionDepth--;
+        }
+        break;
+
+      case OP_WIPER:
+        wiperOverride = ip[1];
+        if (wiperOverride != WIPER_SWEEP) {
+          wiperAngle = constrain(wiperOverride, WIPER_MIN_ANGLE, WIPER_MAX_ANGLE);
+          setServo(SERVO_WIPER, wiperAngle);
+        }
+        break;
+
+      case OP_SERVO:
+        setServo(ip[1], ip[2]);
+        break;
+    }
+  }
+}
+
+// "clean"/"water"/"med"/"garbage" -> slot, -1 if unknown
+int missionSlot(const String &mode) {
+  if (mode == "clean")   return 0;
+  if (mode == "water")   return 1;
+  if (mode == "med")     return 2;
+  if (mode == "garbage") return 3;
+  return -1;
+}
+
+// Returns byte count or -1 on bad hex / too long
+int hexToBytes(const String &hex, uint8_t* out, int maxLen) {
+  if (hex.length() % 2 != 0 || (int)hex.length() / 2 > maxLen) return -1;
+  for (unsigned int i=0; i<hex.length(); i+=2) {
+    char b[3] = {hex[i], hex[i + 1], 0};
+    char* end;
+    out[i / 2] = strtol(b, &end, 16);
+    if (*end != 0) return -1;
+  }
+  return hex.length() / 2;
+}
+
+// ========== Mission storage (NVS) ==========
+void saveMission(int slot) {
+  char key[8];
+  snprintf(key, sizeof(key), "mis%d", slot);
+  prefs.begin("heba", false);
+  if (missionLen[slot] > 0) prefs.putBytes(key, missionProg[slot], missionLen[slot]);
+  else                      prefs.remove(key);
+  prefs.end();
+}
+
+void loadMissions() {
+  prefs.begin("heba", true);
+  for (int slot=0; slot<MISSION_SLOTS; slot++) {
+    char key[8];
+    snprintf(key, sizeof(key), "mis%d", slot);
+    missionLen[slot] = 0;
+    if (!prefs.isKey(key)) continue;
+    size_t len = prefs.getBytes(key, missionProg[slot], MAX_MISSION_BYTES);
+    if (verifyMission(missionProg[slot], len)) missionLen[slot] = len;
+  }
+  prefs.end();
+}
+
 // ========== Continuous wiper update (non-blocking) ==========
 void updateWiper() {
-  // Only run in cleaning mode & not obstacle stop
-  if (currentMode != MODE_CLEANING) return;
+  // Only run in cleaning mode (or when a mission asks for it) & not obstacle stop
+  if (wiperOverride == -1 && currentMode != MODE_CLEANING) return;
+  if (wiperOverride >= 0 && wiperOverride != WIPER_SWEEP) return;
+  if (currentMode == MODE_OBSTACLE_STOP) return;
 
   unsigned long now = millis();
   if (now - lastWiperUpdate < WIPER_STEP_MS) return;
@@ -420,8 +765,16 @@ void handleSave() {
 }
 
 // 4) Play mode once: /play?mode=water
+//    An uploaded mission for the mode takes precedence over taught frames
 void handlePlay() {
   String mode = server.hasArg("mode") ? server.arg("mode") : "";
+  int slot = missionSlot(mode);
+  if (slot >= 0 && missionLen[slot] > 0) {
+    startMission(slot, missionModes[slot]);
+    server.send(200, "text/plain", "Mission triggered");
+    return;
+  }
+
   if (mode == "water") {
     startPlay(waterSeq, waterLen, MODE_WATER);
   } else if (mode == "med") {
@@ -434,6 +787,67 @@ void handlePlay() {
   server.send(200, "text/plain", "Play triggered");
 }
 
+// 5) Mission bytecode: /mission?mode=clean
+//    GET returns hex, POST body = hex from heba_mission.py, &clear=1 deletes
+void handleMission() {
+  int slot = missionSlot(server.hasArg("mode") ? server.arg("mode") : "");
+  if (slot < 0) {
+    server.send(400, "text/plain", "bad mode");
+    return;
+  }
+
+  if (server.hasArg("clear")) {
+    if (missionRunning && missionCode == missionProg[slot]) stopMission();
+    missionLen[slot] = 0;
+    saveMission(slot);
+    server.send(200, "text/plain", "Mission cleared");
+    return;
+  }
+
+  if (server.method() != HTTP_POST) {
+    if (missionLen[slot] == 0) {
+      server.send(404, "text/plain", "no mission");
+      return;
+    }
+    String hex;
+    hex.reserve(missionLen[slot] * 2);
+    for (int i=0;i<missionLen[slot];i++) {
+      char b[3];
+      snprintf(b, sizeof(b), "%02x", missionProg[slot][i]);
+      hex += b;
+    }
+    server.send(200, "text/plain", hex);
+    return;
+  }
+
+  String body = server.arg("plain");
+  body.trim();
+  uint8_t code[MAX_MISSION_BYTES];
+  int len = hexToBytes(body, code, sizeof(code));
+  if (len < 0 || !verifyMission(code, len)) {
+    server.send(400, "text/plain", "bad mission");
+    return;
+  }
+  if (missionRunning && missionCode == missionProg[slot]) stopMission();
+  memcpy(missionProg[slot], code, len);
+  missionLen[slot] = len;
+  saveMission(slot);
+  server.send(200, "text/plain", "Mission stored (" + String(len) + " bytes)");
+}
+
+// 6) Servo power: /power[?budget=mA]
+void handlePower() {
+  if (server.hasArg("budget")) {
+    servoBudgetMa = constrain(server.arg("budget").toInt(), 500, 10000);
+  }
+  int pending = 0;
+  for (int ch=0; ch<NUM_SERVOS; ch++) if (movePending[ch]) pending++;
+  String msg = "budget_ma=" + String(servoBudgetMa);
+  msg += " estimate_ma=" + String(servoCurrentMa(millis()));
+  msg += " pending=" + String(pending);
+  server.send(200, "text/plain", msg);
+}
+
 // Root: help text
 void handleRoot() {
   String msg = "HEBA Robot API:\n";
@@ -441,25 +855,56 @@ void handleRoot() {
   msg += "/servo?ch=0-6&ang=0-180\n";
   msg += "/save?mode=water|med|garbage|clean&dur=ms\n";
   msg += "/play?mode=water|med|garbage|clean\n";
+  msg += "/mission?mode=water|med|garbage|clean [POST hex] [&clear=1]\n";
+  msg += "/power?budget=mA\n";
   server.send(200, "text/plain", msg);
 }
 
+// ========== Obstacle pause / resume ==========
+// Open-loop drive: remaining distance == remaining drive time at the same
+// speed, so freezing the clock and restoring the speeds resumes the segment
+// exactly where it stopped.
+void pausePlayback() {
+  if (playbackPaused || (!playing && !missionRunning)) return;
+  playbackPaused = true;
+  pausedAt       = millis();
+  pausedLeft     = currentLeftSpeed;
+  pausedRight    = currentRightSpeed;
+}
+
+void resumePlayback() {
+  if (!playbackPaused) return;
+  playbackPaused = false;
+  if (!playing && !missionRunning) return;   // stopped while paused
+  unsigned long pausedFor = millis() - pausedAt;
+
+  if (playing) {
+    frameStartTime += pausedFor;
+  } else if (missionRunning && missionWaitOp != OP_WAIT_CLEAR) {
+    missionWaitStart += pausedFor;
+  }
+  setMotors(pausedLeft, pausedRight);
+}
+
 // ========== Obstacle logic ==========
 void checkObstacle() {
   long d = getDistanceCm();
+  lastDistanceCm = d;
   if (d < OBSTACLE_CM) {
     if (currentMode != MODE_OBSTACLE_STOP) {
       prevMode = currentMode;
       currentMode = MODE_OBSTACLE_STOP;
+      pausePlayback();
       stopMotors();
       updateLEDs();
       lcd.clear();
       lcd.setCursor(0,0); lcd.print("Obstacle!");
       lcd.setCursor(0,1); lcd.print("Dist: "); lcd.print(d); lcd.print("cm");
     }
-  } else {
+  } else if (d >= CLEAR_CM) {
     if (currentMode == MODE_OBSTACLE_STOP) {
       currentMode = prevMode;
+      resumePlayback();
       updateLEDs();
       updateLCD();
     }
@@ -476,8 +921,10 @@ void handleSchedule() {
 
     int m = minute % 4;
 
-    if (!playing && currentMode != MODE_OBSTACLE_STOP) {
-      if (m == 0 && cleanLen > 0) {
+    if (!playing && !missionRunning && currentMode != MODE_OBSTACLE_STOP) {
+      if (missionLen[m] > 0) {
+        startMission(m, missionModes[m]);
+      } else if (m == 0 && cleanLen > 0) {
         startPlay(cleanSeq, cleanLen, MODE_CLEANING);
       } else if (m == 1 && waterLen > 0) {
         startPlay(waterSeq, waterLen, MODE_WATER);
@@ -550,11 +997,13 @@ void setup() {
   server.on("/servo", handleServo);
   server.on("/save", handleSave);
   server.on("/play", handlePlay);
+  server.on("/mission", handleMission);
+  server.on("/power", handlePower);
   server.begin();
   Serial.println("HTTP server started");
 
-  // Start position (all servos 90 deg)
-  for (int i=0;i<NUM_SERVOS;i++) setServo(i, 90);
+  // Start position (all servos 90 deg, started within the current budget)
+  for (int i=0;i<NUM_SERVOS;i++) queueServo(i, 90);
 
   // Wiper start at 0°
   wiperAngle = WIPER_MIN_ANGLE;
@@ -563,6 +1012,9 @@ void setup() {
   // Hardcoded demo cleaning sequence ready
   initDemoCleaningSequence();
 
+  // Uploaded missions (override the frame sequences when present)
+  loadMissions();
+
   currentMode = MODE_IDLE;
   updateLEDs();
   updateLCD();
@@ -577,6 +1029,8 @@ void loop() {
   checkObstacle();         // obstacle logic
   handleSchedule();        // RTC-based schedules
   handlePlayback();        // play taught sequences
+  runMission();            // or an uploaded mission
+  updateMotionScheduler(); // start queued servo moves within the current budget
   updateWiper();           // continuous wiper (for cleaning mode)
 
   // LCD refresh every ~1s when not obstacle
@@ -0,0 +1,5226 @@
+// ================================================================
+//  HEBA unified firmware
+//
+//  One source for every HEBA build. Pick the hardware with HEBA_BOARD:
+//    HEBA_BOARD_CLASSIC  wiper on ch0 + 6-servo arm on ch1..6, 60 Hz,
+//                        RoboRemo TCP commands, L298N without ENA/ENB PWM
+//                        (was src/CLAUDE/code/code.c)
+//    HEBA_BOARD_ROBOT    6-servo arm on ch0..5 + wiper on ch6, 50 Hz,
+//                        HTTP API, missions, L298N with ENA/ENB PWM
+//                        (was src/GPT/Code/code.c)
+//    HEBA_BOARD_ARM      arm only: 3x MG996R + 3x SG90, 50 Hz, web UI
+//                        (was the "arm only" sketch)
+//
+//  Pins, channels, pulse windows and servo power figures are compile-time
+//  constants (see "Board configuration"), so pulse math and channel lookups
+//  fold into constants. Subsystems a board doesn't have (wiper, chassis,
+//  sonar, LCD, RTC, ...) are compiled out by the HEBA_HAS_* flags.
+//
+//  Serial output (HEBA_SERIAL_BAUD) is the binary flight recorder: read it with
+//    python3 src/tools/heba_log_decode.py /dev/ttyUSB0
+//  or drive the robot over the same port with src/tools/heba_tether.py.
+// ================================================================
+
+#define HEBA_BOARD_CLASSIC 1
+#define HEBA_BOARD_ROBOT   2
+#define HEBA_BOARD_ARM     3
+
+#ifndef HEBA_BOARD
+#define HEBA_BOARD HEBA_BOARD_ROBOT
+#endif
+
+// ========== Subsystems per board ==========
+#if HEBA_BOARD == HEBA_BOARD_CLASSIC
+  #define HEBA_HAS_CHASSIS  1
+  #define HEBA_HAS_WIPER    1
+  #define HEBA_HAS_SONAR    1
+  #define HEBA_HAS_LEDS     1
+  #define HEBA_HAS_LCD      1
+  #define HEBA_HAS_RTC      1
+  #define HEBA_HAS_MISSIONS 1
+  #define HEBA_HAS_ROBOREMO 1
+  #define HEBA_HAS_HTTP     0
+  #define HEBA_HAS_WEB_UI   0
+#elif HEBA_BOARD == HEBA_BOARD_ROBOT
+  #define HEBA_HAS_CHASSIS  1
+  #define HEBA_HAS_WIPER    1
+  #define HEBA_HAS_SONAR    1
+  #define HEBA_HAS_LEDS     1
+  #define HEBA_HAS_LCD      1
+  #define HEBA_HAS_RTC      1
+  #define HEBA_HAS_MISSIONS 1
+  #define HEBA_HAS_ROBOREMO 0
+  #define HEBA_HAS_HTTP     1
+  #define HEBA_HAS_WEB_UI   0
+#elif HEBA_BOARD == HEBA_BOARD_ARM
+  #define HEBA_HAS_CHASSIS  0
+  #define HEBA_HAS_WIPER    0
+  #define HEBA_HAS_SONAR    0
+  #define HEBA_HAS_LEDS     0
+  #define HEBA_HAS_LCD      0
+  #define HEBA_HAS_RTC      0
+  #define HEBA_HAS_MISSIONS 0
+  #define HEBA_HAS_ROBOREMO 0
+  #define HEBA_HAS_HTTP     1
+  #define HEBA_HAS_WEB_UI   1
+#else
+  #error "Unknown HEBA_BOARD"
+#endif
+
+#include <WiFi.h>
+#include <Wire.h>
+#include <Adafruit_PWMServoDriver.h>
+#include <Preferences.h>
+#include <LittleFS.h>
+#include <esp_system.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include <driver/i2c.h>
+#include <soc/gpio_struct.h>
+#include <esp32/rom/gpio.h>
+#include <lwip/sockets.h>
+#include <driver/i2s.h>
+#include <driver/adc.h>
+#include <esp_adc_cal.h>
+#include <soc/syscon_struct.h>
+#include <esp_debug_helpers.h>
+#include <esp_ota_ops.h>
+#include <freertos/xtensa_context.h>
+#include <xtensa/hal.h>
+#if HEBA_HAS_HTTP
+#include <WebServer.h>
+#endif
+#if HEBA_HAS_LCD
+#include <LiquidCrystal_I2C.h>
+#endif
+#if HEBA_HAS_RTC
+#include <RTClib.h>
+#endif
+
+// ========== Servo classes ==========
+// Pulse window in microseconds (0..180 degrees) plus the power model used
+// by the motion scheduler. Counts follow from the calibrated PCA9685 clock
+// at run time, see pcaApplyClock().
+template<uint16_t MinUs, uint16_t MaxUs, uint16_t MoveMa, uint16_t HoldMa, uint16_t DegPerSec>
+struct ServoClass {
+  static constexpr uint16_t minUs     = MinUs;
+  static constexpr uint16_t maxUs     = MaxUs;
+  static constexpr uint16_t moveMa    = MoveMa;     // while moving (start peak)
+  static constexpr uint16_t holdMa    = HoldMa;     // holding position
+  static constexpr uint16_t degPerSec = DegPerSec;  // no-load speed at 5 V
+};
+
+// Joint positions are fixed point all the way from storage to the PCA9685:
+// 0.1 degree steps, 0..POS_MAX. Only writeServo() rounds to counts.
+#define POS_SCALE 10
+#define POS_MAX   (180 * POS_SCALE)
+#define DEG(d)    ((d) * POS_SCALE)
+
+// Logical joint -> PCA9685 channel, servo class, home angle. Hold = the
+// joint carries load (arm against gravity, a gripped object) and stays
+// powered when the robot idles; the others are switched off. Channels are
+// numbered across the chained boards, PCA_CH(board, channel): board n
+// sits at 0x40 + n (address jumpers), so a pan-tilt on a second board is
+// Joint<PCA_CH(1, 0), SG90, 90>.
+#define PCA_CH(board, ch) ((board) * 16 + (ch))
+
+template<uint8_t Channel, class Class, uint8_t Home, bool Hold = false>
+struct Joint {
+  static constexpr uint8_t channel = Channel;
+  static constexpr uint8_t home    = Home;
+  static constexpr bool    hold    = Hold;
+  typedef Class Servo;
+};
+
+// Largest of a list of constants (number of PCA9685 boards in a layout)
+template<uint8_t... V> struct MaxOf;
+template<uint8_t V> struct MaxOf<V> {
+  static constexpr uint8_t value = V;
+};
+template<uint8_t V, uint8_t... R> struct MaxOf<V, R...> {
+  static constexpr uint8_t value = V > MaxOf<R...>::value ? V : MaxOf<R...>::value;
+};
+
+// Joint table of a board, flattened into constant arrays at compile time.
+// Logical joints 0..5 are the arm, a wiper (if any) comes after them.
+template<class... J>
+struct ServoLayout {
+  static constexpr uint8_t  count = sizeof...(J);
+  static constexpr uint8_t  boards = MaxOf<J::channel...>::value / 16 + 1;   // PCA9685s on the bus
+  static constexpr uint8_t  channel[sizeof...(J)]   = {J::channel...};
+  static constexpr int16_t  home[sizeof...(J)]      = {DEG(J::home)...};
+  static constexpr bool     hold[sizeof...(J)]      = {J::hold...};
+  static constexpr uint16_t minUs[sizeof...(J)]     = {J::Servo::minUs...};
+  static constexpr uint16_t maxUs[sizeof...(J)]     = {J::Servo::maxUs...};
+  static constexpr uint16_t moveMa[sizeof...(J)]    = {J::Servo::moveMa...};
+  static constexpr uint16_t holdMa[sizeof...(J)]    = {J::Servo::holdMa...};
+  static constexpr uint16_t degPerSec[sizeof...(J)] = {J::Servo::degPerSec...};
+
+  // Pulse width of a position, in 1/16 us (keeps the 0.1 degree steps)
+  static constexpr uint32_t pulseUs16(uint8_t joint, int16_t pos) {
+    return ((uint32_t)minUs[joint] << 4) +
+           ((uint32_t)(pos < 0 ? 0 : pos > POS_MAX ? POS_MAX : pos) * (maxUs[joint] - minUs[joint]) << 4) / POS_MAX;
+  }
+  // Each joint's pulse starts at its own point of the PCA9685 period, so
+  // the servos never draw their pulse current at the same instant
+  static constexpr uint16_t onCount(uint8_t joint) {
+    return (uint32_t)joint * 4096 / count;
+  }
+};
+
+template<class... J> constexpr uint8_t  ServoLayout<J...>::channel[];
+template<class... J> constexpr int16_t  ServoLayout<J...>::home[];
+template<class... J> constexpr bool     ServoLayout<J...>::hold[];
+template<class... J> constexpr uint16_t ServoLayout<J...>::minUs[];
+template<class... J> constexpr uint16_t ServoLayout<J...>::maxUs[];
+template<class... J> constexpr uint16_t ServoLayout<J...>::moveMa[];
+template<class... J> constexpr uint16_t ServoLayout<J...>::holdMa[];
+template<class... J> constexpr uint16_t ServoLayout<J...>::degPerSec[];
+
+// Pins, -1 = not fitted
+struct PinMap {
+  int8_t sda, scl;
+  int8_t ledGreen, ledRed, ledYellow;
+  int8_t in1, in2, in3, in4, ena, enb;
+  int8_t rtcInt;   // DS3231 INT/SQW (open drain, pulled up on the module)
+  int8_t estop;    // e-stop switch to GND, internal pull-up, trips on the falling edge
+  int8_t vbat;     // pack / buck output through dividers, ADC1 only (GPIO 32..39)
+  int8_t vbuck;
+};
+
+// Ultrasonic sensors (HC-SR04). Opposite directions differ only in bit 0.
+enum SonarDir : uint8_t { DIR_FRONT = 0, DIR_REAR, DIR_LEFT, DIR_RIGHT };
+
+struct SonarPins {
+  int8_t  trig, echo;
+  uint8_t dir;   // SonarDir
+};
+
+// Set HEBA_SONAR_ARRAY to 1 when the rear/left/right sensors are fitted
+#ifndef HEBA_SONAR_ARRAY
+#define HEBA_SONAR_ARRAY 0
+#endif
+
+// Pack divider on GPIO36 (VP). The array's right sensor echoes on that
+// pin, so with the array fitted the monitor is off unless moved elsewhere.
+#ifndef HEBA_VBAT_PIN
+#define HEBA_VBAT_PIN (HEBA_SONAR_ARRAY ? -1 : 36)
+#endif
+
+// ========== Board configuration ==========
+#if HEBA_BOARD == HEBA_BOARD_CLASSIC
+typedef ServoClass<610, 2440, 1400, 150, 300> MG996R;  // counts 150..600 at 60 Hz
+typedef ServoClass<610, 2440,  650,  60, 600> SG90;
+typedef ServoLayout<
+  Joint<1, MG996R, 60>,       // base
+  Joint<2, MG996R, 60, true>, // shoulder
+  Joint<3, MG996R, 60, true>, // elbow
+  Joint<4, SG90,   60>,       // wrist rotate
+  Joint<5, SG90,   60>,       // wrist pitch
+  Joint<6, SG90,   60, true>, // gripper
+  Joint<0, SG90,  120>        // wiper (120 = up)
+> Servos;
+
+constexpr PinMap   kPins        = {21, 22, 25, 33, 32, 26, 27, 14, 12, -1, -1, 39, 17, HEBA_VBAT_PIN, -1};
+constexpr float    kPwmHz       = 60;
+constexpr char     kSsid[]      = "RobotTeach";
+constexpr char     kPassword[]  = "teach1234";
+constexpr char     kBanner[]    = "Ready! 6-Servo";
+constexpr int      kObstacleCm  = 20;
+constexpr int      kClearCm     = 25;
+constexpr uint8_t  kWiperDown   = 0;     // 610 us
+constexpr uint8_t  kWiperUp     = 120;   // 1830 us
+constexpr bool     kWiperSweeps = false; // held down while cleaning
+constexpr uint16_t kTeachStepMs = 1000;
+
+// Firing order alternates opposite sensors, which can't hear each other
+constexpr SonarPins kSonars[] = {
+  {5,  18, DIR_FRONT},
+#if HEBA_SONAR_ARRAY
+  {19, 34, DIR_REAR},
+  {23, 35, DIR_LEFT},
+  {13, 36, DIR_RIGHT},
+#endif
+};
+
+#elif HEBA_BOARD == HEBA_BOARD_ROBOT
+typedef ServoClass<586, 2930, 1400, 150, 300> MG995;   // counts 120..600 at 50 Hz
+typedef ServoClass<586, 2930,  650,  60, 600> SG90;
+typedef ServoLayout<
+  Joint<0, MG995, 90>,        // base
+  Joint<1, MG995, 90, true>,  // waist
+  Joint<2, MG995, 90, true>,  // arm2
+  Joint<3, SG90,  90>,        // end arm2
+  Joint<4, SG90,  90>,        // arm3
+  Joint<5, SG90,  90, true>,  // holder
+  Joint<6, SG90,   0>         // wiper
+> Servos;
+
+constexpr PinMap   kPins        = {21, 22, 4, 16, 2, 26, 27, 32, 33, 14, 25, 39, 17, HEBA_VBAT_PIN, -1};
+constexpr float    kPwmHz       = 50;
+constexpr char     kSsid[]      = "HEBA_Robot";
+constexpr char     kPassword[]  = "12345678";
+constexpr char     kBanner[]    = "HEBA Ready";
+constexpr int      kObstacleCm  = 25;
+constexpr int      kClearCm     = 30;
+constexpr uint8_t  kWiperDown   = 0;
+constexpr uint8_t  kWiperUp     = 0;
+constexpr bool     kWiperSweeps = true;  // continuous sweep while cleaning
+constexpr uint16_t kTeachStepMs = 1500;
+
+// Firing order alternates opposite sensors, which can't hear each other
+constexpr SonarPins kSonars[] = {
+  {5,  18, DIR_FRONT},
+#if HEBA_SONAR_ARRAY
+  {19, 34, DIR_REAR},
+  {23, 35, DIR_LEFT},
+  {13, 36, DIR_RIGHT},
+#endif
+};
+
+#elif HEBA_BOARD == HEBA_BOARD_ARM
+// MG996R window: SET B from the calibration notes (205/307/410 counts)
+typedef ServoClass<1000, 2000, 1400, 150, 300> MG996R;
+typedef ServoClass<732,  2197,  650,  60, 600> SG90;    // counts 150..450
+typedef ServoLayout<
+  Joint<0, MG996R, 90>,       // base
+  Joint<1, MG996R, 90, true>, // shoulder
+  Joint<2, MG996R, 90, true>, // elbow
+  Joint<3, SG90,   90>,       // wrist
+  Joint<4, SG90,   90>,       // rotate
+  Joint<5, SG90,   90, true>  // gripper
+> Servos;
+
+constexpr PinMap   kPins        = {21, 22, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 17, 36, 39};
+constexpr float    kPwmHz       = 50;
+constexpr char     kSsid[]      = "RoboArm_5DOF";
+constexpr char     kPassword[]  = "12345678";
+constexpr uint16_t kTeachStepMs = 1000;
+#endif
+
+#define NUM_SERVOS     Servos::count
+#define NUM_PCA        Servos::boards
+#define NUM_ARM_SERVOS 6
+#define SERVO_WIPER    NUM_ARM_SERVOS   // logical joint, boards with HEBA_HAS_WIPER
+#define PCA_COUNTS     4096
+#define PCA_OSC_HZ     25000000UL   // nominal; real chips run 23..27 MHz, calibrate with /pca
+
+static_assert(NUM_SERVOS >= NUM_ARM_SERVOS, "layout needs the 6 arm joints first");
+static_assert(NUM_SERVOS <= 32, "joint bit masks are 32 bit");
+static_assert(NUM_PCA <= 16, "PCA9685 addresses 0x40..0x4F");
+static_assert(!HEBA_HAS_WIPER || NUM_SERVOS > SERVO_WIPER, "wiper joint missing from layout");
+
+// Servo rail current budget (5 V 3 A buck, see GPT/Diagram/battery_connection_diagram.md)
+#define SERVO_BUDGET_MA 2500   // keep margin for ESP32 + LCD + sensors
+#define SERVO_SETTLE_MS 40     // extra time a joint draws after it should have arrived
+
+// Battery monitor (see batteryTask): 2S Li-ion pack through 100k/33k, buck
+// output through 10k/10k, sampled back to back by the ADC1 DMA (I2S0)
+#define BATT_CELLS            2
+#define BATT_DIV_PACK         (133.0f / 33.0f)
+#define BATT_DIV_BUCK         2.0f
+#define BATT_SAMPLE_HZ        20000   // all channels together
+#define BATT_BLOCK            512     // samples per DMA read, ~26 ms
+#define BATT_SUB              16      // dips: lowest mean of this many samples
+#define BATT_REST_MS          4000    // time constant of the resting voltage
+#define BATT_THROTTLE_CELL_MV 3450    // pack under load, per cell: start throttling...
+#define BATT_FLOOR_CELL_MV    3200    // ...one joint at a time from here
+#define BATT_LOW_CELL_MV      3650    // resting, per cell: throttle half way ahead of time...
+#define BATT_EMPTY_CELL_MV    3400    // ...fully at this
+#define BUCK_THROTTLE_MV      4800    // 5 V rail the same way (the ESP32's LDO
+#define BUCK_FLOOR_MV         4500    // drops out around 4.3 V)
+#define BATT_STAGGER_MS       120     // gap between joint starts at full throttle
+#define BATT_RELEASE          4       // throttle decay per block (of 255), ~1.7 s from full
+
+#if HEBA_HAS_SONAR
+// Ultrasonic array, fired one sensor at a time (see updateSonars)
+#define NUM_SONARS        (sizeof(kSonars) / sizeof(kSonars[0]))
+#define SONAR_MAX_ECHO_US 23500UL   // 4 m round trip, longer echoes count as "nothing"
+#define SONAR_TIMEOUT_US  30000UL   // HC-SR04 gives up after ~38 ms without an echo
+#define SONAR_GUARD_US    6000UL    // after MAX_ECHO: let reflections die down
+#define SONAR_OPPOSITE_US 1000UL    // opposite sensor: only wait for the echo pin to settle
+#define SONAR_NO_ECHO_CM  400
+#endif
+
+// Transitions into a sequence (play from the top, resume)
+#define TRANSITION_DEG_PER_SEC 60   // slowest joint sets the pace, MG996R safe
+#define TRANSITION_TICK_MS     20   // one servo period
+
+// Boot (see bootStep / updateHoming)
+#define HOME_RAMP_MS           400  // pulse train fills up over this, per joint
+
+// Idle power manager (see updatePower)
+#define IDLE_AFTER_MS     30000UL    // nothing moving, no requests: relax + dim
+#define SLEEP_AFTER_MS    300000UL   // ... and no one on the AP: light sleep
+#define SLEEP_TICK_MS     250        // sonar watch period while idle / asleep
+#define SLEEP_AWAKE_MS    40         // awake after each tick so stations can find the AP
+#define IDLE_LOOP_MS      10         // loop() pacing while idle (CPU waits in the idle task)
+#define IDLE_CPU_MHZ      80
+#define ACTIVE_CPU_MHZ    240
+
+// Emergency stop (see estopTrip). The worst case trigger-to-outputs-off is
+// entry + one foreign I2C transaction still on the bus + the ALL_LED write
+// (address + 5 bytes). The longest foreign one is a full pcaFlush(): per
+// board address, register and 16 channels x 4 bytes, all boards behind
+// repeated STARTs (the RTC read, address + 7 bytes, is shorter).
+#define ESTOP_UDP_PORT     4210   // "ESTOP" datagram, handled outside loop()
+#define ESTOP_ENTRY_US     50     // pin edge to e-stop task running, at IDLE_CPU_MHZ
+#define ESTOP_I2C_SETUP_US 60     // driver overhead per I2C transaction
+#define ESTOP_FLUSH_BYTES  (NUM_PCA * (2 + 16 * 4))
+#define ESTOP_BUS_BYTES    (ESTOP_FLUSH_BYTES > 8 ? ESTOP_FLUSH_BYTES : 8)
+#define ESTOP_I2C_BITS     ((ESTOP_BUS_BYTES + 6) * 9 + NUM_PCA + 3)   // + STARTs / STOPs
+
+// ========== Modes and sequence slots ==========
+enum RobotMode {
+  MODE_IDLE,
+  MODE_CLEANING,
+  MODE_WATER,
+  MODE_MEDICINE,
+  MODE_GARBAGE,
+  MODE_ARM,
+  MODE_OBSTACLE_STOP
+};
+
+struct SlotInfo {
+  const char* key;    // API name (?mode=)
+  RobotMode   mode;
+};
+
+#if HEBA_BOARD == HEBA_BOARD_ARM
+#define NUM_SLOTS 1
+const SlotInfo slots[NUM_SLOTS] = {{"arm", MODE_ARM}};
+#else
+// Same order as the RoboRemo TEACH_START:/PLAY: numbers
+#define NUM_SLOTS 4
+#define SLOT_CLEAN 3
+const SlotInfo slots[NUM_SLOTS] = {
+  {"water",   MODE_WATER},
+  {"med",     MODE_MEDICINE},
+  {"garbage", MODE_GARBAGE},
+  {"clean",   MODE_CLEANING}
+};
+#endif
+
+// Taught sequences live in LittleFS files and are streamed during playback,
+// so their length is bounded by flash, not RAM
+#define MAX_FRAMES    65535    // frame counter width
+#define WINDOW_FRAMES 8        // frames per read-ahead buffer (x2)
+
+struct Pose {
+  int16_t  servo[NUM_ARM_SERVOS];   // arm joints, 0.1 degree
+  int16_t  leftSpeed;               // -255..255
+  int16_t  rightSpeed;              // -255..255
+  uint16_t durationMs;
+};
+
+// Stored and exported as-is (little-endian, 18 bytes per frame)
+static_assert(sizeof(Pose) == 18, "Pose layout is shared with src/tools/heba_retime.py");
+
+uint16_t seqLen[NUM_SLOTS];   // frames in /seq<slot>.pos
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+// Built-in cleaning demo: plays from RAM while no cleaning sequence is taught
+#define DEMO_FRAMES 12
+Pose demoSeq[DEMO_FRAMES];
+bool seqDemo = false;         // SLOT_CLEAN is the demo, not a file
+#endif
+
+// Playback window: frame i lives in window[(i / WINDOW_FRAMES) & 1]. While
+// one buffer plays, the loader task fills the other with the next block.
+// loop() still reads flash itself when playback starts or resumes (the
+// target frame and the first block) and when /save appends a frame.
+// Each frame also comes compiled to the PCA9685 registers of its joints
+// (see pcaCompile), for the clock generation it was compiled against.
+struct FrameBlock {
+  int32_t  first;              // first frame held, -1 = empty / being filled
+  int8_t   slot;
+  uint8_t  count;
+  uint32_t clockGen;           // pcaClockGen of regs
+  Pose     frames[WINDOW_FRAMES];
+  uint8_t  regs[WINDOW_FRAMES][NUM_ARM_SERVOS][4];
+};
+
+FrameBlock        window[2];
+int               windowSlot    = -1;
+volatile int32_t  windowWant    = -1;   // block start the loader should fetch
+TaskHandle_t      windowTask    = NULL;
+SemaphoreHandle_t seqLock       = NULL; // sequence files (loop, loader, HTTP)
+uint32_t          windowStalls  = 0;    // ticks playback had to wait for flash
+
+// Receives the backup image as it is produced (see writeImage)
+typedef void (*ImageSink)(const uint8_t* data, size_t len);
+
+// ========== Hardware objects ==========
+#define PCA_ADDR 0x40            // board 0, the others follow
+#define PCA_ALLCALL      0x70   // every board answers (MODE1 ALLCALL)
+#define PCA_MODE1        0x00
+#define PCA_MODE1_ALLCALL 0x01
+#define PCA_LED0_ON_L    0x06   // 4 registers per channel
+#define PCA_ALL_LED_ON_L 0xFA   // ALL_LED_ON_L/H, ALL_LED_OFF_L/H follow (auto-increment)
+#define PCA_PRESCALE     0xFE
+#define LCD_ADDR 0x27   // change to 0x3F if needed
+#define RTC_ADDR 0x68   // DS3231
+Adafruit_PWMServoDriver pca[NUM_PCA];   // setup only: reset, clock (see pcaFlush for the outputs)
+bool     pcaOk   = false;   // some servo output works
+uint16_t pcaMask = 0;       // boards that answered
+Preferences prefs;
+#if HEBA_HAS_LCD
+LiquidCrystal_I2C lcd(LCD_ADDR, 16, 2);
+bool lcdOk = false;
+#endif
+#if HEBA_HAS_RTC
+RTC_DS3231 rtc;
+bool rtcOk = false;
+#endif
+#if HEBA_HAS_HTTP
+WebServer server(80);
+#endif
+#if HEBA_HAS_ROBOREMO
+WiFiServer roboRemo(80);
+WiFiClient roboClient;
+String     roboLine;
+#endif
+
+RobotMode currentMode = MODE_IDLE;
+RobotMode prevMode    = MODE_IDLE;
+
+// Commanded joint positions (targets, 0.1 degree), logical joint order
+int16_t currentServoAngles[NUM_SERVOS];
+int16_t currentLeftSpeed  = 0;
+int16_t currentRightSpeed = 0;
+
+// Motion scheduler state
+uint16_t      servoBudgetMa = SERVO_BUDGET_MA;
+int16_t       outputAngle[NUM_SERVOS];   // last position written to the PCA
+bool          outputValid[NUM_SERVOS];
+bool          movePending[NUM_SERVOS];
+unsigned long moveEndsAt[NUM_SERVOS];
+uint8_t       moveImage[NUM_SERVOS][4];  // LEDn registers of the target, compiled ahead
+uint32_t      moveImageMask = 0;         // joints whose moveImage is current
+unsigned long lastMoveStart = 0;
+
+// Battery monitor, written by batteryTask on core 0
+enum BattLevel { BATT_OK = 0, BATT_THROTTLED, BATT_FLOOR };
+bool              battOk        = false;
+uint8_t           battCh[2]     = {0xFF, 0xFF};   // ADC1 channel of pack, buck
+volatile uint16_t battPackMv    = 0;   // mean of the last block
+volatile uint16_t battDipMv     = 0;   // its lowest short mean (start current peaks)
+volatile uint16_t battRestMv    = 0;   // filtered while nothing draws much
+volatile uint16_t battBuckMv    = 0;
+volatile uint16_t battSagMv     = 0;   // rest - dip of the last block
+volatile uint16_t battSagMaxMv  = 0;   // worst since boot
+volatile uint8_t  battSoc       = 0;   // %, from the resting voltage
+volatile uint8_t  battThrottle  = 0;   // 0 = none .. 255 = one joint at a time
+uint8_t           battLevel     = BATT_OK;
+
+// Boot: deferred init stages and soft-start homing
+enum BootStage { BOOT_RTC = 0, BOOT_LCD, BOOT_WIFI, BOOT_SERVICES, BOOT_DONE };
+uint8_t       bootStage     = BOOT_RTC;
+bool          booted        = false;   // everything up, homing done
+bool          storageReady  = false;   // set by storageTask (atomic)
+uint32_t      readyMs       = 0;       // reset to ready
+int8_t        homingJoint   = -1;
+uint32_t      homingDone    = 0;       // bit per joint
+unsigned long homingStart   = 0;
+unsigned long homingTick    = 0;
+uint16_t      homingAcc     = 0;
+
+// Playback state
+bool          playing          = false;
+int           playSlot         = -1;
+int           playIndex        = 0;
+int           lastFrameIndex   = -1;
+unsigned long frameStartTime   = 0;
+int           interruptedIndex = -1;   // where STOP hit, -1 = unknown / finished
+
+// Transition into the sequence (from wherever the arm is)
+bool          transitioning      = false;
+Pose          transitionTarget;
+int16_t       transitionFrom[NUM_ARM_SERVOS];
+unsigned long transitionStart    = 0;
+unsigned long transitionMs       = 0;
+unsigned long lastTransitionTick = 0;
+
+// Obstacle pause: frame/wait clocks and drive speeds are frozen, not lost
+bool          playbackPaused = false;
+unsigned long pausedAt       = 0;
+int16_t       pausedLeft     = 0;
+int16_t       pausedRight    = 0;
+
+// Power state
+enum PowerState { PWR_ACTIVE = 0, PWR_IDLE, PWR_SLEEP };
+enum WakeCause  { WAKE_NONE = 0, WAKE_HTTP, WAKE_REMOTE, WAKE_RTC, WAKE_SONAR, WAKE_TETHER };
+
+uint8_t       powerState      = PWR_ACTIVE;
+unsigned long lastActivityMs  = 0;
+unsigned long awakeUntilMs    = 0;      // AP window after a sleep tick
+uint32_t      wakeAtUs        = 0;      // last wake, 0 = its first motion already measured
+uint8_t       wakeCause       = WAKE_NONE;
+uint32_t      wakeLatencyMs   = 0;      // last wake-to-motion
+uint32_t      wakeLatencyMax  = 0;
+uint32_t      sleepCount      = 0;
+uint64_t      sleptUs         = 0;
+bool          servoRelaxed[NUM_SERVOS];
+
+// Loop timing (see loopTiming, /perf): gaps between loop() passes, less the
+// idle pacing delay; bucket n counts gaps below 32 << n us, the last one the rest
+#define LOOP_HIST_BUCKETS 16
+uint32_t      loopHist[LOOP_HIST_BUCKETS];
+uint32_t      loopCount       = 0;
+uint32_t      loopLastUs      = 0;      // 0 = the last pass slept, don't count the gap
+uint32_t      loopMaxGapUs    = 0;
+uint32_t      loopLate        = 0;      // gaps longer than a servo period
+uint32_t      httpMaxUs       = 0;      // longest server.handleClient()
+
+// Emergency stop: latched by the pin ISR or a network message, cleared only by estopReset()
+enum EstopSource { ESTOP_PIN = 0, ESTOP_UDP, ESTOP_REMOTE, ESTOP_HTTP, ESTOP_TETHER };
+
+volatile bool     estopLatched   = false;
+volatile uint8_t  estopSource    = ESTOP_PIN;
+volatile uint32_t estopTripUs    = 0;      // micros() at the trigger
+volatile uint32_t estopMotorUs   = 0;      // trigger to L298N enables low
+uint32_t          estopOutputsUs = 0;      // trigger to every PCA output off
+uint32_t          estopWorstUs   = 0;
+uint32_t          estopBoundUs   = 0;      // guaranteed worst case, see estopBegin()
+uint32_t          estopCount     = 0;
+bool              estopHandled   = false;  // loop() has stopped playback and missions
+TaskHandle_t      estopTask      = NULL;
+
+// Serial tether (see tetherOnReceive): host-driven motion over the USB
+// UART. Messages are <type> <seq> <payload> <crc16 LE>, COBS-encoded and
+// ended by a 0x00, so a lost byte costs one message and the next 0x00
+// resyncs. Keep in sync with src/tools/heba_tether.py.
+#ifndef HEBA_SERIAL_BAUD
+#define HEBA_SERIAL_BAUD 921600
+#endif
+#define TETHER_PROTOCOL   1
+#define TETHER_MAX_MSG    96       // decoded, type..crc
+#define TETHER_QUEUE      8        // messages waiting for loop()
+#define TETHER_TIMEOUT_MS 250      // host gone: back to plain log frames, tether drive stops
+#define TETHER_MIN_PERIOD 5        // telemetry, ms
+#define TETHER_RX_BUF     1024
+#define TETHER_TX_BUF     1024     // Serial.write() returns before the bytes are out
+#define TETHER_DRIVE      31       // setpoint mask bit: left, right speeds follow the joints
+
+enum TetherMsgType : uint8_t {
+  TM_PING      = 0x01,  //                                   -> TM_PONG
+  TM_SETPOINT  = 0x02,  // mask (u32), pos (i16, 0.1 deg) per joint bit, [left, right (i16)]
+  TM_TELEMETRY = 0x03,  // period ms (u16), 0 = off
+  TM_COMMAND   = 0x04,  // text line, same as RoboRemo       -> TM_ACK
+  TM_ESTOP     = 0x05,  //                                   handled in the UART task
+  TM_PONG      = 0x81,  // protocol, board, joints, PCA boards (u8)
+  TM_STATE     = 0x82,  // see tetherTelemetry()
+  TM_LOG       = 0x83,  // one LogRecord, instead of the raw frame while tethered
+  TM_ACK       = 0x84,  // status (u8): 0 ok, 1 bad length, 2 unknown type
+  TM_ERROR     = 0x85   // crc errors, overruns (u16), sent once after a bad message
+};
+
+struct TetherMsg {
+  uint8_t len;                    // type..payload, crc checked and dropped
+  uint8_t data[TETHER_MAX_MSG];
+};
+
+// TM_STATE payload, followed by the driven position of every joint (i16,
+// 0.1 degree, -1 = not driven yet)
+struct TetherState {
+  uint32_t ms;
+  uint32_t pending;      // joints queued, waiting for the current budget
+  uint8_t  mode;         // RobotMode
+  uint8_t  flags;        // TetherFlag
+  uint8_t  seq;          // last setpoint applied
+  uint8_t  soc;          // battery %
+  uint16_t restMv, loadMv;
+  uint16_t obstacleCm;
+  int16_t  left, right;
+  uint16_t frames, crcErrors;
+  uint8_t  joints, reserved;
+};
+
+enum TetherFlag { TF_MOVING = 1, TF_PAUSED = 2, TF_ESTOP = 4, TF_HOMING = 8, TF_WAVES = 16, TF_IDLE = 32 };
+
+static_assert(NUM_SERVOS < TETHER_DRIVE, "setpoint mask bit 31 is the drive");
+static_assert(sizeof(TetherState) + 2 * NUM_SERVOS + 4 <= TETHER_MAX_MSG, "state message too long");
+
+QueueHandle_t     tetherQueue      = NULL;
+uint8_t           tetherRx[TETHER_MAX_MSG + 1];    // COBS bytes so far (one extra below 254)
+uint8_t           tetherRxLen      = 0;
+bool              tetherRxOver     = false;  // message too long: skip to the next 0x00
+volatile bool     tetherActive     = false;  // a host is talking, logs go out wrapped
+volatile uint32_t tetherLastMs     = 0;      // last good message
+volatile uint16_t tetherFrames     = 0;
+volatile uint16_t tetherCrcErrors  = 0;
+volatile uint16_t tetherOverruns   = 0;      // loop() too slow, queue full
+uint16_t          tetherErrorsSent = 0;
+uint16_t          tetherPeriodMs   = 0;
+unsigned long     tetherLastState  = 0;
+uint8_t           tetherLastSeq    = 0;      // of the last setpoint applied
+bool              tetherDriving    = false;  // wheels run on tether setpoints (deadman armed)
+
+// Teaching (RoboRemo TEACH_START / TEACH_STEP / TEACH_END)
+int  teachSlot  = -1;
+bool isTraining = false;   // web UI TRAIN/CONTROL toggle
+
+// Nearest obstacle in the direction of travel (updated by checkObstacle)
+long lastDistanceCm = 400;
+
+#if HEBA_HAS_WIPER
+// Wiper sweep: a WAVE_SINE over the whole range, 0→180→0 in ~4s
+#define WIPER_MIN_ANGLE       0
+#define WIPER_MAX_ANGLE       180
+#define WIPER_PERIOD_MS       4000
+#define WIPER_SWEEP           255
+
+int           wiperAngle      = WIPER_MIN_ANGLE;   // held angle (not sweeping)
+int16_t       wiperOverride   = -1;   // -1 auto (by mode), 0..180 hold, WIPER_SWEEP always
+bool          wiperCleaning   = false;
+bool          wiperSweeping   = false;
+#endif
+
+// ========== Mission bytecode ==========
+// Compiled on the PC by src/tools/heba_mission.py, little-endian operands.
+// Keep the opcodes in sync with OPS in heba_mission.py.
+//   version 1: <1> <ops ... OP_END>                 one track doing everything
+//   version 2: <2> <tracks> {kind, start(u16)} x tracks, then each track's
+//              ops ... OP_END. Arm, base and wiper tracks run side by side
+//              with their own timing and only meet at OP_SYNC.
+#define MISSION_VERSION      2
+#define MAX_MISSION_BYTES    512
+#define MISSION_MAX_DEPTH    4     // nested repeat blocks
+#define MISSION_OPS_PER_TICK 32
+#define MISSION_TRACKS       3
+#define MISSION_SYNC_IDS     32
+
+enum MissionOp {
+  OP_END        = 0x00,  //
+  OP_POSE       = 0x01,  // a0..a5 (u8)        set arm pose
+  OP_DRIVE      = 0x02,  // l, r (i16), ms      set motors and hold for ms
+  OP_WAIT       = 0x03,  // ms (u16)
+  OP_WAIT_CLEAR = 0x04,  // cm (u8), ms (u16)   wait until path clear, 0 ms = forever
+  OP_REPEAT     = 0x05,  // n (u8)              repeat block up to OP_LOOP n times
+  OP_LOOP       = 0x06,  //
+  OP_WIPER      = 0x07,  // angle (u8)          WIPER_SWEEP = sweep, else hold angle
+  OP_SERVO      = 0x08,  // joint, angle (u8)
+  OP_MOVE       = 0x09,  // a0..a5 (u8), ms     arm keyframe: interpolate there in ms
+  OP_SYNC       = 0x0A,  // id (u8)             wait for the other tracks with this id
+  OP_WAVE       = 0x0B   // target, shape (u8), center, amplitude (i16), period ms (u16), phase (u8)
+                         //                     periodic motion, degrees / speed; 0 ms = stop
+};
+
+// Periodic motion on a servo or the drive base (see updateWaves)
+#define NUM_WAVES       3          // e.g. wiper, an arm joint and the base at once
+#define WAVE_TABLE_BITS 6
+#define WAVE_TABLE_SIZE (1 << WAVE_TABLE_BITS)
+#define WAVE_ONE        16384      // table full scale
+#define WAVE_CHASSIS    0x80       // target: base turns side to side (left +v, right -v)
+
+enum WaveShape { WAVE_SINE = 0, WAVE_TRIANGLE, WAVE_TRAPEZOID, WAVE_SHAPES };
+
+struct Wave {
+  bool          active;
+  uint8_t       shape;       // WaveShape
+  uint8_t       target;      // joint, or WAVE_CHASSIS
+  int16_t       center;      // 0.1 degree, or forward speed for WAVE_CHASSIS
+  int16_t       amplitude;   // same unit, peak
+  uint16_t      periodMs;
+  uint16_t      phase;       // at start, 65536 = one period
+  unsigned long start;
+  uint16_t      lastCounts;  // last pulse written (servo)
+  int16_t       lastSpeed;   // last turn speed written (chassis)
+};
+
+// Which ops a track may use (version 1 missions are one TRACK_ALL)
+enum TrackKind { TRACK_ALL = 0, TRACK_ARM, TRACK_BASE, TRACK_WIPER };
+
+// Interpreter state, per track
+struct MissionTrack {
+  uint8_t       kind;
+  bool          done;
+  uint16_t      pc;
+  uint8_t       waitOp;        // op we are blocked on, OP_END = none
+  uint8_t       clearCm;       // OP_WAIT_CLEAR
+  uint8_t       syncId;        // OP_SYNC
+  uint16_t      waitMs;
+  unsigned long waitStart;
+  unsigned long lastTick;      // OP_MOVE interpolation
+  int16_t       moveFrom[NUM_ARM_SERVOS];
+  int16_t       moveTo[NUM_ARM_SERVOS];
+  uint32_t      syncMask;      // sync ids this track takes part in
+  uint16_t      loopPc[MISSION_MAX_DEPTH];
+  uint8_t       loopLeft[MISSION_MAX_DEPTH];
+  uint8_t       depth;
+};
+
+#if HEBA_HAS_MISSIONS
+uint8_t  missionProg[NUM_SLOTS][MAX_MISSION_BYTES];
+uint16_t missionLen[NUM_SLOTS];
+
+bool           missionRunning   = false;
+int            missionSlotNow   = -1;
+const uint8_t* missionCode      = nullptr;
+MissionTrack   missionTracks[MISSION_TRACKS];
+uint8_t        missionTrackCount = 0;
+#endif
+
+// ========== Warm restart checkpoint ==========
+// Progress of the running sequence / mission, written to RTC memory on every
+// keyframe and refreshed every CKPT_REFRESH_MS. RTC memory survives a
+// brownout, panic or watchdog reset, so the boot after one can put the run
+// back where it was (see warmResume). Two copies are written in turn: a
+// reset in the middle of a write still leaves the previous one intact.
+#define CKPT_MAGIC        0x4845424BUL  // "HEBK"
+#define CKPT_REFRESH_MS   100     // elapsed time of the current frame / waits
+#define CKPT_MAX_ATTEMPTS 2       // warm resumes of one run before giving up (stall loop)
+#define CKPT_STABLE_MS    5000    // a resumed run that lasts this long counts as recovered
+
+enum CheckpointKind { CKPT_NONE = 0, CKPT_PLAY, CKPT_MISSION };
+enum WarmResult { WARM_HELD = 0, WARM_HOMED, WARM_DROPPED, WARM_GAVE_UP };
+
+struct Checkpoint {
+  uint32_t     magic;          // CKPT_MAGIC once the rest is written, 0 while writing
+  uint32_t     seq;            // newer copy wins
+  uint8_t      kind;           // CheckpointKind
+  int8_t       slot;
+  uint8_t      prescale;       // PCA9685 prescale in use (is the chip still running?)
+  uint8_t      attempt;        // warm resumes of this run so far
+  uint8_t      trackCount;
+  int16_t      frame;          // CKPT_PLAY: frame being played
+  int16_t      left, right;    // drive speeds
+  int16_t      wiper;          // wiperOverride
+  uint16_t     missionLen;     // the program is still the same one
+  uint32_t     elapsed[MISSION_TRACKS];  // ms into the frame / into each track's wait
+  int16_t      servo[NUM_SERVOS];        // positions on the PCA outputs
+  MissionTrack tracks[MISSION_TRACKS];
+  Wave         waves[NUM_WAVES];
+  uint32_t     waveElapsed[NUM_WAVES];   // ms since each wave started
+};
+
+RTC_NOINIT_ATTR Checkpoint ckpt[2];
+uint32_t      ckptSeq       = 0;       // last copy written
+unsigned long ckptSavedMs   = 0;
+bool          ckptDirty     = false;   // a keyframe started since the last save
+bool          ckptIdle      = false;   // CKPT_NONE is written, nothing to refresh
+uint8_t       ckptAttempt   = 0;
+Checkpoint    warmCkpt;                // what this boot resumes from
+bool          warmPending   = false;   // resume once storage is up and the joints are home
+bool          warmHeld      = false;   // PCA kept running through the reset
+unsigned long warmResumedMs = 0;
+uint32_t      playSkipMs    = 0;       // resumed frame: time it had already run
+
+#if HEBA_HAS_RTC
+// RTC schedule. ROBOT runs the 4-minute demo rotation, CLASSIC a fixed table.
+struct Schedule {
+  int hour;
+  int minute;
+  int slot;
+};
+
+#if HEBA_BOARD == HEBA_BOARD_CLASSIC
+const Schedule schedules[] = {
+  {8, 0, 3},   // 8:00 AM - Cleaning
+  {8, 1, 2},   // 8:01 AM - Garbage
+  {8, 2, 0},   // 8:02 AM - Water
+  {8, 3, 1},   // 8:03 AM - Medicine
+  {12, 0, 3},  // 12:00 PM - Cleaning
+  {12, 1, 0},  // 12:01 PM - Water
+  {18, 0, 3},  // 6:00 PM - Cleaning
+  {18, 1, 1}   // 6:01 PM - Medicine
+};
+const int scheduleCount = sizeof(schedules) / sizeof(schedules[0]);
+#else
+const int rotationSlots[4] = {3, 0, 1, 2};   // minute % 4: clean, water, med, garbage
+#endif
+
+int lastScheduleMinute = -1;
+unsigned long lastSchedulePoll = 0;
+bool scheduleDue = false;   // alarm woke us, check now
+
+// Wall clock (see clockNow): esp_timer disciplined to the DS3231
+#define CLOCK_SYNC_MS      600000UL   // catch a DS3231 second tick this often
+#define CLOCK_RETRY_MS     10000UL    // ...or this soon after a failed try
+#define CLOCK_LEAD_MS      60         // start polling this long before the predicted tick
+#define CLOCK_WINDOW_MS    1100       // give up when no tick comes within
+#define CLOCK_POLL_MS      5          // seconds register poll while catching it
+#define CLOCK_MAX_GAP_MS   (2 * CLOCK_POLL_MS)   // polls around the tick further apart: no sync
+#define CLOCK_MAX_PPM      200        // crystals are +-20 ppm, more is a bad sync
+#define CLOCK_SAVE_PPM     2          // drift change worth an NVS write
+
+enum ClockSync { CLOCK_IDLE = 0, CLOCK_HUNT };
+uint32_t      clockEpoch     = 0;     // unix time at clockBaseUs
+int64_t       clockBaseUs    = 0;     // esp_timer at that second boundary
+bool          clockValid     = false; // set from the first read, to the second
+bool          clockLocked    = false; // based on a caught tick (drift can be measured)
+float         clockDriftPpm  = 0;     // esp_timer vs DS3231, + = we run fast
+float         clockSavedPpm  = 0;
+int32_t       clockLastErrUs = 0;     // correction of the last sync
+uint32_t      clockSyncs     = 0;
+uint32_t      clockRejects   = 0;     // ticks caught between polls too far apart
+uint32_t      clockReads     = 0;     // I2C transactions spent on time
+uint8_t       clockState     = CLOCK_IDLE;
+uint8_t       clockHuntSec   = 0;
+unsigned long clockNextSync  = 0;
+unsigned long clockHuntStart = 0;
+unsigned long clockLastPoll  = 0;
+int64_t       clockPollUs    = 0;
+#endif
+
+// ========== Flight recorder (binary event log) ==========
+// Control code only stores a fixed-size record (event id + args) into a
+// lock-free ring; a low-priority task ships the records as binary frames and
+// src/tools/heba_log_decode.py turns them back into text on the PC.
+// The ring lives in RTC memory, so the last LOG_RING_SIZE records survive a
+// crash/brownout reset and are re-sent after the next boot.
+// Keep the ids in sync with EVENTS in heba_log_decode.py.
+enum LogEvent : uint8_t {
+  EV_LOG_LOST = 0,     // records overwritten before they were sent (count)
+  EV_BOOT,             // reset reason, boot number
+  EV_READY,            // AP IP a.b.c.d
+  EV_CMD,              // first 10 chars of the command
+  EV_TEACH_START,      // slot
+  EV_TEACH_STEP,       // step number
+  EV_TEACH_SERVOS_A,   // joint 0..4
+  EV_TEACH_SERVOS_B,   // joint 5..6
+  EV_TEACH_END,        // slot, steps
+  EV_PLAY_START,       // slot
+  EV_SEQ_SAVED,        // slot, frames
+  EV_SEQ_LOADED,       // slot, frames
+  EV_PLAY_DONE,        // slot
+  EV_PLAY_STOP,        // slot, frame
+  EV_RESUME,           // frame, transition ms
+  EV_OBSTACLE,         // distance cm, SonarDir
+  EV_PATH_CLEAR,       // paused ms
+  EV_MISSION_START,    // slot
+  EV_MISSION_END,      // slot
+  EV_MISSION_STORED,   // slot, bytes
+  EV_PERIPH_MISSING,   // PeriphId
+  EV_POWER,            // PowerState
+  EV_WAKE,             // WakeCause, ms from wake to first motion
+  EV_ESTOP,            // EstopSource, us to motors off, us to servos off, bound us, servos cut
+  EV_ESTOP_CLEAR,      // trips so far
+  EV_WARM_RESUME,      // CheckpointKind, slot, frame / first track pc, attempt, WarmResult
+  EV_BATTERY,          // BattLevel, pack mV under load, resting mV, buck mV, state of charge %
+  EV_TETHER            // 1 host connected / 0 gone, crc errors, overruns
+};
+
+enum PeriphId { PERIPH_PCA = 0, PERIPH_RTC, PERIPH_LCD, PERIPH_FLASH, PERIPH_BATTERY };
+
+#define LOG_RING_SIZE 64   // power of 2, 20 bytes each
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_MAGIC 0x4845424CUL  // "HEBL"
+#define LOG_SYNC1 0xA5
+#define LOG_SYNC2 0x5A
+
+struct LogRecord {
+  uint32_t seq;      // index + 1, 0 while the slot is being written
+  uint32_t ms;       // millis() when logged
+  uint8_t  id;       // LogEvent
+  uint8_t  boot;     // boot number (low 8 bits)
+  int16_t  arg[5];
+};
+
+RTC_NOINIT_ATTR LogRecord logRing[LOG_RING_SIZE];
+RTC_NOINIT_ATTR uint32_t logMagic;
+RTC_NOINIT_ATTR uint32_t logBootCount;
+uint32_t logHead = 0;      // next index to write (atomic)
+uint32_t logBootHead = 0;  // first index written by this boot
+
+void logEvent(uint8_t id, int16_t a0 = 0, int16_t a1 = 0, int16_t a2 = 0, int16_t a3 = 0, int16_t a4 = 0);
+
+// Called once at boot, before anything logs.
+void logBegin() {
+  esp_reset_reason_t reason = esp_reset_reason();
+
+  if (logMagic != LOG_MAGIC || reason == ESP_RST_POWERON) {
+    // RTC memory holds garbage after power-on: start an empty ring
+    memset(logRing, 0, sizeof(logRing));
+    logMagic = LOG_MAGIC;
+    logBootCount = 0;
+    logHead = 0;
+  } else {
+    // Warm reset: keep the previous boot's records and continue numbering
+    logBootCount++;
+    for (int i=0;i<LOG_RING_SIZE;i++) {
+      if (logRing[i].seq > logHead) logHead = logRing[i].seq;
+    }
+  }
+  logBootHead = logHead;
+
+  // Drain on core 0, below the WiFi stack and next to the idle task
+  xTaskCreatePinnedToCore(logDrainTask, "logDrain", 3072, NULL, 1, NULL, 0);
+  logEvent(EV_BOOT, reason, logBootCount);
+}
+
+// Lock-free, never blocks: safe from loop(), other tasks and ISRs.
+// When the drain falls behind the oldest records are overwritten.
+void IRAM_ATTR logEvent(uint8_t id, int16_t a0, int16_t a1, int16_t a2, int16_t a3, int16_t a4) {
+  uint32_t idx = __atomic_fetch_add(&logHead, 1, __ATOMIC_RELAXED);
+  LogRecord &r = logRing[idx & LOG_RING_MASK];
+
+  __atomic_store_n(&r.seq, 0, __ATOMIC_RELEASE);
+  r.ms = millis();
+  r.id = id;
+  r.boot = logBootCount;
+  r.arg[0] = a0;
+  r.arg[1] = a1;
+  r.arg[2] = a2;
+  r.arg[3] = a3;
+  r.arg[4] = a4;
+  __atomic_store_n(&r.seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+// Commands are packed as raw text (up to 10 chars) into the args
+void logCommand(const String &cmd) {
+  int16_t a[5] = {0, 0, 0, 0, 0};
+  memcpy(a, cmd.c_str(), min((unsigned int)sizeof(a), cmd.length()));
+  logEvent(EV_CMD, a[0], a[1], a[2], a[3], a[4]);
+}
+
+// Frame: sync1 sync2 <20 byte record> xor-checksum
+void logWriteFrame(const LogRecord &r) {
+  // A tethered host reads COBS messages only, a raw frame would be noise to it
+  if (tetherActive) {
+    tetherSend(TM_LOG, 0, (const uint8_t*)&r, sizeof(LogRecord));
+    return;
+  }
+
+  uint8_t frame[sizeof(LogRecord) + 3];
+  frame[0] = LOG_SYNC1;
+  frame[1] = LOG_SYNC2;
+  memcpy(&frame[2], &r, sizeof(LogRecord));
+
+  uint8_t sum = 0;
+  for (unsigned int i=2; i<sizeof(LogRecord) + 2; i++) sum ^= frame[i];
+  frame[sizeof(LogRecord) + 2] = sum;
+
+  Serial.write(frame, sizeof(frame));
+}
+
+void logDrainTask(void* arg) {
+  // Start with whatever the previous boot left in RTC memory
+  uint32_t tail = logBootHead > LOG_RING_SIZE ? logBootHead - LOG_RING_SIZE : 0;
+  uint32_t lost = 0;
+
+  for (;;) {
+    uint32_t head = __atomic_load_n(&logHead, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+      vTaskDelay(pdMS_TO_TICKS(20));
+      continue;
+    }
+    if (head - tail > LOG_RING_SIZE) {
+      lost += head - tail - LOG_RING_SIZE;
+      tail = head - LOG_RING_SIZE;
+    }
+
+    LogRecord &slot = logRing[tail & LOG_RING_MASK];
+    uint32_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+
+    if (seq != tail + 1) {
+      // Slot reserved but not finished yet: give the writer time
+      if (tail >= logBootHead && (int32_t)(seq - (tail + 1)) < 0) {
+        vTaskDelay(1);
+        continue;
+      }
+      // Overwritten, or torn by the reset
+      lost++;
+      tail++;
+      continue;
+    }
+
+    LogRecord copy = slot;
+    if (__atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE) != seq) {
+      lost++;  // overwritten while copying
+      tail++;
+      continue;
+    }
+
+    if (lost > 0) {
+      LogRecord note = {0, copy.ms, EV_LOG_LOST, copy.boot, {(int16_t)min(lost, (uint32_t)INT16_MAX), 0, 0, 0, 0}};
+      logWriteFrame(note);
+      lost = 0;
+    }
+    logWriteFrame(copy);
+    tail++;
+  }
+}
+
+// ========== Servo output ==========
+// The PCA9685 period comes from its internal oscillator through an 8-bit
+// prescaler, so neither the frequency nor the counts per microsecond are
+// what kPwmHz says. Both are worked out from each board's calibrated
+// oscillator (every chip runs at its own speed).
+//
+// Outputs are written into a shadow of the LEDn registers and sent by
+// pcaFlush() once per control pass: per board one auto-increment burst
+// over the channels that changed, all boards in a single I2C transaction
+// joined by repeated STARTs. The chips latch new outputs on STOP (MODE2
+// OCH = 0), so the whole frame takes effect on every board at the same
+// instant, and a pass costs one transaction however many joints moved.
+uint32_t pcaOscHz[NUM_PCA];
+float    pcaHz[NUM_PCA];         // real output frequency
+float    pcaCounts16[NUM_PCA];   // counts per 1/16 us
+uint8_t  pcaPrescale[NUM_PCA];
+
+uint8_t  pcaShadow[NUM_PCA][16][4];   // LEDn_ON_L/H, OFF_L/H
+volatile uint32_t pcaClockGen = 0;    // bumped on every clock change: compiled registers are stale
+uint32_t pcaCompiled = 0, pcaLive = 0;   // joint starts from compiled frames / computed on the spot
+uint16_t pcaDirty[NUM_PCA];           // bit per channel
+uint8_t  pcaCmdBuf[I2C_LINK_RECOMMENDED_SIZE(NUM_PCA)];
+uint32_t pcaFlushes = 0, pcaFlushErrors = 0;
+
+uint8_t pcaBoard(uint8_t joint) {
+  return Servos::channel[joint] >> 4;
+}
+
+// Raw register access, also before pca[].begin() resets the chip
+uint8_t pcaReadReg(uint8_t board, uint8_t reg) {
+  Wire.beginTransmission(PCA_ADDR + board);
+  Wire.write(reg);
+  if (Wire.endTransmission() != 0 || Wire.requestFrom((uint8_t)(PCA_ADDR + board), (uint8_t)1) != 1) return 0;
+  return Wire.read();
+}
+
+void pcaWriteReg(uint8_t board, uint8_t reg, uint8_t value) {
+  Wire.beginTransmission(PCA_ADDR + board);
+  Wire.write(reg);
+  Wire.write(value);
+  Wire.endTransmission();
+}
+
+void pcaApplyClock(uint8_t b) {
+  pca[b].setOscillatorFrequency(pcaOscHz[b]);
+  pca[b].setPWMFreq(kPwmHz);
+  // the library's reset drops ALLCALL, pcaAllOff() needs it
+  pcaWriteReg(b, PCA_MODE1, pcaReadReg(b, PCA_MODE1) | PCA_MODE1_ALLCALL);
+  pcaPrescale[b] = pca[b].readPrescale();
+  pcaHz[b] = (float)pcaOscHz[b] / (PCA_COUNTS * (pcaPrescale[b] + 1));
+  pcaCounts16[b] = PCA_COUNTS * pcaHz[b] / 16e6f;
+  __atomic_add_fetch(&pcaClockGen, 1, __ATOMIC_RELEASE);
+}
+
+// Finds the boards and brings them up. Calibrations are in NVS: "pcaOsc"
+// for board 0 (as before), "pcaOsc<n>" for the others.
+void pcaBegin() {
+  prefs.begin("heba", true);
+  for (int b=0;b<NUM_PCA;b++) {
+    char key[8];
+    snprintf(key, sizeof(key), b ? "pcaOsc%d" : "pcaOsc", b);
+    pcaOscHz[b]    = prefs.getUInt(key, PCA_OSC_HZ);
+    pcaHz[b]       = kPwmHz;
+    pcaCounts16[b] = 0;
+    for (int ch=0;ch<16;ch++) {
+      pcaShadow[b][ch][0] = pcaShadow[b][ch][1] = pcaShadow[b][ch][2] = 0;
+      pcaShadow[b][ch][3] = 0x10;   // full off
+    }
+    if (i2cPresent(PCA_ADDR + b)) {
+      pcaMask |= 1 << b;
+    } else {
+      logEvent(EV_PERIPH_MISSING, PERIPH_PCA, b);   // its joints stay limp, the rest works
+    }
+  }
+  prefs.end();
+  pcaOk = pcaMask != 0;
+}
+
+void pcaStart() {
+  for (int b=0;b<NUM_PCA;b++) {
+    if (!(pcaMask & (1 << b))) continue;
+    pca[b] = Adafruit_PWMServoDriver(PCA_ADDR + b);
+    pca[b].begin();
+    pcaApplyClock(b);
+  }
+}
+
+// New oscillator calibration: kept in NVS, outputs re-written at once
+void pcaSetOsc(uint8_t b, uint32_t hz) {
+  if (b >= NUM_PCA || !(pcaMask & (1 << b)) || hz < 20000000UL || hz > 30000000UL) return;
+  pcaOscHz[b] = hz;
+  char key[8];
+  snprintf(key, sizeof(key), b ? "pcaOsc%d" : "pcaOsc", b);
+  prefs.begin("heba", false);
+  prefs.putUInt(key, hz);
+  prefs.end();
+  pcaApplyClock(b);
+  moveImageMask = 0;   // queued moves compiled for the old clock
+  for (int j=0;j<NUM_SERVOS;j++) {
+    if (outputValid[j] && pcaBoard(j) == b) writeServo(j, outputAngle[j]);
+  }
+  pcaFlush();
+}
+
+uint16_t servoCounts(uint8_t joint, int16_t pos) {
+  return (uint16_t)(Servos::pulseUs16(joint, pos) * pcaCounts16[pcaBoard(joint)] + 0.5f);
+}
+
+// Reverse of servoCounts(), for front-ends that send raw counts (RoboRemo)
+int16_t posFromCounts(uint8_t joint, uint16_t counts) {
+  float c16 = pcaCounts16[pcaBoard(joint)];
+  if (c16 <= 0) return Servos::home[joint];
+  float us = counts / c16 / 16;
+  return constrain((int)((us - Servos::minUs[joint]) * POS_MAX / (Servos::maxUs[joint] - Servos::minUs[joint]) + 0.5f),
+                   0, POS_MAX);
+}
+
+// Into the shadow; goes out with the next pcaFlush()
+void pcaSet(uint8_t joint, uint16_t on, uint16_t off) {
+  uint8_t b = pcaBoard(joint), ch = Servos::channel[joint] & 15;
+  uint8_t* r = pcaShadow[b][ch];
+  r[0] = on;
+  r[1] = on >> 8;
+  r[2] = off;
+  r[3] = off >> 8;
+  pcaDirty[b] |= 1 << ch;
+}
+
+// LEDn_ON_L/H, OFF_L/H of a joint at pos with the current clock. Also
+// run by the window loader on core 0, so playback only copies registers.
+void pcaCompile(uint8_t joint, int16_t pos, uint8_t* r) {
+  uint16_t on  = Servos::onCount(joint);
+  uint16_t off = (on + servoCounts(joint, constrain(pos, 0, POS_MAX))) % PCA_COUNTS;
+  r[0] = on;
+  r[1] = on >> 8;
+  r[2] = off;
+  r[3] = off >> 8;
+}
+
+bool servoWritable(uint8_t joint) {
+  return pcaOk && !estopLatched && (pcaMask & (1 << pcaBoard(joint)));
+}
+
+void writeServo(uint8_t joint, int16_t pos) {
+  if (!servoWritable(joint)) return;
+  uint8_t b = pcaBoard(joint), ch = Servos::channel[joint] & 15;
+  pcaCompile(joint, pos, pcaShadow[b][ch]);
+  pcaDirty[b] |= 1 << ch;
+}
+
+// Compiled registers straight into the shadow
+void writeServoImage(uint8_t joint, const uint8_t* r) {
+  if (!servoWritable(joint)) return;
+  uint8_t b = pcaBoard(joint), ch = Servos::channel[joint] & 15;
+  memcpy(pcaShadow[b][ch], r, 4);
+  pcaDirty[b] |= 1 << ch;
+}
+
+// Pulses off (servo goes limp): FULL_OFF bit, no pulse at all
+void pcaOff(uint8_t joint) {
+  pcaSet(joint, 0, PCA_COUNTS);
+}
+
+// Sends what changed since the last call, every board in one transaction
+bool pcaFlush() {
+  uint16_t any = 0;
+  for (int b=0;b<NUM_PCA;b++) {
+    if (!(pcaMask & (1 << b))) pcaDirty[b] = 0;
+    any |= pcaDirty[b];
+  }
+  if (!any) return true;
+  if (estopLatched) {
+    for (int b=0;b<NUM_PCA;b++) pcaDirty[b] = 0;
+    return false;
+  }
+
+  i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(pcaCmdBuf, sizeof(pcaCmdBuf));
+  for (int b=0;b<NUM_PCA;b++) {
+    if (!pcaDirty[b]) continue;
+    int lo = __builtin_ctz(pcaDirty[b]), hi = 31 - __builtin_clz(pcaDirty[b]);
+    i2c_master_start(cmd);   // repeated START after the first board
+    i2c_master_write_byte(cmd, (PCA_ADDR + b) << 1 | I2C_MASTER_WRITE, true);
+    i2c_master_write_byte(cmd, PCA_LED0_ON_L + 4 * lo, true);
+    i2c_master_write(cmd, pcaShadow[b][lo], 4 * (hi - lo + 1), true);
+    pcaDirty[b] = 0;
+  }
+  i2c_master_stop(cmd);      // every board latches here
+  esp_err_t err = i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(20));
+  i2c_cmd_link_delete_static(cmd);
+  pcaFlushes++;
+  if (err != ESP_OK) pcaFlushErrors++;
+  // tripped while the frame was on the bus: the ALL_LED write may be out already
+  if (estopLatched) pcaAllOff();
+  return err == ESP_OK;
+}
+
+void releaseServo(uint8_t joint) {
+  if (pcaOk) pcaOff(joint);
+  outputValid[joint] = false;
+  movePending[joint] = false;
+}
+
+// Every channel of every board full-off in one bus transaction (ALL_LED
+// registers through the all-call address)
+bool pcaAllOff() {
+  Wire.beginTransmission(PCA_ALLCALL);
+  Wire.write(PCA_ALL_LED_ON_L);
+  Wire.write(0);
+  Wire.write(0);
+  Wire.write(0);
+  Wire.write(0x10);   // ALL_LED_OFF_H bit 4: full off
+  bool ok = Wire.endTransmission() == 0;
+  // ALL_LED loads every LEDn register: the shadow has to agree
+  for (int b=0;b<NUM_PCA;b++) {
+    for (int ch=0;ch<16;ch++) {
+      pcaShadow[b][ch][0] = pcaShadow[b][ch][1] = pcaShadow[b][ch][2] = 0;
+      pcaShadow[b][ch][3] = 0x10;
+    }
+    pcaDirty[b] = 0;
+  }
+  return ok;
+}
+
+void releaseAllServos() {
+  if (pcaOk) pcaAllOff();
+  for (int j=0;j<NUM_SERVOS;j++) {
+    outputValid[j] = false;
+    movePending[j] = false;
+  }
+}
+
+// ========== Battery monitor ==========
+// The pack (and the buck output, where wired) is sampled continuously by
+// the ADC1 DMA: I2S0 in built-in ADC mode walks the channel pattern at
+// BATT_SAMPLE_HZ without the CPU, and batteryTask only averages full
+// blocks. Per block it keeps the mean, the dip (lowest short mean, where
+// servo start currents show up) and a resting voltage filtered only while
+// no joint moves and the wheels stand, for the state of charge. Dips
+// towards the floor, or a pack that is running low, raise battThrottle,
+// and the motion scheduler starts fewer joints at once, further apart.
+const uint16_t kCellSocMv[] = {3300, 3500, 3600, 3700, 3750, 3800, 3850, 3900, 4000, 4100, 4200};
+const uint8_t  kCellSocPct[] = {0,   5,    10,   20,   30,   40,   50,   60,   75,   90,   100};
+
+uint8_t batterySoc(uint16_t cellMv) {
+  const int n = sizeof(kCellSocMv) / sizeof(kCellSocMv[0]);
+  if (cellMv <= kCellSocMv[0]) return 0;
+  for (int i=1;i<n;i++) {
+    if (cellMv < kCellSocMv[i]) {
+      return kCellSocPct[i - 1] + (uint32_t)(cellMv - kCellSocMv[i - 1]) * (kCellSocPct[i] - kCellSocPct[i - 1]) /
+                                  (kCellSocMv[i] - kCellSocMv[i - 1]);
+    }
+  }
+  return 100;
+}
+
+// 0 at or above 'start', 255 at or below 'floor'
+uint8_t batteryRamp(int mv, int start, int floor) {
+  if (mv >= start) return 0;
+  if (mv <= floor) return 255;
+  return (uint32_t)(start - mv) * 255 / (start - floor);
+}
+
+// Something draws more than holding current right now
+bool batteryLoaded() {
+  if (currentLeftSpeed || currentRightSpeed) return true;
+  unsigned long now = millis();
+  for (int j=0;j<NUM_SERVOS;j++) {
+    if (outputValid[j] && (long)(moveEndsAt[j] - now) > 0) return true;
+  }
+  return false;
+}
+
+// One block: mV means and dips per channel (0 = channel not sampled)
+void batteryUpdate(const uint16_t* mv, const uint16_t* dip) {
+  uint8_t t = 0;
+  if (mv[0]) {
+    if (!battRestMv || !batteryLoaded()) {
+      float blockMs = BATT_BLOCK * 1000.0f / BATT_SAMPLE_HZ;
+      battRestMv = battRestMv ? battRestMv + ((float)mv[0] - battRestMv) * blockMs / BATT_REST_MS : mv[0];
+    }
+    battPackMv = mv[0];
+    battDipMv  = dip[0];
+    battSagMv  = battRestMv > dip[0] ? battRestMv - dip[0] : 0;
+    if (battSagMv > battSagMaxMv) battSagMaxMv = battSagMv;
+    battSoc    = batterySoc(battRestMv / BATT_CELLS);
+    t = max(batteryRamp(dip[0] / BATT_CELLS, BATT_THROTTLE_CELL_MV, BATT_FLOOR_CELL_MV),
+            (uint8_t)(batteryRamp(battRestMv / BATT_CELLS, BATT_LOW_CELL_MV, BATT_EMPTY_CELL_MV) / 2));
+  }
+  if (mv[1]) {
+    battBuckMv = mv[1];
+    t = max(t, batteryRamp(dip[1], BUCK_THROTTLE_MV, BUCK_FLOOR_MV));
+  }
+  // up at once, down slowly (no stop/go chatter while the load settles)
+  battThrottle = t >= battThrottle ? t : max((int)t, battThrottle - BATT_RELEASE);
+
+  uint8_t level = battThrottle == 255 ? BATT_FLOOR : battThrottle ? BATT_THROTTLED : BATT_OK;
+  if (level != battLevel) {
+    battLevel = level;
+    logEvent(EV_BATTERY, level, battDipMv, battRestMv, battBuckMv, battSoc);
+  }
+}
+
+void batteryTask(void* arg) {
+  static uint16_t buf[BATT_BLOCK];
+  esp_adc_cal_characteristics_t cal;
+  esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &cal);
+  const float div[2] = {BATT_DIV_PACK, BATT_DIV_BUCK};
+
+  for (;;) {
+    size_t got = 0;
+    if (i2s_read(I2S_NUM_0, buf, sizeof(buf), &got, pdMS_TO_TICKS(200)) != ESP_OK || got == 0) continue;
+
+    // each sample carries its channel in the top 4 bits
+    uint32_t sum[2] = {0, 0}, sub[2] = {0, 0}, low[2] = {UINT32_MAX, UINT32_MAX};
+    uint16_t n[2] = {0, 0}, subN[2] = {0, 0};
+    for (size_t i=0;i<got / 2;i++) {
+      uint8_t ch = buf[i] >> 12;
+      int k = ch == battCh[0] ? 0 : ch == battCh[1] ? 1 : -1;
+      if (k < 0) continue;
+      uint16_t raw = buf[i] & 0xFFF;
+      sum[k] += raw;
+      sub[k] += raw;
+      n[k]++;
+      if (++subN[k] == BATT_SUB) {
+        low[k]  = min(low[k], sub[k]);
+        sub[k]  = 0;
+        subN[k] = 0;
+      }
+    }
+
+    uint16_t mv[2] = {0, 0}, dip[2] = {0, 0};
+    for (int k=0;k<2;k++) {
+      if (!n[k]) continue;
+      mv[k]  = esp_adc_cal_raw_to_voltage(sum[k] / n[k], &cal) * div[k];
+      dip[k] = low[k] == UINT32_MAX ? mv[k] : esp_adc_cal_raw_to_voltage(low[k] / BATT_SUB, &cal) * div[k];
+    }
+    batteryUpdate(mv, dip);
+  }
+}
+
+// Called in setup(): nothing to do without a divider wired to ADC1
+void batteryBegin() {
+  const int8_t pins[2] = {kPins.vbat, kPins.vbuck};
+  int count = 0;
+  for (int k=0;k<2;k++) {
+    int ch = pins[k] >= 32 ? digitalPinToAnalogChannel(pins[k]) : -1;   // ADC1 pins only (ADC2 is WiFi's)
+    if (ch < 0 || ch > 7) continue;
+    battCh[k] = ch;
+    adc1_config_channel_atten((adc1_channel_t)ch, ADC_ATTEN_DB_11);
+    count++;
+  }
+  if (!count) return;
+
+  i2s_config_t cfg = {};
+  cfg.mode                 = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN);
+  cfg.sample_rate          = BATT_SAMPLE_HZ;
+  cfg.bits_per_sample      = I2S_BITS_PER_SAMPLE_16BIT;
+  cfg.channel_format       = I2S_CHANNEL_FMT_ONLY_LEFT;
+  cfg.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+  cfg.dma_buf_count        = 4;
+  cfg.dma_buf_len          = BATT_BLOCK;
+  uint8_t first = battCh[0] != 0xFF ? battCh[0] : battCh[1];
+  if (i2s_driver_install(I2S_NUM_0, &cfg, 0, NULL) != ESP_OK ||
+      i2s_set_adc_mode(ADC_UNIT_1, (adc1_channel_t)first) != ESP_OK ||
+      i2s_adc_enable(I2S_NUM_0) != ESP_OK) {
+    logEvent(EV_PERIPH_MISSING, PERIPH_BATTERY);
+    return;
+  }
+  if (count == 2) {
+    // the driver sets up a one-entry pattern: make it pack, buck, pack, ...
+    // entry = channel, 12 bit, 11 dB
+    SYSCON.saradc_ctrl.sar1_patt_len = 1;
+    SYSCON.saradc_sar1_patt_tab[0] = ((uint32_t)(battCh[0] << 4 | 3 << 2 | ADC_ATTEN_DB_11) << 24) |
+                                     ((uint32_t)(battCh[1] << 4 | 3 << 2 | ADC_ATTEN_DB_11) << 16);
+  }
+  battOk = true;
+  xTaskCreatePinnedToCore(batteryTask, "battery", 3072, NULL, 3, NULL, 0);
+}
+
+// ========== Current-budget motion scheduler ==========
+// A servo draws its big current while it is moving (stall current at the
+// start), and only a small holding current once it has arrived. New
+// targets are queued and joints are started, heaviest first, only while
+// the estimated sum stays inside the budget. The rest start a few ms later
+// as earlier joints arrive. Every joint still moves at full speed.
+
+// Estimated servo rail current right now
+uint16_t servoCurrentMa(unsigned long now) {
+  uint16_t ma = 0;
+  for (int j=0;j<NUM_SERVOS;j++) {
+    if (!outputValid[j]) continue;
+    bool moving = (long)(moveEndsAt[j] - now) > 0;
+    ma += moving ? Servos::moveMa[j] : Servos::holdMa[j];
+  }
+  return ma;
+}
+
+// Start as many queued moves as the budget allows (called in loop and on every request)
+void updateMotionScheduler() {
+  if (estopLatched || homingJoint >= 0) return;   // queued moves wait for the re-arm
+  unsigned long now = millis();
+  uint16_t used = servoCurrentMa(now);
+  // a sagging battery shrinks the budget and spaces the start peaks out
+  uint8_t throttle = battThrottle;
+  uint16_t budget  = servoBudgetMa - (uint32_t)servoBudgetMa * throttle / 256;
+  unsigned long gap = (unsigned long)BATT_STAGGER_MS * throttle / 255;
+
+  for (;;) {
+    // heaviest pending joint first
+    int next = -1;
+    for (int j=0;j<NUM_SERVOS;j++) {
+      if (movePending[j] && (next < 0 || Servos::moveMa[j] > Servos::moveMa[next])) next = j;
+    }
+    if (next < 0) break;
+
+    uint16_t extra = Servos::moveMa[next] - (outputValid[next] ? Servos::holdMa[next] : 0);
+    bool nothingMoving = true;
+    for (int j=0;j<NUM_SERVOS;j++) {
+      if (outputValid[j] && (long)(moveEndsAt[j] - now) > 0) nothingMoving = false;
+    }
+    // A joint bigger than the whole budget still has to move eventually
+    if (used + extra > budget && !nothingMoving) break;
+    if (gap && now - lastMoveStart < gap) break;
+
+    int16_t target = currentServoAngles[next];
+    int delta = outputValid[next] ? abs((int)target - (int)outputAngle[next]) : POS_MAX;
+    noteMotion();
+    if (moveImageMask & (1UL << next)) {
+      writeServoImage(next, moveImage[next]);
+      pcaCompiled++;
+    } else {
+      writeServo(next, target);
+      pcaLive++;
+    }
+    outputAngle[next] = target;
+    outputValid[next] = true;
+    movePending[next] = false;
+    moveEndsAt[next]  = now + (unsigned long)delta * 1000 / (Servos::degPerSec[next] * POS_SCALE) + SERVO_SETTLE_MS;
+    lastMoveStart     = now;
+    used += extra;
+  }
+  pcaFlush();   // the joints started together go out as one frame
+}
+
+// Queue a target without starting it (use for whole poses, then schedule once)
+void queueServo(uint8_t joint, int pos) {
+  if (joint >= NUM_SERVOS) return;
+  pos = constrain(pos, 0, POS_MAX);
+  currentServoAngles[joint] = pos;
+  movePending[joint] = !outputValid[joint] || outputAngle[joint] != pos;
+  moveImageMask &= ~(1UL << joint);
+}
+
+// Same, with the target's registers already compiled (playback keyframes)
+void queueServoImage(uint8_t joint, int pos, const uint8_t* r) {
+  queueServo(joint, pos);
+  if (joint >= NUM_SERVOS) return;
+  memcpy(moveImage[joint], r, 4);
+  moveImageMask |= 1UL << joint;
+}
+
+void setServo(uint8_t joint, int pos) {
+  queueServo(joint, pos);
+  updateMotionScheduler();
+}
+
+void moveAllToHome() {
+  for (int j=0;j<NUM_ARM_SERVOS;j++) queueServo(j, Servos::home[j]);
+  updateMotionScheduler();
+}
+
+// Soft-start homing at boot. Where the joints are is unknown, so the first
+// pulse can't be ramped in angle; instead the pulse train is: a servo only
+// drives while it gets pulses, so starting with one period in eight and
+// filling up over HOME_RAMP_MS makes it creep home instead of snapping.
+// Joints go one after another, heaviest first (inside any current budget).
+void startHoming() {
+  for (int j=0;j<NUM_SERVOS;j++) currentServoAngles[j] = Servos::home[j];
+  moveImageMask = 0;
+#if HEBA_HAS_WIPER
+  wiperAngle = kWiperUp;
+  currentServoAngles[SERVO_WIPER] = DEG(wiperAngle);
+#endif
+  homingDone  = 0;
+  homingJoint = pcaOk && !estopLatched ? nextHomingJoint() : -1;
+  homingStart = millis();
+  homingAcc   = 0;
+}
+
+int8_t nextHomingJoint() {
+  int8_t next = -1;
+  for (int j=0;j<NUM_SERVOS;j++) {
+    if (homingDone & (1UL << j)) continue;
+    if (next < 0 || Servos::moveMa[j] > Servos::moveMa[next]) next = j;
+  }
+  return next;
+}
+
+// Called every loop while booting, one PCA write per servo period
+void updateHoming() {
+  if (homingJoint < 0) return;
+  unsigned long now = millis();
+  if (now - homingTick < TRANSITION_TICK_MS) return;
+  homingTick = now;
+
+  int j = homingJoint;
+  unsigned long t = now - homingStart;
+  if (t < HOME_RAMP_MS) {
+    homingAcc += 32 + 224 * t / HOME_RAMP_MS;   // density 1/8 .. 1
+    if (homingAcc >= 256) {
+      homingAcc -= 256;
+      writeServo(j, currentServoAngles[j]);
+    } else {
+      pcaOff(j);
+    }
+    pcaFlush();
+    return;
+  }
+
+  writeServo(j, currentServoAngles[j]);
+  pcaFlush();
+  outputAngle[j] = currentServoAngles[j];
+  outputValid[j] = true;
+  moveEndsAt[j]  = now + SERVO_SETTLE_MS;
+  homingDone |= 1UL << j;
+  homingJoint = nextHomingJoint();
+  homingStart = now;
+  homingAcc   = 0;
+}
+
+// ========== Motors control ==========
+#if HEBA_HAS_CHASSIS
+void driveSide(int8_t inA, int8_t inB, uint8_t pwmCh, int8_t en, int16_t speed) {
+  digitalWrite(inA, speed > 0 ? HIGH : LOW);
+  digitalWrite(inB, speed < 0 ? HIGH : LOW);
+  if (en >= 0) ledcWrite(pwmCh, abs(speed));   // boards without ENA/ENB run full speed
+}
+
+void setMotors(int16_t left, int16_t right) {
+  if (estopLatched) left = right = 0;
+  if (left || right) noteMotion();
+  currentLeftSpeed  = left;
+  currentRightSpeed = right;
+  driveSide(kPins.in1, kPins.in2, 0, kPins.ena, left);    // channel 0 -> ENA
+  driveSide(kPins.in3, kPins.in4, 1, kPins.enb, right);   // channel 1 -> ENB
+  if (estopLatched) estopCutMotors();                     // tripped halfway through
+}
+#else
+void setMotors(int16_t left, int16_t right) {}
+#endif
+
+void stopMotors() {
+  setMotors(0, 0);
+}
+
+// ========== Emergency stop ==========
+// The switch interrupt (or a network message) cuts the drive motors right
+// in the ISR and wakes the highest-priority task, which switches every PCA
+// output off with one ALL_LED write. Neither waits for loop(), so a long
+// handler or a frame delay can't hold the stop up. The trip stays latched
+// until estopReset(); writeServo() and setMotors() refuse to drive until then.
+//
+// Worst case trigger-to-everything-off (estopBoundUs) is set by the I2C
+// bus: the task may have to wait for a transaction loop() already started.
+// It holds except while flash is being written (teach, /seq, /backup), which
+// holds off both cores; the measured worst is kept next to it in /estop.
+#if HEBA_HAS_CHASSIS
+void IRAM_ATTR estopPinLow(int8_t pin) {
+  if (pin < 0) return;
+  if (pin < 32) GPIO.out_w1tc = 1UL << pin;
+  else          GPIO.out1_w1tc.val = 1UL << (pin - 32);
+}
+
+// Register writes only, safe in the ISR. ENA/ENB reach their pins from the
+// LEDC through the GPIO matrix, so they are handed back to the (low) output
+// latch; IN1..IN4 low covers boards with the enables strapped high.
+void IRAM_ATTR estopCutMotors() {
+  estopPinLow(kPins.ena);
+  estopPinLow(kPins.enb);
+  if (kPins.ena >= 0) gpio_matrix_out(kPins.ena, SIG_GPIO_OUT_IDX, false, false);
+  if (kPins.enb >= 0) gpio_matrix_out(kPins.enb, SIG_GPIO_OUT_IDX, false, false);
+  estopPinLow(kPins.in1);
+  estopPinLow(kPins.in2);
+  estopPinLow(kPins.in3);
+  estopPinLow(kPins.in4);
+}
+#else
+void IRAM_ATTR estopCutMotors() {}
+#endif
+
+// First trigger wins, the rest are no-ops until the reset. Any context.
+void IRAM_ATTR estopTrip(uint8_t source) {
+  uint32_t t0 = micros();
+  if (__atomic_exchange_n(&estopLatched, true, __ATOMIC_ACQ_REL)) return;
+  estopCutMotors();
+  estopMotorUs = micros() - t0;
+  estopTripUs  = t0;
+  estopSource  = source;
+  if (xPortInIsrContext()) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(estopTask, &woken);
+    if (woken) portYIELD_FROM_ISR();
+  } else {
+    xTaskNotifyGive(estopTask);
+  }
+}
+
+void IRAM_ATTR estopIsr() {
+  estopTrip(ESTOP_PIN);
+}
+
+// Highest priority on the loop() core: preempts it, waits at most for the
+// I2C transaction it has on the bus
+void estopOutputsTask(void* arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    bool cut = pcaOk && pcaAllOff();
+    uint32_t us = micros() - estopTripUs;
+    estopOutputsUs = us;
+    if (us > estopWorstUs) estopWorstUs = us;
+    estopCount++;
+    logEvent(EV_ESTOP, estopSource, min((uint32_t)estopMotorUs, (uint32_t)INT16_MAX), min(us, (uint32_t)INT16_MAX),
+             min(estopBoundUs, (uint32_t)INT16_MAX), cut);
+  }
+}
+
+// High-priority network path, for the boards whose front-end is HTTP or
+// RoboRemo: a datagram starting with "ESTOP" on ESTOP_UDP_PORT trips at once
+// (echo -n ESTOP | nc -u -w1 192.168.4.1 4210). Answers "TRIPPED".
+void estopUdpTask(void* arg) {
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  sockaddr_in addr = {};
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(ESTOP_UDP_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (sock < 0 || bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (sock >= 0) close(sock);
+    vTaskDelete(NULL);
+    return;
+  }
+
+  char buf[16];
+  for (;;) {
+    sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    int n = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr*)&from, &fromLen);
+    if (n < 5 || memcmp(buf, "ESTOP", 5) != 0) continue;
+    estopTrip(ESTOP_UDP);
+    sendto(sock, "TRIPPED", 7, 0, (sockaddr*)&from, fromLen);
+  }
+}
+
+// First thing in setup(), before the tether can take an ESTOP: a trip that
+// early cuts the motors, the servo outputs go off with pcaBegin()
+void estopTaskBegin() {
+  xTaskCreatePinnedToCore(estopOutputsTask, "estop", 2048, NULL, configMAX_PRIORITIES - 1, &estopTask, 1);
+}
+
+// Called in setup() once the I2C bus is up (the bound depends on its clock)
+void estopBegin() {
+  estopBoundUs = ESTOP_ENTRY_US + 2 * ESTOP_I2C_SETUP_US + ESTOP_I2C_BITS * 1000000UL / Wire.getClock();
+  if (kPins.estop < 0) return;
+  pinMode(kPins.estop, INPUT_PULLUP);
+  attachInterrupt(kPins.estop, estopIsr, FALLING);
+  if (digitalRead(kPins.estop) == LOW) estopTrip(ESTOP_PIN);   // held down through the reset
+}
+
+// loop() side of a trip: playback and missions end, every joint is limp
+void estopService() {
+  if (!estopLatched || estopHandled) return;
+  estopHandled = true;
+  homingJoint  = -1;
+  stopAll();
+  for (int j=0;j<NUM_SERVOS;j++) {
+    outputValid[j] = false;
+    movePending[j] = false;
+  }
+  updateLEDs();
+  showStatus("EMERGENCY STOP", "reset to resume");
+}
+
+// Only once the switch is released. The joints come back through the
+// soft-start homing, as at boot.
+bool estopReset() {
+  if (!estopLatched) return true;
+  if (kPins.estop >= 0 && digitalRead(kPins.estop) == LOW) return false;
+  stopMotors();
+#if HEBA_HAS_CHASSIS
+  if (kPins.ena >= 0) {
+    ledcAttachPin(kPins.ena, 0);
+    ledcAttachPin(kPins.enb, 1);
+  }
+#endif
+  estopHandled = false;
+  __atomic_store_n(&estopLatched, false, __ATOMIC_RELEASE);
+  startHoming();
+  updateLEDs();
+  logEvent(EV_ESTOP_CLEAR, estopCount);
+  return true;
+}
+
+// ========== Ultrasonic distance ==========
+#if HEBA_HAS_SONAR
+// Sensors are fired round-robin from loop(). The echo pulse is timed by a
+// pin interrupt, so nothing waits on pulseIn(). A sensor may only fire once
+// the previous ping can no longer produce an echo (crosstalk). An opposite
+// sensor can't hear that ping, so it may fire as soon as the echo is in.
+struct SonarState {
+  uint16_t raw[3];              // last readings, cm
+  uint8_t  next;                // ring position in raw[]
+  uint16_t cm;                  // median of raw[]
+  unsigned long updatedMs;
+  uint32_t readings;
+};
+
+SonarState sonar[NUM_SONARS];
+volatile int8_t   sonarActive = -1;   // sensor whose echo the ISR is timing
+volatile uint32_t sonarRiseUs = 0;
+volatile uint32_t sonarFallUs = 0;
+uint8_t       sonarIndex   = 0;
+bool          sonarWaiting = false;  // ping out, echo not in yet
+uint32_t      sonarFireUs  = 0;
+uint32_t      sonarNextUs  = 0;      // earliest time for the next ping
+unsigned long sonarStartMs = 0;
+uint32_t      sonarRoundUs = 0;      // start of the current round
+
+// Injected readings from the host (see /sonar and heba_sonar_sim.py)
+bool     sonarSim = false;
+uint16_t sonarSimCm[NUM_SONARS];
+
+void IRAM_ATTR sonarEchoIsr(void* arg) {
+  int8_t i = (int8_t)(intptr_t)arg;
+  if (i != sonarActive) return;
+  uint32_t now = micros();
+  if (digitalRead(kSonars[i].echo)) {
+    if (sonarRiseUs == 0) sonarRiseUs = now;
+  } else if (sonarRiseUs != 0 && sonarFallUs == 0) {
+    sonarFallUs = now;
+  }
+}
+
+void sonarBegin() {
+  for (unsigned int i=0;i<NUM_SONARS;i++) {
+    pinMode(kSonars[i].trig, OUTPUT);
+    digitalWrite(kSonars[i].trig, LOW);
+    pinMode(kSonars[i].echo, INPUT);
+    attachInterruptArg(kSonars[i].echo, sonarEchoIsr, (void*)(intptr_t)i, CHANGE);
+
+    for (int k=0;k<3;k++) sonar[i].raw[k] = SONAR_NO_ECHO_CM;
+    sonar[i].cm = SONAR_NO_ECHO_CM;
+    sonarSimCm[i] = SONAR_NO_ECHO_CM;
+  }
+  sonarStartMs = millis();
+}
+
+void sonarFire(uint8_t i) {
+  sonarRiseUs = 0;
+  sonarFallUs = 0;
+  sonarActive = i;
+  digitalWrite(kSonars[i].trig, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(kSonars[i].trig, LOW);
+  sonarFireUs  = micros();
+  sonarWaiting = true;
+}
+
+void sonarStore(uint8_t i, uint16_t cm) {
+  SonarState &st = sonar[i];
+  st.raw[st.next] = cm;
+  st.next = (st.next + 1) % 3;
+
+  // median of 3 drops single ghost echoes and missed pings
+  uint16_t a = st.raw[0], b = st.raw[1], c = st.raw[2];
+  st.cm = max(min(a, b), min(max(a, b), c));
+  st.updatedMs = millis();
+  st.readings++;
+}
+
+// Called every loop, returns immediately
+void updateSonars() {
+  uint32_t now = micros();
+
+  if (sonarWaiting) {
+    uint32_t rise = sonarRiseUs, fall = sonarFallUs;
+    uint16_t cm;
+    if (fall != 0) {
+      uint32_t width = fall - rise;
+      cm = width > SONAR_MAX_ECHO_US ? SONAR_NO_ECHO_CM : width / 58;
+    } else if (now - sonarFireUs > SONAR_TIMEOUT_US) {
+      cm = SONAR_NO_ECHO_CM;   // no echo or sensor missing
+    } else {
+      return;
+    }
+    sonarActive  = -1;
+    sonarWaiting = false;
+    uint8_t i = sonarIndex;
+    sonarStore(i, sonarSim ? sonarSimCm[i] : cm);
+
+    sonarIndex = (sonarIndex + 1) % NUM_SONARS;
+    bool opposite = NUM_SONARS > 1 && (kSonars[i].dir ^ kSonars[sonarIndex].dir) == 1;
+    sonarNextUs = opposite ? now + SONAR_OPPOSITE_US
+                           : max((uint32_t)(sonarFireUs + SONAR_MAX_ECHO_US + SONAR_GUARD_US), now);
+    return;
+  }
+
+  if ((int32_t)(now - sonarNextUs) < 0) return;
+  if (sonarIndex == 0) {
+    // idle: one round per SLEEP_TICK_MS is enough to notice someone
+    if (powerState != PWR_ACTIVE && now - sonarRoundUs < SLEEP_TICK_MS * 1000UL) return;
+    sonarRoundUs = now;
+  }
+  sonarFire(sonarIndex);
+}
+
+// Nearest reading from the sensors facing the way the robot is moving.
+// Standing still (arm work) and driving forward watch the front. Stopped
+// for an obstacle, the motors are off: the sensors facing the paused
+// motion decide when the path is clear, since that is where it resumes.
+long obstacleDistance(uint8_t* dirOut) {
+  int16_t left  = currentLeftSpeed;
+  int16_t right = currentRightSpeed;
+  if (currentMode == MODE_OBSTACLE_STOP) {
+    left  = pausedLeft;
+    right = pausedRight;
+  }
+  uint8_t mask = 1 << DIR_FRONT;
+  if (left < 0 && right < 0) mask = 1 << DIR_REAR;
+  else if (left < right)     mask |= 1 << DIR_LEFT;
+  else if (left > right)     mask |= 1 << DIR_RIGHT;
+
+  long best = SONAR_NO_ECHO_CM;
+  *dirOut = DIR_FRONT;
+  bool any = false;
+  for (unsigned int i=0;i<NUM_SONARS;i++) {
+    if (!(mask & (1 << kSonars[i].dir))) continue;
+    any = true;
+    if (sonar[i].cm < best) {
+      best = sonar[i].cm;
+      *dirOut = kSonars[i].dir;
+    }
+  }
+  // No sensor that way (single sensor build): fall back to the front one
+  if (!any) {
+    for (unsigned int i=0;i<NUM_SONARS;i++) {
+      if (kSonars[i].dir == DIR_FRONT) best = min(best, (long)sonar[i].cm);
+    }
+  }
+  return best;
+}
+#endif
+
+// ========== LEDs by mode ==========
+void updateLEDs() {
+#if HEBA_HAS_LEDS
+  bool working = currentMode != MODE_IDLE && currentMode != MODE_OBSTACLE_STOP;
+  digitalWrite(kPins.ledYellow, currentMode == MODE_IDLE ? HIGH : LOW);
+  digitalWrite(kPins.ledGreen,  working && !estopLatched ? HIGH : LOW);
+  digitalWrite(kPins.ledRed,    currentMode == MODE_OBSTACLE_STOP || estopLatched ? HIGH : LOW);
+#endif
+}
+
+// ========== LCD update ==========
+const char* modeToStr(RobotMode m) {
+  switch (m) {
+    case MODE_IDLE:          return "IDLE";
+    case MODE_CLEANING:      return "CLEANING";
+    case MODE_WATER:         return "WATER";
+    case MODE_MEDICINE:      return "MEDICINE";
+    case MODE_GARBAGE:       return "GARBAGE";
+    case MODE_ARM:           return "ARM";
+    case MODE_OBSTACLE_STOP: return "OBSTACLE";
+  }
+  return "UNKNOWN";
+}
+
+void showStatus(const char* line1, const char* line2) {
+#if HEBA_HAS_LCD
+  if (!lcdOk) return;
+  lcd.clear();
+  lcd.setCursor(0,0);
+  lcd.print(line1);
+  lcd.setCursor(0,1);
+  lcd.print(line2);
+#endif
+}
+
+void updateLCD() {
+#if HEBA_HAS_LCD
+  char line1[17];
+  char line2[17];
+#if HEBA_HAS_RTC
+  if (clockValid) {
+    DateTime now(clockNow());
+    snprintf(line1, sizeof(line1), "%02d:%02d %s", now.hour(), now.minute(), modeToStr(currentMode));
+  } else
+#endif
+  snprintf(line1, sizeof(line1), "%s", modeToStr(currentMode));
+
+  if (estopLatched) {
+    snprintf(line2, sizeof(line2), "E-STOP: reset");
+  } else if (playing) {
+    snprintf(line2, sizeof(line2), "Step: %d/%d", playIndex + 1, seqLen[playSlot]);
+  } else if (teachSlot >= 0) {
+    snprintf(line2, sizeof(line2), "Teach %s: %d", slots[teachSlot].key, seqLen[teachSlot]);
+  } else {
+    snprintf(line2, sizeof(line2), "Dist:%3ldcm", lastDistanceCm);
+  }
+  showStatus(line1, line2);
+#endif
+}
+
+// ========== Sequence storage (LittleFS) ==========
+// One file of Pose frames per slot: /seq<slot>.pos. Replacements are written
+// to /seq<slot>.tmp first and renamed, so a failed upload keeps the old one.
+void seqPath(int slot, const char* ext, char* out) {
+  snprintf(out, 16, "/seq%d.%s", slot, ext);
+}
+
+// Boot only looks at the file size; frames are read when they play
+void countSequence(int slot) {
+  char path[16];
+  seqPath(slot, "pos", path);
+  File f = LittleFS.open(path, FILE_READ);
+  seqLen[slot] = f ? min(f.size() / sizeof(Pose), (size_t)MAX_FRAMES) : 0;
+  f.close();
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+  if (slot == SLOT_CLEAN) {
+    seqDemo = seqLen[slot] == 0;
+    if (seqDemo) seqLen[slot] = DEMO_FRAMES;
+  }
+#endif
+  logEvent(EV_SEQ_LOADED, slot, seqLen[slot]);
+}
+
+// Frames really stored for the slot (the demo is not: backups skip it)
+uint16_t storedLen(int slot) {
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+  if (slot == SLOT_CLEAN && seqDemo) return 0;
+#endif
+  return seqLen[slot];
+}
+
+// Same as readFrames, seqLock already held
+int loadFrames(int slot, int first, Pose* out, int count) {
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+  if (slot == SLOT_CLEAN && seqDemo) {
+    int n = constrain(DEMO_FRAMES - first, 0, count);
+    memcpy(out, &demoSeq[first], n * sizeof(Pose));
+    return n;
+  }
+#endif
+  char path[16];
+  seqPath(slot, "pos", path);
+  File f = LittleFS.open(path, FILE_READ);
+  int n = 0;
+  if (f && f.seek(first * sizeof(Pose))) {
+    n = f.read((uint8_t*)out, count * sizeof(Pose)) / sizeof(Pose);
+  }
+  f.close();
+  return n;
+}
+
+// Reads up to 'count' frames starting at 'first', returns how many
+int readFrames(int slot, int first, Pose* out, int count) {
+  xSemaphoreTake(seqLock, portMAX_DELAY);
+  int n = loadFrames(slot, first, out, count);
+  xSemaphoreGive(seqLock);
+  return n;
+}
+
+bool appendFrame(int slot, const Pose &p) {
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+  // the first taught frame replaces the demo
+  if (slot == SLOT_CLEAN && seqDemo) {
+    seqDemo = false;
+    seqLen[slot] = 0;
+  }
+#endif
+  if (seqLen[slot] >= MAX_FRAMES) return false;
+  char path[16];
+  seqPath(slot, "pos", path);
+  xSemaphoreTake(seqLock, portMAX_DELAY);
+  File f = LittleFS.open(path, FILE_APPEND);
+  bool ok = f && f.write((const uint8_t*)&p, sizeof(Pose)) == sizeof(Pose);
+  f.close();
+  xSemaphoreGive(seqLock);
+  if (ok) seqLen[slot]++;
+  return ok;
+}
+
+void clearSequence(int slot) {
+  char path[16];
+  seqPath(slot, "pos", path);
+  xSemaphoreTake(seqLock, portMAX_DELAY);
+  LittleFS.remove(path);
+  xSemaphoreGive(seqLock);
+  seqLen[slot] = 0;
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+  if (slot == SLOT_CLEAN) seqDemo = false;
+#endif
+  logEvent(EV_SEQ_SAVED, slot, 0);
+}
+
+// Swap /seq<slot>.tmp in (after a complete upload), or drop it
+void commitSequence(int slot, bool keep) {
+  char path[16], tmp[16];
+  seqPath(slot, "pos", path);
+  seqPath(slot, "tmp", tmp);
+  xSemaphoreTake(seqLock, portMAX_DELAY);
+  if (keep) {
+    LittleFS.remove(path);
+    LittleFS.rename(tmp, path);
+  } else {
+    LittleFS.remove(tmp);
+  }
+  xSemaphoreGive(seqLock);
+  if (keep) {
+    countSequence(slot);
+    logEvent(EV_SEQ_SAVED, slot, seqLen[slot]);
+  }
+}
+
+// "water"/"med"/"garbage"/"clean" ("arm") -> slot, -1 if unknown
+int slotFromName(const String &name) {
+  for (int s=0;s<NUM_SLOTS;s++) {
+    if (name == slots[s].key) return s;
+  }
+  return -1;
+}
+
+// Returns byte count or -1 on bad hex / too long
+int hexToBytes(const String &hex, uint8_t* out, int maxLen) {
+  if (hex.length() % 2 != 0 || (int)hex.length() / 2 > maxLen) return -1;
+  for (unsigned int i=0; i<hex.length(); i+=2) {
+    char b[3] = {hex[i], hex[i + 1], 0};
+    char* end;
+    out[i / 2] = strtol(b, &end, 16);
+    if (*end != 0) return -1;
+  }
+  return hex.length() / 2;
+}
+
+int16_t readI16(const uint8_t* p) { return (int16_t)(p[0] | (p[1] << 8)); }
+uint16_t readU16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+
+// Degrees as typed ("90", "90.5") -> position
+int parsePos(const String &deg) {
+  return constrain((int)lroundf(deg.toFloat() * POS_SCALE), 0, POS_MAX);
+}
+
+// "90,45.5,120" -> positions, parsePos() on each; returns how many were read
+int parsePosList(const String &list, int* out, int maxCount) {
+  int n = 0;
+  int from = 0;
+  while (n < maxCount && from < (int)list.length()) {
+    int comma = list.indexOf(',', from);
+    if (comma < 0) comma = list.length();
+    out[n++] = parsePos(list.substring(from, comma));
+    from = comma + 1;
+  }
+  return n;
+}
+
+// "90,45,120" -> values, returns how many were read (at most maxCount)
+int parseList(const String &list, int* out, int maxCount) {
+  int n = 0;
+  int from = 0;
+  while (n < maxCount && from < (int)list.length()) {
+    int comma = list.indexOf(',', from);
+    if (comma < 0) comma = list.length();
+    out[n++] = list.substring(from, comma).toInt();
+    from = comma + 1;
+  }
+  return n;
+}
+
+String bytesToHex(const uint8_t* data, int len) {
+  String hex;
+  hex.reserve(len * 2);
+  for (int i=0;i<len;i++) {
+    char b[3];
+    snprintf(b, sizeof(b), "%02x", data[i]);
+    hex += b;
+  }
+  return hex;
+}
+
+// ========== Save current pose to sequence ==========
+// Appended to the slot's file right away
+bool savePoseToSeq(int slot, uint16_t durMs) {
+  Pose p;
+  for (int i=0;i<NUM_ARM_SERVOS;i++) p.servo[i] = currentServoAngles[i];
+  p.leftSpeed  = currentLeftSpeed;
+  p.rightSpeed = currentRightSpeed;
+  p.durationMs = durMs;
+  if (!appendFrame(slot, p)) return false;
+
+  logEvent(EV_TEACH_STEP, seqLen[slot]);
+  // whole degrees, as the log always had them
+  logEvent(EV_TEACH_SERVOS_A, p.servo[0] / POS_SCALE, p.servo[1] / POS_SCALE, p.servo[2] / POS_SCALE,
+           p.servo[3] / POS_SCALE, p.servo[4] / POS_SCALE);
+  logEvent(EV_TEACH_SERVOS_B, p.servo[5] / POS_SCALE);
+  return true;
+}
+
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+// ========== Hardcoded DEMO cleaning sequence ==========
+// Only used until a cleaning sequence has been taught and saved. Kept in
+// RAM (demoSeq), so the cleaning slot on flash stays empty until then.
+void initDemoCleaningSequence() {
+  const Pose head[] = {
+    {{900, 900, 900, 900, 900, 600},    0,    0,  800},   // neutral arm, robot still
+    {{900, 900, 900, 900, 900, 600},  140,  140, 1800}    // slight forward move
+  };
+  const Pose tail[] = {
+    {{900, 900, 900, 900, 900, 600}, -140, -140, 1800},   // move back
+    {{900, 900, 900, 900, 900, 600},    0,    0, 1000}    // stop
+  };
+  int n = 0;
+  for (unsigned int i=0;i<sizeof(head) / sizeof(head[0]);i++) demoSeq[n++] = head[i];
+
+  // LEFT / RIGHT sweep: one period of a sine turn, sampled at the end of each frame
+  const int SWEEP_FRAMES = 8, SWEEP_MS = 1600, SWEEP_SPEED = 120;
+  static_assert(sizeof(head) / sizeof(head[0]) + SWEEP_FRAMES + sizeof(tail) / sizeof(tail[0]) == DEMO_FRAMES,
+                "DEMO_FRAMES");
+  Pose p = tail[1];
+  for (int k=1;k<=SWEEP_FRAMES;k++) {
+    int16_t v = waveValue(WAVE_SINE, (uint16_t)(32768 + k * 65536UL / SWEEP_FRAMES), SWEEP_SPEED);
+    p.leftSpeed  = v;
+    p.rightSpeed = -v;
+    p.durationMs = SWEEP_MS / SWEEP_FRAMES;
+    demoSeq[n++] = p;
+  }
+
+  for (unsigned int i=0;i<sizeof(tail) / sizeof(tail[0]);i++) demoSeq[n++] = tail[i];
+}
+#endif
+
+// ========== Playback ==========
+// Largest joint move from the current arm state to a stored frame
+int poseDistance(const Pose &p, int* sum) {
+  int maxDelta = 0;
+  *sum = 0;
+  for (int j=0;j<NUM_ARM_SERVOS;j++) {
+    int d = abs((int)p.servo[j] - (int)currentServoAngles[j]);
+    maxDelta = max(maxDelta, d);
+    *sum += d;
+  }
+  return maxDelta;
+}
+
+// Nearest stored frame in joint space. The largest joint delta decides
+// how long the transition takes, so rank by that (ties: total motion).
+// After a STOP only frames from the interrupted one onward are considered,
+// so a pose repeated at the start/end of a sequence can't skip the mission.
+int findNearestFrame(int slot) {
+  int first = interruptedIndex > 0 ? interruptedIndex - 1 : 0;
+  int best = first;
+  int bestMax = POS_MAX + 1, bestSum = 0;
+
+  // streamed from flash a block at a time
+  Pose buf[WINDOW_FRAMES];
+  for (int i=first; i<seqLen[slot]; i+=WINDOW_FRAMES) {
+    int n = readFrames(slot, i, buf, WINDOW_FRAMES);
+    for (int k=0;k<n;k++) {
+      int sum;
+      int maxDelta = poseDistance(buf[k], &sum);
+      if (maxDelta < bestMax || (maxDelta == bestMax && sum < bestSum)) {
+        best = i + k;
+        bestMax = maxDelta;
+        bestSum = sum;
+      }
+    }
+    if (n < WINDOW_FRAMES) break;
+  }
+  return best;
+}
+
+// ---------- Read-ahead window ----------
+// Fills the buffer of the block starting at 'first' (loader task, or loop when priming)
+void windowLoadBlock(int32_t first) {
+  FrameBlock &b = window[(first / WINDOW_FRAMES) & 1];
+
+  xSemaphoreTake(seqLock, portMAX_DELAY);
+  __atomic_store_n(&b.first, -1, __ATOMIC_RELEASE);
+  b.count = loadFrames(windowSlot, first, b.frames, WINDOW_FRAMES);
+  // a clock change while compiling leaves the old generation: seen as stale
+  b.clockGen = __atomic_load_n(&pcaClockGen, __ATOMIC_ACQUIRE);
+  for (int k=0;k<b.count;k++) {
+    for (int j=0;j<NUM_ARM_SERVOS;j++) pcaCompile(j, b.frames[k].servo[j], b.regs[k][j]);
+  }
+  b.slot = windowSlot;
+  __atomic_store_n(&b.first, first, __ATOMIC_RELEASE);
+  xSemaphoreGive(seqLock);
+}
+
+void windowLoaderTask(void* arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int32_t want = __atomic_exchange_n(&windowWant, -1, __ATOMIC_ACQ_REL);
+    if (want >= 0) windowLoadBlock(want);
+  }
+}
+
+// Ask the loader for the block starting at 'first' (returns at once)
+void windowRequest(int32_t first) {
+  if (first >= seqLen[windowSlot]) return;
+  __atomic_store_n(&windowWant, first, __ATOMIC_RELEASE);
+  xTaskNotifyGive(windowTask);
+}
+
+// Frame i if its block is in RAM, NULL if the loader hasn't got there yet
+const Pose* windowFrame(int i) {
+  const FrameBlock &b = window[(i / WINDOW_FRAMES) & 1];
+  int32_t first = __atomic_load_n(&b.first, __ATOMIC_ACQUIRE);
+  if (first != i - i % WINDOW_FRAMES || b.slot != windowSlot || i - first >= b.count) return NULL;
+  return &b.frames[i - first];
+}
+
+// Registers of frame i (NUM_ARM_SERVOS x 4), NULL when the clock has changed
+// since they were compiled. Only valid together with windowFrame(i).
+const uint8_t* windowRegs(int i) {
+  const FrameBlock &b = window[(i / WINDOW_FRAMES) & 1];
+  if (b.clockGen != __atomic_load_n(&pcaClockGen, __ATOMIC_ACQUIRE)) return NULL;
+  return b.regs[i % WINDOW_FRAMES][0];
+}
+
+void windowInvalidate() {
+  xSemaphoreTake(seqLock, portMAX_DELAY);
+  window[0].first = -1;
+  window[1].first = -1;
+  xSemaphoreGive(seqLock);
+}
+
+// Block of 'index' is read right away (start of playback), the next one ahead
+void windowPrime(int slot, int index) {
+  windowSlot = slot;
+  windowInvalidate();
+  windowLoadBlock(index - index % WINDOW_FRAMES);
+  windowRequest(index - index % WINDOW_FRAMES + WINDOW_FRAMES);
+}
+
+// Velocity-limited move into frame 'index', then normal playback from there
+void startTransition(int slot, int index) {
+  readFrames(slot, index, &transitionTarget, 1);
+  windowPrime(slot, index);
+
+  int sum;
+  int maxDelta = poseDistance(transitionTarget, &sum);
+
+  for (int j=0;j<NUM_ARM_SERVOS;j++) transitionFrom[j] = currentServoAngles[j];
+  // down to half speed on a throttled battery
+  transitionMs       = (unsigned long)maxDelta * 1000 * 512 / (DEG(TRANSITION_DEG_PER_SEC) * (512 - battThrottle));
+  transitionStart    = millis();
+  lastTransitionTick = 0;
+  transitioning      = true;
+  playSkipMs         = 0;
+  ckptDirty          = true;
+
+  playSlot       = slot;
+  playIndex      = index;
+  lastFrameIndex = -1;
+  playing        = true;
+  playbackPaused = false;
+  currentMode    = slots[slot].mode;
+  updateLEDs();
+}
+
+#if HEBA_HAS_MISSIONS
+void stopMission();
+#endif
+
+void startPlay(int slot) {
+  if (slot < 0 || slot >= NUM_SLOTS || seqLen[slot] == 0) return;
+#if HEBA_HAS_MISSIONS
+  if (missionRunning) stopMission();
+#endif
+  interruptedIndex = -1;
+  startTransition(slot, 0);
+  logEvent(EV_PLAY_START, slot);
+}
+
+// Continue from the stored frame closest to where the arm is now
+void resumePlay(int slot) {
+  if (slot < 0 || slot >= NUM_SLOTS || seqLen[slot] == 0 || estopLatched) return;
+  if (slot != playSlot || interruptedIndex >= seqLen[slot]) interruptedIndex = -1;
+
+  int index = findNearestFrame(slot);
+  startTransition(slot, index);
+  logEvent(EV_RESUME, index, transitionMs);
+}
+
+void finishPlay() {
+  playing        = false;
+  transitioning  = false;
+  playbackPaused = false;
+  lastFrameIndex = -1;
+  stopMotors();
+  currentMode = MODE_IDLE;
+  updateLEDs();
+}
+
+void stopPlay() {
+  if (!playing) return;
+  interruptedIndex = playIndex;
+  logEvent(EV_PLAY_STOP, playSlot, playIndex);
+  finishPlay();
+}
+
+// Interpolate all joints so they arrive together
+void handleTransition(unsigned long now) {
+  if (now - lastTransitionTick < TRANSITION_TICK_MS) return;
+  lastTransitionTick = now;
+
+  unsigned long elapsed = now - transitionStart;
+  if (elapsed >= transitionMs) {
+    transitioning = false;  // frame gets applied exactly by handlePlayback()
+    return;
+  }
+
+  const Pose &target = transitionTarget;
+  for (int j=0;j<NUM_ARM_SERVOS;j++) {
+    int pos = transitionFrom[j] + (long)(target.servo[j] - transitionFrom[j]) * (long)elapsed / (long)transitionMs;
+    queueServo(j, pos);
+  }
+  updateMotionScheduler();
+}
+
+// Playback step (called in loop)
+void handlePlayback() {
+  if (!playing || playbackPaused) return;
+
+  unsigned long now = millis();
+
+  if (transitioning) {
+    handleTransition(now);
+    if (transitioning) return;
+  }
+
+  const Pose* cur = windowFrame(playIndex);
+  if (cur == NULL) {
+    // Flash fell behind: hold the previous frame until the block is in
+    windowStalls++;
+    if (__atomic_load_n(&windowWant, __ATOMIC_ACQUIRE) < 0) windowRequest(playIndex - playIndex % WINDOW_FRAMES);
+    return;
+  }
+
+  // Apply current frame once when index changes
+  if (playIndex != lastFrameIndex) {
+    const uint8_t* regs = windowRegs(playIndex);
+    for (int i=0;i<NUM_ARM_SERVOS;i++) {
+      if (regs) queueServoImage(i, cur->servo[i], regs + 4 * i);
+      else      queueServo(i, cur->servo[i]);   // recalibrated since the block was read
+    }
+    updateMotionScheduler();
+    setMotors(cur->leftSpeed, cur->rightSpeed);
+    frameStartTime = now - playSkipMs;
+    playSkipMs     = 0;
+    lastFrameIndex = playIndex;
+    ckptDirty      = true;
+    // First frame of a block: the other buffer is free, read ahead into it
+    if (playIndex % WINDOW_FRAMES == 0) windowRequest(playIndex + WINDOW_FRAMES);
+  }
+
+  if (now - frameStartTime >= cur->durationMs) {
+    playIndex++;
+    if (playIndex >= seqLen[playSlot]) {
+      interruptedIndex = -1;
+      logEvent(EV_PLAY_DONE, playSlot);
+      finishPlay();
+    }
+  }
+}
+
+#if HEBA_HAS_MISSIONS
+// ========== Mission interpreter (called in loop) ==========
+uint8_t missionOpSize(uint8_t op) {
+  switch (op) {
+    case OP_END:        return 1;
+    case OP_POSE:       return 1 + NUM_ARM_SERVOS;
+    case OP_DRIVE:      return 7;
+    case OP_WAIT:       return 3;
+    case OP_WAIT_CLEAR: return 4;
+    case OP_REPEAT:     return 2;
+    case OP_LOOP:       return 1;
+    case OP_WIPER:      return 2;
+    case OP_SERVO:      return 3;
+    case OP_MOVE:       return 3 + NUM_ARM_SERVOS;
+    case OP_SYNC:       return 2;
+    case OP_WAVE:       return 10;
+  }
+  return 0;  // unknown
+}
+
+// Track kind an op belongs to, TRACK_ALL = any track
+uint8_t missionOpTrack(const uint8_t* ip) {
+  switch (ip[0]) {
+    case OP_POSE:
+    case OP_MOVE:  return TRACK_ARM;
+    case OP_DRIVE: return TRACK_BASE;
+    case OP_WIPER: return TRACK_WIPER;
+    case OP_SERVO: return ip[1] < NUM_ARM_SERVOS ? TRACK_ARM : TRACK_WIPER;
+    case OP_WAVE:  return ip[1] == WAVE_CHASSIS ? TRACK_BASE : ip[1] < NUM_ARM_SERVOS ? TRACK_ARM : TRACK_WIPER;
+  }
+  return TRACK_ALL;
+}
+
+// One track from 'pc' to its OP_END; collects the sync ids it uses, and
+// in after[id] the id it meets next
+bool verifyTrack(const uint8_t* code, uint16_t len, uint16_t pc, uint8_t kind, uint32_t* syncMask,
+                 uint32_t* after) {
+  int depth = 0;
+  int prevSync = -1;
+  *syncMask = 0;
+  while (pc < len) {
+    const uint8_t* ip = &code[pc];
+    uint8_t op = ip[0];
+    uint8_t size = missionOpSize(op);
+    if (size == 0 || pc + size > len) return false;
+    uint8_t owner = missionOpTrack(ip);
+    if (kind != TRACK_ALL && owner != TRACK_ALL && owner != kind) return false;
+    if (op == OP_REPEAT) {
+      if (ip[1] == 0 || ++depth > MISSION_MAX_DEPTH) return false;
+    } else if (op == OP_LOOP) {
+      if (--depth < 0) return false;
+    } else if (op == OP_POSE || op == OP_MOVE) {
+      for (int i=0;i<NUM_ARM_SERVOS;i++) if (ip[1 + i] > 180) return false;
+    } else if (op == OP_SERVO) {
+      if (ip[1] >= NUM_SERVOS || ip[2] > 180) return false;
+#if HEBA_HAS_WIPER
+    } else if (op == OP_WIPER) {
+      if (ip[1] > WIPER_MAX_ANGLE && ip[1] != WIPER_SWEEP) return false;
+#endif
+    } else if (op == OP_WAVE) {
+      if ((ip[1] >= NUM_SERVOS && ip[1] != WAVE_CHASSIS) || ip[2] >= WAVE_SHAPES) return false;
+    } else if (op == OP_SYNC) {
+      // once per track and never inside a repeat, so every sync id is one barrier
+      if (depth > 0 || ip[1] >= MISSION_SYNC_IDS || (*syncMask & (1UL << ip[1]))) return false;
+      *syncMask |= 1UL << ip[1];
+      if (prevSync >= 0) after[prevSync] |= 1UL << ip[1];
+      prevSync = ip[1];
+    } else if (op == OP_END) {
+      return depth == 0;
+    }
+    pc += size;
+  }
+  return false;  // no OP_END
+}
+
+// All tracks have to meet their sync ids in one common order. Two tracks
+// meeting at 1 then 2 and at 2 then 1 (or three going round in a circle)
+// would each wait for the other forever. after[] is closed transitively;
+// an id that ends up after itself is such a cycle.
+bool syncOrderOk(uint32_t* after) {
+  for (int k=0;k<MISSION_SYNC_IDS;k++) {
+    for (int i=0;i<MISSION_SYNC_IDS;i++) {
+      if (after[i] & (1UL << k)) after[i] |= after[k];
+    }
+  }
+  for (int i=0;i<MISSION_SYNC_IDS;i++) {
+    if (after[i] & (1UL << i)) return false;
+  }
+  return true;
+}
+
+// Fills missionTracks[] when 'tracks' is given; checked once on upload so
+// the interpreter can trust the program
+bool verifyMission(const uint8_t* code, uint16_t len, MissionTrack* tracks, uint8_t* count) {
+  MissionTrack local[MISSION_TRACKS];
+  uint32_t after[MISSION_SYNC_IDS] = {0};
+  if (!tracks) tracks = local;
+  if (len < 2) return false;
+
+  if (code[0] == 1) {
+    *count = 1;
+    tracks[0].kind = TRACK_ALL;
+    tracks[0].pc   = 1;
+    return verifyTrack(code, len, 1, TRACK_ALL, &tracks[0].syncMask, after);
+  }
+  if (code[0] != MISSION_VERSION) return false;
+
+  uint8_t n = code[1];
+  uint16_t table = 2 + 3 * n;
+  if (n == 0 || n > MISSION_TRACKS || table > len) return false;
+  uint8_t kinds = 0;
+  for (int t=0;t<n;t++) {
+    const uint8_t* e = &code[2 + 3 * t];
+    uint8_t kind = e[0];
+    uint16_t start = readU16(&e[1]);
+    if (kind == TRACK_ALL || kind > TRACK_WIPER || (kinds & (1 << kind)) || start < table) return false;
+    kinds |= 1 << kind;
+    tracks[t].kind = kind;
+    tracks[t].pc   = start;
+    if (!verifyTrack(code, len, start, kind, &tracks[t].syncMask, after)) return false;
+  }
+  if (!syncOrderOk(after)) return false;
+  *count = n;
+  return true;
+}
+
+bool verifyMission(const uint8_t* code, uint16_t len) {
+  uint8_t n;
+  return verifyMission(code, len, nullptr, &n);
+}
+
+void startMission(int slot) {
+  if (missionLen[slot] == 0) return;
+  if (playing) finishPlay();   // frame playback and missions never overlap
+  if (!verifyMission(missionProg[slot], missionLen[slot], missionTracks, &missionTrackCount)) return;
+  for (int t=0;t<missionTrackCount;t++) {
+    missionTracks[t].done   = false;
+    missionTracks[t].waitOp = OP_END;
+    missionTracks[t].depth  = 0;
+  }
+  missionSlotNow   = slot;
+  missionCode      = missionProg[slot];
+  missionRunning   = true;
+  playbackPaused   = false;
+  currentMode      = slots[slot].mode;
+  updateLEDs();
+  logEvent(EV_MISSION_START, slot, missionTrackCount);
+}
+
+void stopMission() {
+  if (!missionRunning) return;
+  logEvent(EV_MISSION_END, missionSlotNow);
+  missionRunning = false;
+  missionCode    = nullptr;
+  missionSlotNow = -1;
+#if HEBA_HAS_WIPER
+  wiperOverride  = -1;
+#endif
+  waveStopAll();
+  stopMotors();
+  currentMode = MODE_IDLE;
+  updateLEDs();
+}
+
+// Arm keyframe in progress: one interpolation step per servo period
+bool missionMoveStep(MissionTrack &t, unsigned long now) {
+  unsigned long elapsed = now - t.waitStart;
+  bool last = elapsed >= t.waitMs;
+  if (!last && now - t.lastTick < TRANSITION_TICK_MS) return false;
+  t.lastTick = now;
+  for (int j=0;j<NUM_ARM_SERVOS;j++) {
+    int pos = last ? t.moveTo[j] : t.moveFrom[j] + (long)(t.moveTo[j] - t.moveFrom[j]) * (long)elapsed / (long)t.waitMs;
+    queueServo(j, pos);
+  }
+  updateMotionScheduler();
+  return last;
+}
+
+// A track is free to run on unless it waits. Timed waits are frozen while
+// paused; wait-until-clear keeps its own timeout.
+bool missionTrackBlocked(MissionTrack &t, unsigned long now) {
+  if (t.waitOp == OP_END) return false;
+  if (t.waitOp == OP_SYNC) return true;   // released by missionSync()
+  if (t.waitOp == OP_WAIT_CLEAR) {
+    bool clear   = currentMode != MODE_OBSTACLE_STOP && lastDistanceCm > t.clearCm;
+    bool timeout = t.waitMs > 0 && now - t.waitStart >= t.waitMs;
+    if (!clear && !timeout) return true;
+  } else if (playbackPaused) {
+    return true;
+  } else if (t.waitOp == OP_MOVE) {
+    if (!missionMoveStep(t, now)) return true;
+  } else if (now - t.waitStart < t.waitMs) {
+    return true;
+  }
+  t.waitOp = OP_END;
+  return false;
+}
+
+// Runs one track's ops until one of them has to wait (at most MISSION_OPS_PER_TICK)
+void runMissionTrack(MissionTrack &t, unsigned long now) {
+  ckptDirty = true;   // it goes on to its next wait (a keyframe) or ends
+  for (int n = 0; n < MISSION_OPS_PER_TICK; n++) {
+    const uint8_t* ip = &missionCode[t.pc];
+    uint8_t op = ip[0];
+    t.pc += missionOpSize(op);
+
+    switch (op) {
+      case OP_END:
+        t.done = true;
+        return;
+
+      case OP_POSE:
+        for (int i=0;i<NUM_ARM_SERVOS;i++) {
+          waveStop(i);
+          queueServo(i, DEG(ip[1 + i]));
+        }
+        updateMotionScheduler();
+        break;
+
+      case OP_MOVE:
+        for (int i=0;i<NUM_ARM_SERVOS;i++) {
+          waveStop(i);
+          t.moveFrom[i] = currentServoAngles[i];
+          t.moveTo[i]   = DEG(constrain(ip[1 + i], 0, 180));
+        }
+        t.waitOp    = OP_MOVE;
+        t.waitMs    = max(readU16(&ip[1 + NUM_ARM_SERVOS]), (uint16_t)1);
+        t.waitStart = now;
+        t.lastTick  = 0;
+        return;
+
+      case OP_DRIVE:
+        waveStop(WAVE_CHASSIS);
+        setMotors(readI16(&ip[1]), readI16(&ip[3]));
+        t.waitOp    = OP_DRIVE;
+        t.waitMs    = readU16(&ip[5]);
+        t.waitStart = now;
+        return;
+
+      case OP_WAIT:
+        t.waitOp    = OP_WAIT;
+        t.waitMs    = readU16(&ip[1]);
+        t.waitStart = now;
+        return;
+
+      case OP_WAIT_CLEAR:
+        t.waitOp    = OP_WAIT_CLEAR;
+        t.clearCm   = ip[1];
+        t.waitMs    = readU16(&ip[2]);
+        t.waitStart = now;
+        return;
+
+      case OP_SYNC:
+        t.waitOp = OP_SYNC;
+        t.syncId = ip[1];
+        return;
+
+      case OP_REPEAT:
+        t.loopPc[t.depth]   = t.pc;
+        t.loopLeft[t.depth] = ip[1];
+        t.depth++;
+        break;
+
+      case OP_LOOP:
+        if (--t.loopLeft[t.depth - 1] > 0) {
+          t.pc = t.loopPc[t.depth - 1];
+        } else {
+          t.depth--;
+        }
+        break;
+
+      case OP_WIPER:
+#if HEBA_HAS_WIPER
+        wiperOverride = ip[1];
+        if (wiperOverride != WIPER_SWEEP) {
+          waveStop(SERVO_WIPER);
+          wiperAngle = constrain(wiperOverride, WIPER_MIN_ANGLE, WIPER_MAX_ANGLE);
+          setServo(SERVO_WIPER, DEG(wiperAngle));
+        }
+#endif
+        break;
+
+      case OP_SERVO:
+        waveStop(ip[1]);
+        setServo(ip[1], DEG(ip[2]));
+        break;
+
+      case OP_WAVE: {
+        uint16_t period = readU16(&ip[7]);
+        bool servo = ip[1] != WAVE_CHASSIS;
+        if (period == 0) waveStop(ip[1]);
+        else waveStart(ip[1], ip[2], servo ? DEG(readI16(&ip[3])) : readI16(&ip[3]),
+                       servo ? DEG(readI16(&ip[5])) : readI16(&ip[5]), period, ip[9] << 8);
+        break;
+      }
+    }
+  }
+}
+
+// Sync barrier: id 'n' lets go once every track that has an OP_SYNC n
+// waits at it (tracks that have ended don't hold anyone up)
+void missionSync() {
+  for (int t=0;t<missionTrackCount;t++) {
+    MissionTrack &w = missionTracks[t];
+    if (w.done || w.waitOp != OP_SYNC) continue;
+    bool all = true;
+    for (int u=0;u<missionTrackCount;u++) {
+      const MissionTrack &o = missionTracks[u];
+      if (o.done || !(o.syncMask & (1UL << w.syncId))) continue;
+      if (o.waitOp != OP_SYNC || o.syncId != w.syncId) all = false;
+    }
+    if (!all) continue;
+    uint8_t id = w.syncId;
+    for (int u=0;u<missionTrackCount;u++) {
+      MissionTrack &o = missionTracks[u];
+      if (o.waitOp == OP_SYNC && o.syncId == id) o.waitOp = OP_END;
+    }
+  }
+}
+
+void runMission() {
+  if (!missionRunning) return;
+  unsigned long now = millis();
+
+  missionSync();
+  bool allDone = true;
+  for (int i=0;i<missionTrackCount;i++) {
+    MissionTrack &t = missionTracks[i];
+    if (t.done) continue;
+    allDone = false;
+    if (missionTrackBlocked(t, now)) continue;
+    // Don't start new moves into an obstacle
+    if (currentMode == MODE_OBSTACLE_STOP) continue;
+    runMissionTrack(t, now);
+    // a track ending while driving leaves the base where its last drive put it
+    if (t.done && t.kind == TRACK_BASE) stopMotors();
+  }
+  if (allDone) stopMission();
+}
+
+// ========== Mission storage (NVS) ==========
+void saveMission(int slot) {
+  char key[8];
+  snprintf(key, sizeof(key), "mis%d", slot);
+  prefs.begin("heba", false);
+  if (missionLen[slot] > 0) prefs.putBytes(key, missionProg[slot], missionLen[slot]);
+  else                      prefs.remove(key);
+  prefs.end();
+}
+
+void loadMissions() {
+  prefs.begin("heba", true);
+  for (int slot=0; slot<NUM_SLOTS; slot++) {
+    char key[8];
+    snprintf(key, sizeof(key), "mis%d", slot);
+    missionLen[slot] = 0;
+    if (!prefs.isKey(key)) continue;
+    size_t len = prefs.getBytes(key, missionProg[slot], MAX_MISSION_BYTES);
+    if (verifyMission(missionProg[slot], len)) missionLen[slot] = len;
+  }
+  prefs.end();
+}
+#endif
+
+// Play a slot: an uploaded mission takes precedence over taught frames
+void runSlot(int slot) {
+  if (estopLatched) return;
+#if HEBA_HAS_MISSIONS
+  if (missionLen[slot] > 0) {
+    startMission(slot);
+    return;
+  }
+#endif
+  startPlay(slot);
+}
+
+void stopAll() {
+  stopPlay();
+#if HEBA_HAS_MISSIONS
+  stopMission();
+#endif
+  waveStopAll();
+  stopMotors();
+  teachSlot = -1;
+}
+
+// ========== Backup image (binary, CRC-checked) ==========
+// Every taught sequence and mission of the unit in one stream, for /backup
+// and src/tools/heba_backup.py:
+//   "HEBA" version board slots 0             (8 byte header)
+//   per slot: slot 0 frames(u16) missionLen(u16) <frames x Pose> <mission>
+//   crc32 (zlib) of everything before it
+// Little-endian throughout. Both directions are streamed: frames go between
+// the sequence files and the network a block at a time. An upload lands in
+// /seq<slot>.tmp files and only replaces anything once the CRC has matched.
+#define IMAGE_VERSION 3        // 3: 18 byte Pose (0.1 degree); heba_backup.py converts 2
+#define IMAGE_HEADER  8
+#define IMAGE_RECORD  6
+#if HEBA_HAS_MISSIONS
+#define IMAGE_MISSION_BYTES MAX_MISSION_BYTES
+#else
+#define IMAGE_MISSION_BYTES 0
+#endif
+
+enum ImageState { IMG_HEADER, IMG_RECORD, IMG_FRAMES, IMG_MISSION, IMG_CRC, IMG_DONE, IMG_ERROR };
+
+struct ImageParser {
+  uint8_t  state;
+  uint8_t  buf[IMAGE_HEADER];  // header / record / crc being collected
+  uint8_t  fill;
+  uint8_t  records;            // records still to come
+  uint8_t  slotsSeen;          // bit per slot
+  int8_t   slot;
+  uint16_t misLen;
+  uint32_t left;               // bytes left of the current frames / mission
+  uint32_t crc;
+  File     file;
+};
+
+ImageParser img;
+#if HEBA_HAS_MISSIONS
+uint8_t  imageMission[NUM_SLOTS][MAX_MISSION_BYTES];
+uint16_t imageMissionLen[NUM_SLOTS];
+#endif
+
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *data++;
+    for (int k=0;k<8;k++) crc = (crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+  }
+  return ~crc;
+}
+
+uint16_t slotMissionLen(int slot) {
+#if HEBA_HAS_MISSIONS
+  return missionLen[slot];
+#else
+  return 0;
+#endif
+}
+
+// Bytes writeImage() will produce, for Content-Length
+size_t imageSize(int onlySlot) {
+  size_t len = IMAGE_HEADER + 4;
+  for (int s=0;s<NUM_SLOTS;s++) {
+    if (onlySlot >= 0 && s != onlySlot) continue;
+    len += IMAGE_RECORD + storedLen(s) * sizeof(Pose) + slotMissionLen(s);
+  }
+  return len;
+}
+
+// Image of one slot, or of all of them (slot = -1)
+void writeImage(int onlySlot, ImageSink sink) {
+  uint8_t head[IMAGE_HEADER] = {'H', 'E', 'B', 'A', IMAGE_VERSION, HEBA_BOARD,
+                                (uint8_t)(onlySlot < 0 ? NUM_SLOTS : 1), 0};
+  uint32_t crc = crc32Update(0, head, sizeof(head));
+  sink(head, sizeof(head));
+
+  for (int s=0;s<NUM_SLOTS;s++) {
+    if (onlySlot >= 0 && s != onlySlot) continue;
+    uint16_t misLen = slotMissionLen(s);
+    uint16_t frames = storedLen(s);
+    uint8_t rec[IMAGE_RECORD] = {(uint8_t)s, 0, (uint8_t)(frames & 0xFF), (uint8_t)(frames >> 8),
+                                 (uint8_t)(misLen & 0xFF), (uint8_t)(misLen >> 8)};
+    crc = crc32Update(crc, rec, sizeof(rec));
+    sink(rec, sizeof(rec));
+
+    Pose buf[WINDOW_FRAMES];
+    for (int i=0; i<frames; i+=WINDOW_FRAMES) {
+      int n = readFrames(s, i, buf, min(WINDOW_FRAMES, frames - i));
+      crc = crc32Update(crc, (const uint8_t*)buf, n * sizeof(Pose));
+      sink((const uint8_t*)buf, n * sizeof(Pose));
+    }
+#if HEBA_HAS_MISSIONS
+    crc = crc32Update(crc, missionProg[s], misLen);
+    sink(missionProg[s], misLen);
+#endif
+  }
+  sink((const uint8_t*)&crc, 4);
+}
+
+void imageBegin() {
+  img.state = IMG_HEADER;
+  img.fill = 0;
+  img.slotsSeen = 0;
+  img.crc = 0;
+}
+
+void imageNextRecord() {
+  img.state = --img.records ? IMG_RECORD : IMG_CRC;
+}
+
+// After a frames part: the mission part, or the next record
+void imageAfterFrames() {
+  img.file.close();
+  img.left = img.misLen;
+  if (img.misLen > 0) img.state = IMG_MISSION;
+  else                imageNextRecord();
+}
+
+// Parses the next chunk of an upload. Frames are written to the slot's
+// tmp file as they arrive, missions are kept in RAM until the CRC is in.
+void imageFeed(const uint8_t* data, size_t len) {
+  while (len > 0 && img.state < IMG_DONE) {
+    size_t take = 0;
+    switch (img.state) {
+      case IMG_HEADER:
+      case IMG_RECORD:
+      case IMG_CRC: {
+        uint8_t need = img.state == IMG_HEADER ? IMAGE_HEADER : img.state == IMG_RECORD ? IMAGE_RECORD : 4;
+        take = min(len, (size_t)(need - img.fill));
+        memcpy(img.buf + img.fill, data, take);
+        if (img.state != IMG_CRC) img.crc = crc32Update(img.crc, data, take);
+        img.fill += take;
+        if (img.fill < need) break;
+        img.fill = 0;
+
+        if (img.state == IMG_HEADER) {
+          if (memcmp(img.buf, "HEBA", 4) != 0 || img.buf[4] != IMAGE_VERSION || img.buf[5] != HEBA_BOARD) {
+            img.state = IMG_ERROR;
+            break;
+          }
+          img.records = img.buf[6];
+          img.state = img.records ? IMG_RECORD : IMG_CRC;
+        } else if (img.state == IMG_RECORD) {
+          img.slot   = img.buf[0];
+          img.left   = (uint32_t)readU16(&img.buf[2]) * sizeof(Pose);
+          img.misLen = readU16(&img.buf[4]);
+          if (img.slot >= NUM_SLOTS || (img.slotsSeen & (1 << img.slot)) || img.misLen > IMAGE_MISSION_BYTES) {
+            img.state = IMG_ERROR;
+            break;
+          }
+          img.slotsSeen |= 1 << img.slot;
+#if HEBA_HAS_MISSIONS
+          imageMissionLen[img.slot] = img.misLen;
+#endif
+          char tmp[16];
+          seqPath(img.slot, "tmp", tmp);
+          img.file = LittleFS.open(tmp, FILE_WRITE);
+          if (!img.file)          img.state = IMG_ERROR;
+          else if (img.left == 0) imageAfterFrames();
+          else                    img.state = IMG_FRAMES;
+        } else {
+          uint32_t crc;
+          memcpy(&crc, img.buf, 4);
+          img.state = crc == img.crc ? IMG_DONE : IMG_ERROR;
+        }
+        break;
+      }
+
+      case IMG_FRAMES:
+        take = min(len, (size_t)img.left);
+        if (img.file.write(data, take) != take) {
+          img.state = IMG_ERROR;   // flash full
+          break;
+        }
+        img.crc = crc32Update(img.crc, data, take);
+        img.left -= take;
+        if (img.left == 0) imageAfterFrames();
+        break;
+
+      case IMG_MISSION:
+        take = min(len, (size_t)img.left);
+#if HEBA_HAS_MISSIONS
+        memcpy(&imageMission[img.slot][img.misLen - img.left], data, take);
+#endif
+        img.crc = crc32Update(img.crc, data, take);
+        img.left -= take;
+        if (img.left > 0) break;
+#if HEBA_HAS_MISSIONS
+        if (!verifyMission(imageMission[img.slot], img.misLen)) {
+          img.state = IMG_ERROR;
+          break;
+        }
+#endif
+        imageNextRecord();
+        break;
+    }
+    data += take;
+    len  -= take;
+  }
+  if (len > 0) img.state = IMG_ERROR;   // bytes after the CRC
+}
+
+// Replaces the uploaded slots if the image was complete and intact.
+// Returns the number of slots restored, -1 if rejected (nothing changed).
+int imageFinish() {
+  if (img.file) img.file.close();
+  bool ok = img.state == IMG_DONE;
+  if (ok) {
+    stopAll();               // nothing may play from the files being replaced
+    interruptedIndex = -1;
+    windowInvalidate();
+  }
+
+  int restored = 0;
+  for (int s=0;s<NUM_SLOTS;s++) {
+    if (!(img.slotsSeen & (1 << s))) continue;
+    commitSequence(s, ok);
+    if (!ok) continue;
+#if HEBA_HAS_MISSIONS
+    missionLen[s] = imageMissionLen[s];
+    memcpy(missionProg[s], imageMission[s], missionLen[s]);
+    saveMission(s);
+#endif
+    restored++;
+  }
+  img.state = IMG_HEADER;
+  return ok ? restored : -1;
+}
+
+// ========== Waveform generator ==========
+// Periodic motion of a servo or the drive base: sine, triangle or
+// trapezoid around a center, with amplitude, period and start phase. The
+// unit shapes are tabulated once at boot; at every servo tick a wave is
+// looked up (linear interpolation between table entries) and only written
+// when the PCA pulse it quantises to has changed, so slow or small waves
+// cost next to no bus traffic. A wave owns its target until waveStop():
+// mission ops that set the same joint / the motors stop it first.
+int16_t       waveTable[WAVE_SHAPES][WAVE_TABLE_SIZE + 1];   // +1: wraps to entry 0
+Wave          waves[NUM_WAVES];
+unsigned long waveTick = 0;
+
+void waveBegin() {
+  for (int i=0;i<=WAVE_TABLE_SIZE;i++) {
+    float x   = (float)(i % WAVE_TABLE_SIZE) / WAVE_TABLE_SIZE;        // 0..1 of a period
+    float tri = x < 0.25f ? 4 * x : x < 0.75f ? 2 - 4 * x : 4 * x - 4;   // from 0, rising
+    waveTable[WAVE_SINE][i]      = lroundf(sinf(2 * PI * x) * WAVE_ONE);
+    waveTable[WAVE_TRIANGLE][i]  = lroundf(tri * WAVE_ONE);
+    waveTable[WAVE_TRAPEZOID][i] = lroundf(constrain(tri * 1.5f, -1.0f, 1.0f) * WAVE_ONE);   // 1/3 dwell
+  }
+}
+
+// Unit shape at 'phase' (65536 = one period), scaled to 'amplitude'
+int16_t waveValue(uint8_t shape, uint16_t phase, int16_t amplitude) {
+  const int16_t* t = waveTable[shape];
+  int i = phase >> (16 - WAVE_TABLE_BITS);
+  int frac = phase & ((1 << (16 - WAVE_TABLE_BITS)) - 1);
+  int32_t v = t[i] + (((int32_t)(t[i + 1] - t[i]) * frac) >> (16 - WAVE_TABLE_BITS));
+  return (int16_t)((v * amplitude) / WAVE_ONE);
+}
+
+// Starts (or retunes) the wave on 'target'. Returns false when all are busy.
+bool waveStart(uint8_t target, uint8_t shape, int16_t center, int16_t amplitude, uint16_t periodMs, uint16_t phase) {
+  if (shape >= WAVE_SHAPES || periodMs == 0) return false;
+  if (target >= NUM_SERVOS && target != WAVE_CHASSIS) return false;
+  Wave* w = nullptr;
+  for (int i=0;i<NUM_WAVES;i++) {
+    if (waves[i].active && waves[i].target == target) w = &waves[i];
+  }
+  for (int i=0;i<NUM_WAVES && !w;i++) {
+    if (!waves[i].active) w = &waves[i];
+  }
+  if (!w) return false;
+  w->shape      = shape;
+  w->target     = target;
+  w->center     = center;
+  w->amplitude  = abs(amplitude);
+  w->periodMs   = periodMs;
+  w->phase      = phase;
+  w->start      = millis();
+  w->lastCounts = 0xFFFF;
+  w->lastSpeed  = INT16_MIN;
+  w->active     = true;
+  return true;
+}
+
+// Servos stay where the wave left them, the base stops
+void waveStop(uint8_t target) {
+  for (int i=0;i<NUM_WAVES;i++) {
+    if (!waves[i].active || waves[i].target != target) continue;
+    waves[i].active = false;
+    if (target == WAVE_CHASSIS) stopMotors();
+  }
+}
+
+bool wavesActive() {
+  for (int i=0;i<NUM_WAVES;i++) {
+    if (waves[i].active) return true;
+  }
+  return false;
+}
+
+void waveStopAll() {
+  for (int i=0;i<NUM_WAVES;i++) {
+    if (waves[i].active) waveStop(waves[i].target);
+  }
+}
+
+// Called every loop, evaluates at the servo period. Frozen (clock held)
+// while paused for an obstacle, like the frame and wait clocks.
+void updateWaves() {
+  unsigned long now = millis();
+  if (now - waveTick < TRANSITION_TICK_MS) return;
+  unsigned long dt = now - waveTick;
+  waveTick = now;
+
+  bool held = playbackPaused || currentMode == MODE_OBSTACLE_STOP;
+  for (int i=0;i<NUM_WAVES;i++) {
+    Wave &w = waves[i];
+    if (!w.active) continue;
+    if (held) {
+      w.start    += dt;
+      w.lastSpeed = INT16_MIN;   // the pause stopped the motors, drive again after
+      continue;
+    }
+    uint16_t phase = w.phase + (uint16_t)((uint32_t)((now - w.start) % w.periodMs) * 65536UL / w.periodMs);
+    int16_t v = waveValue(w.shape, phase, w.amplitude);
+
+    if (w.target == WAVE_CHASSIS) {
+      if (v == w.lastSpeed) continue;
+      w.lastSpeed = v;
+      setMotors(constrain(w.center + v, -255, 255), constrain(w.center - v, -255, 255));
+    } else {
+      int16_t pos = constrain(w.center + v, 0, POS_MAX);
+      uint16_t counts = servoCounts(w.target, pos);
+      if (counts == w.lastCounts) continue;
+      w.lastCounts = counts;
+      setServo(w.target, pos);
+    }
+  }
+}
+
+// ========== Continuous wiper update (non-blocking) ==========
+#if HEBA_HAS_WIPER
+void updateWiper() {
+  bool cleaning = currentMode == MODE_CLEANING;
+
+  // Lower / raise on entering / leaving cleaning (the mission may take over)
+  if (cleaning != wiperCleaning && currentMode != MODE_OBSTACLE_STOP) {
+    wiperCleaning = cleaning;
+    if (wiperOverride == -1) {
+      wiperAngle = cleaning ? kWiperDown : kWiperUp;
+      setServo(SERVO_WIPER, DEG(wiperAngle));
+    }
+  }
+
+  bool sweep = wiperOverride == WIPER_SWEEP || (wiperOverride == -1 && cleaning && kWiperSweeps);
+  if (sweep == wiperSweeping) return;
+  wiperSweeping = sweep;
+  if (!sweep) {
+    waveStop(SERVO_WIPER);
+    return;
+  }
+  // rising from wherever the wiper is, no jump
+  const int mid = (WIPER_MIN_ANGLE + WIPER_MAX_ANGLE) / 2;
+  float x = constrain((float)currentServoAngles[SERVO_WIPER] / POS_SCALE - mid, -mid, mid) / mid;
+  waveStart(SERVO_WIPER, WAVE_SINE, DEG(mid), DEG(mid), WIPER_PERIOD_MS, (uint16_t)(int16_t)lroundf(asinf(x) / (2 * PI) * 65536));
+}
+#endif
+
+// ========== Obstacle pause / resume ==========
+// Open-loop drive: remaining distance == remaining drive time at the same
+// speed, so freezing the clock and restoring the speeds resumes the segment
+// exactly where it stopped.
+bool motionActive() {
+#if HEBA_HAS_MISSIONS
+  if (missionRunning) return true;
+#endif
+  return playing;
+}
+
+// The speeds are kept even without playback: obstacleDistance() watches
+// the way the robot was heading until the path is clear
+void pausePlayback() {
+  if (playbackPaused) return;
+  pausedLeft  = currentLeftSpeed;
+  pausedRight = currentRightSpeed;
+  if (!motionActive()) return;
+  playbackPaused = true;
+  pausedAt       = millis();
+}
+
+void resumePlayback() {
+  if (!playbackPaused) return;
+  playbackPaused = false;
+  if (!motionActive()) return;   // stopped while paused
+  unsigned long pausedFor = millis() - pausedAt;
+  logEvent(EV_PATH_CLEAR, min(pausedFor, (unsigned long)INT16_MAX));
+
+  if (playing) {
+    frameStartTime  += pausedFor;
+    transitionStart += pausedFor;
+  }
+#if HEBA_HAS_MISSIONS
+  else {
+    for (int i=0;i<missionTrackCount;i++) {
+      if (missionTracks[i].waitOp != OP_WAIT_CLEAR) missionTracks[i].waitStart += pausedFor;
+    }
+  }
+#endif
+  setMotors(pausedLeft, pausedRight);
+}
+
+#if HEBA_HAS_SONAR
+// ========== Obstacle logic ==========
+void checkObstacle() {
+  uint8_t dir;
+  long d = obstacleDistance(&dir);
+  lastDistanceCm = d;
+  if (d < kObstacleCm) {
+    if (currentMode != MODE_OBSTACLE_STOP) {
+      prevMode = currentMode;
+      currentMode = MODE_OBSTACLE_STOP;
+      pausePlayback();
+      stopMotors();
+      updateLEDs();
+      logEvent(EV_OBSTACLE, d, dir);
+      char line2[17];
+      snprintf(line2, sizeof(line2), "Dist: %ldcm", d);
+      showStatus("Obstacle!", line2);
+    }
+  } else if (d >= kClearCm) {
+    // resume only once clearly past the threshold (no stop/go chatter)
+    if (currentMode == MODE_OBSTACLE_STOP) {
+      currentMode = prevMode;
+      resumePlayback();
+      updateLEDs();
+      updateLCD();
+    }
+  }
+}
+#endif
+
+#if HEBA_HAS_RTC
+// ========== Wall clock ==========
+// Schedules and the LCD read the time from esp_timer, which costs nothing;
+// the DS3231 is only asked every CLOCK_SYNC_MS. A sync catches the moment
+// its seconds register ticks over (one-byte reads every CLOCK_POLL_MS,
+// started just before the tick is due), so the software clock is put on
+// the second boundary to a few ms, and the error found at the next sync
+// measures how fast esp_timer runs against the DS3231. That drift is
+// corrected continuously and kept in NVS for the next boot.
+uint32_t clockNow() {
+  int64_t us = esp_timer_get_time() - clockBaseUs;
+  us -= (int64_t)(us * (double)clockDriftPpm / 1e6);
+  return clockEpoch + (uint32_t)(us / 1000000);
+}
+
+// Microseconds into the current second, on the disciplined clock
+int32_t clockFracUs(int64_t at) {
+  int64_t us = at - clockBaseUs;
+  us -= (int64_t)(us * (double)clockDriftPpm / 1e6);
+  return us % 1000000;
+}
+
+// DS3231 seconds register (BCD), -1 on a bus error
+int rtcSeconds() {
+  clockReads++;
+  Wire.beginTransmission(RTC_ADDR);
+  Wire.write(0x00);
+  if (Wire.endTransmission() != 0 || Wire.requestFrom((uint8_t)RTC_ADDR, (uint8_t)1) != 1) return -1;
+  return Wire.read() & 0x7F;
+}
+
+// Coarse start at boot (to the second, phase unknown), then catch a tick
+void clockBegin() {
+  clockReads++;
+  clockEpoch    = rtc.now().unixtime();
+  clockBaseUs   = esp_timer_get_time();
+  clockValid    = true;
+  prefs.begin("heba", true);
+  clockDriftPpm = clockSavedPpm = prefs.getFloat("clkPpm", 0);
+  prefs.end();
+  clockNextSync = millis();
+}
+
+// Called every loop pass: idle until a sync is due, then polls for the tick
+void clockService() {
+  if (!rtcOk) return;
+  unsigned long now = millis();
+
+  if (clockState == CLOCK_IDLE) {
+    if ((long)(now - clockNextSync) < 0) return;
+    // locked: wait for the last CLOCK_LEAD_MS before the tick we expect
+    if (clockLocked && clockFracUs(esp_timer_get_time()) < (1000 - CLOCK_LEAD_MS) * 1000L) return;
+    int sec = rtcSeconds();
+    if (sec < 0) {
+      clockNextSync = now + CLOCK_RETRY_MS;
+      return;
+    }
+    clockHuntSec   = sec;
+    clockHuntStart = clockLastPoll = now;
+    clockPollUs    = esp_timer_get_time();
+    clockState     = CLOCK_HUNT;
+    return;
+  }
+
+  if (now - clockLastPoll < CLOCK_POLL_MS) return;
+  clockLastPoll = now;
+  int sec = rtcSeconds();
+  int64_t us = esp_timer_get_time();
+  if (sec < 0 || now - clockHuntStart > CLOCK_WINDOW_MS) {
+    clockState    = CLOCK_IDLE;
+    clockNextSync = now + CLOCK_RETRY_MS;
+    return;
+  }
+  if (sec == clockHuntSec) {
+    clockPollUs = us;
+    return;
+  }
+
+  // ticked between the last two polls: take the middle, unless a slow pass
+  // left a gap that makes the middle a guess (it would show up as drift)
+  if (us - clockPollUs > CLOCK_MAX_GAP_MS * 1000LL) {
+    clockRejects++;
+    clockState    = CLOCK_IDLE;
+    clockNextSync = now + CLOCK_RETRY_MS;
+    return;
+  }
+  int64_t edgeUs = (clockPollUs + us) / 2;
+  clockReads++;
+  uint32_t epoch = rtc.now().unixtime();   // the second that just began
+  if (clockLocked) {
+    // where our clock had the edge vs where it really was
+    int64_t since = edgeUs - clockBaseUs;
+    int64_t ours  = since - (int64_t)(since * (double)clockDriftPpm / 1e6);
+    int64_t err   = ours - (int64_t)(epoch - clockEpoch) * 1000000;   // + = we ran fast
+    float ppm = clockDriftPpm + (float)err * 1e6f / since;
+    if (fabsf(ppm) <= CLOCK_MAX_PPM) clockDriftPpm = ppm;
+    clockLastErrUs = err;
+  }
+  clockEpoch    = epoch;
+  clockBaseUs   = edgeUs;
+  clockLocked   = true;
+  clockState    = CLOCK_IDLE;
+  clockNextSync = now + CLOCK_SYNC_MS;
+  clockSyncs++;
+
+  if (fabsf(clockDriftPpm - clockSavedPpm) >= CLOCK_SAVE_PPM) {
+    clockSavedPpm = clockDriftPpm;
+    prefs.begin("heba", false);
+    prefs.putFloat("clkPpm", clockDriftPpm);
+    prefs.end();
+  }
+}
+
+// ========== RTC Schedules ==========
+// The DS3231 alarm 1 output (INT/SQW, active low) is armed for the next
+// schedule so it can wake the ESP32 from light sleep.
+void armScheduleAlarm(int hour, int minute) {
+  rtc.clearAlarm(1);
+#if HEBA_BOARD == HEBA_BOARD_CLASSIC
+  int nowMin = hour * 60 + minute;
+  int best = -1, bestIn = 24 * 60;
+  for (int i=0;i<scheduleCount;i++) {
+    int in = (schedules[i].hour * 60 + schedules[i].minute - nowMin + 24 * 60 - 1) % (24 * 60) + 1;
+    if (in < bestIn) { bestIn = in; best = i; }
+  }
+  if (best >= 0) {
+    rtc.setAlarm1(DateTime(2000, 1, 1, schedules[best].hour, schedules[best].minute, 0), DS3231_A1_Hour);
+  }
+#else
+  rtc.setAlarm1(DateTime(2000, 1, 1, 0, 0, 0), DS3231_A1_Second);   // every minute at :00
+#endif
+}
+
+void handleSchedule() {
+  if (!clockValid) return;
+  unsigned long ms = millis();
+  if (!scheduleDue && ms - lastSchedulePoll < 1000) return;   // the minute is all we need
+  lastSchedulePoll = ms;
+  scheduleDue = false;
+
+  DateTime now(clockNow());
+  int minute = now.minute();
+  if (minute == lastScheduleMinute) return;
+  lastScheduleMinute = minute;
+  armScheduleAlarm(now.hour(), minute);
+
+  if (motionActive() || currentMode == MODE_OBSTACLE_STOP) return;
+
+#if HEBA_BOARD == HEBA_BOARD_CLASSIC
+  for (int i=0;i<scheduleCount;i++) {
+    if (now.hour() == schedules[i].hour && minute == schedules[i].minute) {
+      runSlot(schedules[i].slot);
+      return;
+    }
+  }
+#else
+  runSlot(rotationSlots[minute % 4]);
+#endif
+}
+#endif
+
+// ========== Idle power manager ==========
+// ACTIVE -> IDLE after IDLE_AFTER_MS without motion or requests: joints
+// that don't carry a load are switched full-off (Joint Hold = false), the
+// LCD backlight goes off, the CPU drops to IDLE_CPU_MHZ and loop() paces
+// itself. IDLE -> SLEEP after SLEEP_AFTER_MS when no station is on the AP:
+// light sleep between sonar rounds, woken by the timer (sonar tick) or the
+// DS3231 alarm. The AP is down while asleep, a station that joins in an
+// awake window keeps the robot out of SLEEP.
+// Catching a DS3231 tick (clockService): loop() keeps polling, no pacing
+// delay and no light sleep until it is caught or given up
+bool clockHunting() {
+#if HEBA_HAS_RTC
+  return clockState == CLOCK_HUNT;
+#else
+  return false;
+#endif
+}
+
+bool powerBusy() {
+  if (motionActive() || wavesActive() || teachSlot >= 0 || currentLeftSpeed || currentRightSpeed) return true;
+  if (currentMode != MODE_IDLE && currentMode != MODE_ARM && currentMode != MODE_OBSTACLE_STOP) return true;
+  unsigned long now = millis();
+  for (int j=0;j<NUM_SERVOS;j++) {
+    if (movePending[j] || (outputValid[j] && (long)(moveEndsAt[j] - now) > 0)) return true;
+  }
+  return false;
+}
+
+void setPowerState(uint8_t st) {
+  if (st == powerState) return;
+  powerState = st;
+  logEvent(EV_POWER, st);
+}
+
+void enterIdle() {
+  for (int j=0;j<NUM_SERVOS;j++) {
+    servoRelaxed[j] = !Servos::hold[j] && outputValid[j];
+    if (servoRelaxed[j]) releaseServo(j);
+  }
+  pcaFlush();
+#if HEBA_HAS_LCD
+  if (lcdOk) lcd.noBacklight();   // the PCF8574 backpack only switches it
+#endif
+  setCpuFrequencyMhz(IDLE_CPU_MHZ);
+  setPowerState(PWR_IDLE);
+}
+
+// Wake-to-motion is measured from sinceUs (the request, or the end of sleep)
+void exitIdle(uint8_t cause, uint32_t sinceUs) {
+  setCpuFrequencyMhz(ACTIVE_CPU_MHZ);
+  // back to the pulse they had, not a move: the joints haven't gone anywhere
+  for (int j=0;j<NUM_SERVOS;j++) {
+    if (!servoRelaxed[j]) continue;
+    servoRelaxed[j] = false;
+    if (movePending[j]) continue;   // already commanded somewhere else
+    writeServo(j, outputAngle[j]);
+    outputValid[j] = true;
+  }
+  pcaFlush();
+#if HEBA_HAS_LCD
+  if (lcdOk) lcd.backlight();
+  updateLCD();
+#endif
+  wakeCause = cause;
+  wakeAtUs  = sinceUs ? sinceUs : 1;
+  setPowerState(PWR_ACTIVE);
+}
+
+// Something asked for the robot (request, command, alarm, someone in front)
+void markActivity(uint8_t cause) {
+  uint32_t us = micros();
+  lastActivityMs = millis();
+  if (powerState != PWR_ACTIVE) exitIdle(cause, us);
+}
+
+// First servo or motor command after a wake
+void noteMotion() {
+  if (wakeAtUs == 0) return;
+  wakeLatencyMs  = (micros() - wakeAtUs) / 1000;
+  wakeLatencyMax = max(wakeLatencyMax, wakeLatencyMs);
+  wakeAtUs = 0;
+  logEvent(EV_WAKE, wakeCause, min(wakeLatencyMs, (uint32_t)INT16_MAX));
+}
+
+void lightSleep(uint32_t ms) {
+  // a tripped robot stays awake: a held switch would wake it at once anyway
+  if (estopLatched || (kPins.estop >= 0 && digitalRead(kPins.estop) == LOW)) return;
+#if HEBA_HAS_RTC
+  if (rtcOk && kPins.rtcInt >= 0) {
+    if (digitalRead(kPins.rtcInt) == LOW) {   // alarm already pending
+      scheduleDue = true;
+      return;
+    }
+    gpio_wakeup_enable((gpio_num_t)kPins.rtcInt, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+  }
+#endif
+  // GPIO edges aren't seen while asleep: wake on the e-stop level instead,
+  // with the ISR masked so a pressed switch doesn't fire it over and over
+  if (kPins.estop >= 0) {
+    gpio_intr_disable((gpio_num_t)kPins.estop);
+    gpio_wakeup_enable((gpio_num_t)kPins.estop, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+  }
+  esp_sleep_enable_timer_wakeup((uint64_t)ms * 1000);
+
+  uint32_t t0 = micros();
+  esp_light_sleep_start();
+  uint32_t woke = micros();
+  sleptUs += woke - t0;
+  sleepCount++;
+  loopLastUs = 0;   // not a loop gap
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+  awakeUntilMs = millis() + SLEEP_AWAKE_MS;
+
+  if (kPins.estop >= 0) {
+    gpio_wakeup_disable((gpio_num_t)kPins.estop);
+    gpio_set_intr_type((gpio_num_t)kPins.estop, GPIO_INTR_NEGEDGE);   // back to the ISR's edge
+    gpio_intr_enable((gpio_num_t)kPins.estop);
+    if (digitalRead(kPins.estop) == LOW) estopTrip(ESTOP_PIN);
+  }
+
+#if HEBA_HAS_RTC
+  // the GPIO wakeup doesn't say which pin: the alarm holds INT low until cleared
+  if (rtcOk && kPins.rtcInt >= 0) {
+    gpio_wakeup_disable((gpio_num_t)kPins.rtcInt);
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO && digitalRead(kPins.rtcInt) == LOW) {
+      scheduleDue = true;
+      lastActivityMs = millis();
+      exitIdle(WAKE_RTC, woke);
+    }
+  }
+#endif
+}
+
+// Called at the top of every loop once booted
+void loopTiming() {
+  uint32_t now = micros();
+  if (loopLastUs) {
+    uint32_t gap = now - loopLastUs;
+    int b = gap < 32 ? 0 : min(31 - __builtin_clz(gap) - 4, LOOP_HIST_BUCKETS - 1);
+    loopHist[b]++;
+    loopCount++;
+    if (gap > loopMaxGapUs) loopMaxGapUs = gap;
+    if (gap > TRANSITION_TICK_MS * 1000UL) loopLate++;
+  }
+  loopLastUs = now;
+}
+
+// Called every loop
+void updatePower() {
+  unsigned long now = millis();
+  if (powerBusy()) lastActivityMs = now;
+
+#if HEBA_HAS_SONAR
+  // someone stepping up to the parked robot wakes it (edge only: a wall doesn't)
+  static bool wasNear = false;
+  bool near = lastDistanceCm < kObstacleCm;
+  if (near && !wasNear) markActivity(WAKE_SONAR);
+  wasNear = near;
+#endif
+
+  unsigned long quiet = now - lastActivityMs;
+  if (powerState == PWR_ACTIVE) {
+    if (quiet >= IDLE_AFTER_MS) enterIdle();
+    return;
+  }
+
+  bool alone = WiFi.softAPgetStationNum() == 0 && !tetherActive;   // the UART doesn't receive asleep
+  if (powerState == PWR_IDLE && alone && quiet >= SLEEP_AFTER_MS) setPowerState(PWR_SLEEP);
+  if (powerState == PWR_SLEEP && !alone) setPowerState(PWR_IDLE);
+  if (powerState != PWR_SLEEP || (long)(now - awakeUntilMs) < 0 || clockHunting()) return;
+
+#if HEBA_HAS_SONAR
+  // finish the round first, then sleep until the next one is due
+  if (sonarWaiting || sonarIndex != 0) return;
+  uint32_t sinceRound = (micros() - sonarRoundUs) / 1000;
+  if (sinceRound >= SLEEP_TICK_MS) return;
+  lightSleep(SLEEP_TICK_MS - sinceRound);
+#else
+  lightSleep(SLEEP_TICK_MS);
+#endif
+}
+
+// ========== Text commands (RoboRemo TCP, serial tether) ==========
+void processCommand(String cmd, uint8_t via) {
+  cmd.trim();
+  logCommand(cmd);
+  markActivity(via);
+
+  // Teaching commands
+  if (cmd.startsWith("TEACH_START:")) {
+    int slot = cmd.substring(12).toInt();
+    if (slot < 0 || slot >= NUM_SLOTS) return;
+    stopAll();
+    teachSlot = slot;
+    clearSequence(slot);
+    logEvent(EV_TEACH_START, slot);
+  }
+  else if (cmd == "TEACH_STEP") {
+    if (teachSlot >= 0) savePoseToSeq(teachSlot, kTeachStepMs);
+  }
+  else if (cmd == "TEACH_END") {
+    if (teachSlot < 0) return;   // steps are already on flash
+    logEvent(EV_TEACH_END, teachSlot, seqLen[teachSlot]);
+    teachSlot = -1;
+  }
+  else if (cmd.startsWith("PLAY:")) {
+    int slot = cmd.substring(5).toInt();
+    if (slot >= 0 && slot < NUM_SLOTS) runSlot(slot);
+  }
+  else if (cmd == "STOP") {
+    stopAll();
+  }
+  else if (cmd == "ESTOP") estopTrip(via == WAKE_TETHER ? ESTOP_TETHER : ESTOP_REMOTE);
+  else if (cmd == "ESTOP_RESET") estopReset();
+
+  // Manual servo control (Sn:pulse, n = PCA channel)
+  else if (cmd.length() > 3 && cmd[0] == 'S' && cmd[2] == ':') {
+    int ch = cmd[1] - '0';
+    for (int j=0;j<NUM_SERVOS;j++) {
+      if (Servos::channel[j] == ch) setServo(j, posFromCounts(j, cmd.substring(3).toInt()));
+    }
+  }
+
+  // Motor control
+  else if (cmd == "FWD") setMotors(200, 200);
+  else if (cmd == "BWD") setMotors(-200, -200);
+  else if (cmd == "LEFT") setMotors(-150, 150);
+  else if (cmd == "RIGHT") setMotors(150, -150);
+  else if (cmd == "STOP_M") stopMotors();
+  else if (cmd.startsWith("PCA_OSC:")) pcaSetOsc(0, cmd.substring(8).toInt());
+}
+
+#if HEBA_HAS_ROBOREMO
+// ========== RoboRemo (line based TCP) ==========
+// Reads whatever has arrived, never waits for the client
+void handleRoboRemo() {
+  if (!roboClient || !roboClient.connected()) {
+    roboClient = roboRemo.available();
+    roboLine = "";
+    if (!roboClient) return;
+  }
+
+  while (roboClient.available()) {
+    char c = roboClient.read();
+    if (c == '\n') {
+      processCommand(roboLine, WAKE_REMOTE);
+      roboLine = "";
+    } else if (roboLine.length() < 64) {
+      roboLine += c;
+    }
+  }
+}
+#endif
+
+// ========== Serial tether ==========
+// A PC planner streams setpoints at 100+ Hz over the USB UART and gets the
+// state back at a fixed rate. Nothing polls Serial: the UART driver's
+// event task calls tetherOnReceive() when its RX FIFO fills or the line
+// goes quiet for two characters. An e-stop trips right there; everything
+// else is queued for loop() and goes through the same calls as the HTTP
+// and RoboRemo handlers (queueServo + scheduler, setMotors, processCommand).
+
+// CRC-16/CCITT-FALSE, binascii.crc_hqx(data, 0xFFFF) on the PC
+uint16_t tetherCrc(const uint8_t* p, size_t n) {
+  uint16_t crc = 0xFFFF;
+  while (n--) {
+    crc ^= (uint16_t)*p++ << 8;
+    for (int i=0;i<8;i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// out needs n + n / 254 + 1 bytes; none of them is 0x00
+size_t cobsEncode(const uint8_t* in, size_t n, uint8_t* out) {
+  uint8_t* code = out;
+  uint8_t* o = out + 1;
+  uint8_t run = 1;
+  for (size_t i=0;i<n;i++) {
+    if (in[i]) {
+      *o++ = in[i];
+      run++;
+    }
+    if (!in[i] || run == 0xFF) {
+      *code = run;
+      run  = 1;
+      code = o;
+      if (!in[i] || i + 1 < n) o++;
+    }
+  }
+  *code = run;
+  return o - out;
+}
+
+// 0 = malformed; out needs n - 1 bytes
+size_t cobsDecode(const uint8_t* in, size_t n, uint8_t* out) {
+  size_t o = 0;
+  for (size_t i=0;i<n;) {
+    uint8_t run = in[i++];
+    if (run == 0 || i + run - 1 > n) return 0;
+    for (uint8_t k=1;k<run;k++) out[o++] = in[i++];
+    if (run != 0xFF && i < n) out[o++] = 0;
+  }
+  return o;
+}
+
+// Loop, log drain task: one Serial.write() per message, so the two never interleave
+void tetherSend(uint8_t type, uint8_t seq, const uint8_t* payload, size_t n) {
+  uint8_t raw[TETHER_MAX_MSG];
+  uint8_t out[TETHER_MAX_MSG + 2];
+  if (n + 4 > sizeof(raw)) return;
+  raw[0] = type;
+  raw[1] = seq;
+  memcpy(&raw[2], payload, n);
+  uint16_t crc = tetherCrc(raw, n + 2);
+  raw[n + 2] = crc & 0xFF;
+  raw[n + 3] = crc >> 8;
+  size_t len = cobsEncode(raw, n + 4, out);
+  out[len++] = 0;
+  Serial.write(out, len);
+}
+
+void tetherAck(uint8_t seq, uint8_t status) {
+  tetherSend(TM_ACK, seq, &status, 1);
+}
+
+// UART event task, one byte of the COBS stream
+void tetherRxByte(uint8_t c) {
+  if (c != 0) {
+    if (tetherRxLen < sizeof(tetherRx)) tetherRx[tetherRxLen++] = c;
+    else tetherRxOver = true;
+    return;
+  }
+  if (tetherRxLen == 0 && !tetherRxOver) return;   // the host may lead with a 0x00
+
+  TetherMsg m;
+  size_t len = tetherRxOver ? 0 : cobsDecode(tetherRx, tetherRxLen, m.data);
+  tetherRxLen  = 0;
+  tetherRxOver = false;
+  if (len < 4 || tetherCrc(m.data, len - 2) != (m.data[len - 2] | m.data[len - 1] << 8)) {
+    tetherCrcErrors++;
+    return;
+  }
+  m.len = len - 2;
+  tetherLastMs = millis();
+  tetherActive = true;
+  tetherFrames++;
+
+  if (m.data[0] == TM_ESTOP) {
+    estopTrip(ESTOP_TETHER);   // no queue and no loop() in between
+    return;
+  }
+  if (xQueueSend(tetherQueue, &m, 0) != pdTRUE) tetherOverruns++;
+}
+
+void tetherOnReceive() {
+  uint8_t buf[64];
+  int n;
+  while ((n = Serial.available()) > 0) {
+    n = Serial.readBytes(buf, min(n, (int)sizeof(buf)));
+    for (int i=0;i<n;i++) tetherRxByte(buf[i]);
+  }
+}
+
+void tetherBegin() {
+  tetherQueue = xQueueCreate(TETHER_QUEUE, sizeof(TetherMsg));
+  Serial.setRxTimeout(2);   // symbols: a message is handed over right after its 0x00
+  Serial.onReceive(tetherOnReceive);
+}
+
+// Joints in the mask (bit n = joint n, TETHER_DRIVE = base), one pose
+bool tetherSetpoint(const uint8_t* p, int n) {
+  if (n < 4) return false;
+  uint32_t mask;
+  memcpy(&mask, p, 4);
+  uint32_t joints = mask & ~(1UL << TETHER_DRIVE);
+  bool drive = mask & (1UL << TETHER_DRIVE);
+  if (joints >> NUM_SERVOS || n != 4 + 2 * __builtin_popcount(joints) + (drive ? 4 : 0)) return false;
+  p += 4;
+
+  for (int j=0;j<NUM_SERVOS;j++) {
+    if (!(joints & (1UL << j))) continue;
+    int16_t pos;
+    memcpy(&pos, p, 2);
+    p += 2;
+    waveStop(j);
+    queueServo(j, pos);
+  }
+  updateMotionScheduler();
+
+  if (drive) {
+    int16_t speed[2];
+    memcpy(speed, p, 4);
+    waveStop(WAVE_CHASSIS);
+    if (currentMode == MODE_OBSTACLE_STOP) speed[0] = speed[1] = 0;   // like /drive
+    setMotors(speed[0], speed[1]);
+    tetherDriving = speed[0] || speed[1];
+  }
+  return true;
+}
+
+void tetherHandle(const TetherMsg &m) {
+  uint8_t seq = m.data[1];
+  const uint8_t* p = &m.data[2];
+  int n = m.len - 2;
+  markActivity(WAKE_TETHER);
+
+  switch (m.data[0]) {
+  case TM_PING: {
+    uint8_t info[4] = {TETHER_PROTOCOL, HEBA_BOARD, NUM_SERVOS, NUM_PCA};
+    tetherSend(TM_PONG, seq, info, sizeof(info));
+    break;
+  }
+  case TM_SETPOINT:
+    if (tetherSetpoint(p, n)) tetherLastSeq = seq;
+    else tetherAck(seq, 1);   // only failures: the state carries the seq
+    break;
+  case TM_TELEMETRY:
+    if (n != 2) {
+      tetherAck(seq, 1);
+      break;
+    }
+    tetherPeriodMs = p[0] | p[1] << 8;
+    if (tetherPeriodMs) tetherPeriodMs = max(tetherPeriodMs, (uint16_t)TETHER_MIN_PERIOD);
+    tetherAck(seq, 0);
+    break;
+  case TM_COMMAND: {
+    char line[TETHER_MAX_MSG];
+    memcpy(line, p, n);
+    line[n] = 0;
+    processCommand(String(line), WAKE_TETHER);
+    tetherAck(seq, 0);
+    break;
+  }
+  default:
+    tetherAck(seq, 2);
+  }
+}
+
+void tetherTelemetry() {
+  uint8_t buf[sizeof(TetherState) + 2 * NUM_SERVOS];
+  TetherState st;
+  st.ms      = millis();
+  st.pending = 0;
+  for (int j=0;j<NUM_SERVOS;j++) {
+    if (movePending[j]) st.pending |= 1UL << j;
+  }
+  st.mode  = currentMode;
+  st.flags = (motionActive() ? TF_MOVING : 0) | (playbackPaused ? TF_PAUSED : 0) | (estopLatched ? TF_ESTOP : 0) |
+             (homingJoint >= 0 ? TF_HOMING : 0) | (wavesActive() ? TF_WAVES : 0) | (powerState != PWR_ACTIVE ? TF_IDLE : 0);
+  st.seq        = tetherLastSeq;
+  st.soc        = battSoc;
+  st.restMv     = battRestMv;
+  st.loadMv     = battDipMv;
+  st.obstacleCm = min(lastDistanceCm, (long)UINT16_MAX);
+  st.left       = currentLeftSpeed;
+  st.right      = currentRightSpeed;
+  st.frames     = tetherFrames;
+  st.crcErrors  = tetherCrcErrors;
+  st.joints     = NUM_SERVOS;
+  st.reserved   = 0;
+  memcpy(buf, &st, sizeof(st));
+  for (int j=0;j<NUM_SERVOS;j++) {
+    int16_t pos = outputValid[j] ? outputAngle[j] : -1;
+    memcpy(&buf[sizeof(st) + 2 * j], &pos, 2);
+  }
+  tetherSend(TM_STATE, 0, buf, sizeof(buf));
+}
+
+// Called every loop
+void tetherService() {
+  TetherMsg m;
+  while (xQueueReceive(tetherQueue, &m, 0) == pdTRUE) tetherHandle(m);
+
+  static bool logged = false;
+  unsigned long now = millis();
+  if (tetherActive && now - tetherLastMs > TETHER_TIMEOUT_MS) {
+    // host gone: whatever it was driving must not run on
+    if (tetherDriving) stopMotors();
+    tetherDriving  = false;
+    tetherPeriodMs = 0;
+    tetherActive   = false;
+  }
+  uint16_t counts[2] = {tetherCrcErrors, tetherOverruns};
+  if (tetherActive != logged) {
+    logged = tetherActive;
+    logEvent(EV_TETHER, logged, min(counts[0], (uint16_t)INT16_MAX), min(counts[1], (uint16_t)INT16_MAX));
+  }
+  if (!tetherActive) return;
+
+  if (counts[0] + counts[1] != tetherErrorsSent) {
+    tetherSend(TM_ERROR, 0, (const uint8_t*)counts, sizeof(counts));
+    tetherErrorsSent = counts[0] + counts[1];
+  }
+  if (tetherPeriodMs && now - tetherLastState >= tetherPeriodMs) {
+    tetherLastState = now;
+    tetherTelemetry();
+  }
+}
+
+#if HEBA_HAS_HTTP
+// ========== Sampling profiler ==========
+// A hardware timer interrupts the loop() core at profHz and records what
+// it interrupted: the PC plus up to profDepth callers of the running task.
+// On entry to a first-level interrupt the FreeRTOS port saves the task's
+// stack pointer, which points at its exception frame, into the TCB
+// (pxTopOfStack, the first field); the ISR reads the PC there and walks
+// the stack like a panic backtrace. Ticks that find the idle task only
+// count as idle. Samples in critical sections are taken when interrupts
+// come back on, so time spent there shows up at its end.
+//
+// /prof?start=1 starts, /prof downloads (and stops); heba_profile.py
+// symbolises against the firmware ELF. Keep the layout in sync with it:
+//   "HPRF" version board depth 0 hz(u16) 0(u16) ms samples idle lost words
+//   elf sha256[8], then per sample: word (task << 8 | n), n PCs, leaf first
+// (callers are raw return addresses, the host maps them to call sites).
+#define PROF_VERSION    1
+#define PROF_MAGIC      0x46525048UL   // "HPRF"
+#define PROF_HZ_MAX     5000
+#define PROF_DEPTH_MAX  16
+#define PROF_BUF_WORDS  8192           // 32 KB, allocated while a profile is held
+
+enum ProfTask { PROF_LOOP = 0, PROF_OTHER };
+
+uint32_t*         profBuf      = NULL;
+volatile uint32_t profLen      = 0;      // words used
+volatile uint32_t profSamples  = 0;
+volatile uint32_t profIdle     = 0;
+volatile uint32_t profLost     = 0;      // buffer full
+volatile bool     profRunning  = false;
+uint16_t          profHz       = 0;
+uint8_t           profDepth    = 8;
+uint32_t          profStartMs  = 0;
+uint32_t          profMs       = 0;      // length of the finished run
+hw_timer_t*       profTimer    = NULL;
+TaskHandle_t      profLoopTask = NULL;
+TaskHandle_t      profIdleTask = NULL;
+
+void IRAM_ATTR profIsr() {
+  if (!profRunning) return;
+  TaskHandle_t t = xTaskGetCurrentTaskHandleForCPU(xPortGetCoreID());
+  if (t == profIdleTask) {
+    profIdle++;
+    return;
+  }
+  uint32_t len = profLen;
+  if (len + 1 + profDepth > PROF_BUF_WORDS) {
+    profLost++;
+    return;
+  }
+
+  const XtExcFrame* f = *(XtExcFrame* const*)t;   // pxTopOfStack
+  xthal_window_spill();                          // live register windows onto their stacks
+  esp_backtrace_frame_t fr = {(uint32_t)f->pc, (uint32_t)f->a1, (uint32_t)f->a0, f};
+  uint32_t* out = &profBuf[len + 1];
+  uint8_t n = 0;
+  out[n++] = fr.pc;
+  while (n < profDepth && fr.next_pc && esp_stack_ptr_is_sane(fr.sp)) {
+    bool ok = esp_backtrace_get_next_frame(&fr);
+    out[n++] = fr.pc;
+    if (!ok) break;
+  }
+  profBuf[len] = (t == profLoopTask ? PROF_LOOP : PROF_OTHER) << 8 | n;
+  profLen = len + 1 + n;
+  profSamples++;
+}
+
+void profStop() {
+  if (!profRunning) return;
+  profRunning = false;
+  timerAlarmDisable(profTimer);
+  timerDetachInterrupt(profTimer);
+  timerEnd(profTimer);
+  profTimer = NULL;
+  profMs = millis() - profStartMs;
+}
+
+// From loop(): the timer interrupt lands on the loop() core
+bool profStart(uint16_t hz, uint8_t depth) {
+  profStop();
+  if (!profBuf) profBuf = (uint32_t*)malloc(PROF_BUF_WORDS * sizeof(uint32_t));
+  if (!profBuf) return false;
+  profHz       = constrain(hz, 1, PROF_HZ_MAX);
+  profDepth    = constrain(depth, 1, PROF_DEPTH_MAX);
+  profLen      = 0;
+  profSamples  = 0;
+  profIdle     = 0;
+  profLost     = 0;
+  profMs       = 0;
+  profLoopTask = xTaskGetCurrentTaskHandle();
+  profIdleTask = xTaskGetIdleTaskHandleForCPU(xPortGetCoreID());
+  profStartMs  = millis();
+  profRunning  = true;
+
+  profTimer = timerBegin(0, 80, true);   // 1 MHz
+  timerAttachInterrupt(profTimer, profIsr, true);
+  timerAlarmWrite(profTimer, 1000000UL / profHz, true);
+  timerAlarmEnable(profTimer);
+  return true;
+}
+
+struct __attribute__((packed)) ProfHeader {
+  uint32_t magic;
+  uint8_t  version, board, depth, pad0;
+  uint16_t hz, pad1;
+  uint32_t ms, samples, idle, lost, words;
+  uint8_t  elfSha[8];   // first bytes of the app ELF sha256, to pick the right ELF
+};
+
+void profFree() {
+  profStop();
+  free(profBuf);
+  profBuf = NULL;
+  profLen = 0;
+}
+#endif
+
+#if HEBA_HAS_HTTP
+// ========== WiFi Handlers ==========
+String statusJson() {
+  String json = "{\"mode\":\"" + String(modeToStr(currentMode)) + "\"";
+  json += ",\"playing\":" + String(playing ? "true" : "false");
+  json += ",\"training\":" + String(isTraining ? "true" : "false");
+  json += ",\"resuming\":" + String(transitioning ? "true" : "false");
+  json += ",\"paused\":" + String(playbackPaused ? "true" : "false");
+  json += ",\"slot\":" + String(playSlot);
+  json += ",\"position\":" + String(playIndex);
+  json += ",\"length\":" + String(playSlot >= 0 ? seqLen[playSlot] : seqLen[0]);
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+  json += ",\"cleaningDemo\":" + String(seqDemo ? "true" : "false");
+#endif
+  json += ",\"stalls\":" + String(windowStalls);
+  json += ",\"readyMs\":" + String(readyMs);
+  json += ",\"servos\":" + String(pcaOk ? "true" : "false");
+  json += ",\"estop\":" + String(estopLatched ? "true" : "false");
+  json += ",\"elapsedMs\":" + String(playing && !transitioning ? millis() - frameStartTime : 0);
+#if HEBA_HAS_MISSIONS
+  json += ",\"mission\":" + String(missionRunning ? "true" : "false");
+#endif
+  if (battOk && battCh[0] != 0xFF) {
+    json += ",\"batteryMv\":" + String(battRestMv);
+    json += ",\"soc\":" + String(battSoc);
+    json += ",\"sagMv\":" + String(battSagMv);
+  }
+  if (battOk) json += ",\"throttle\":" + String(battThrottle * 100 / 255);
+  json += ",\"tether\":" + String(tetherActive ? "true" : "false");
+  if (tetherFrames) json += ",\"tetherCrcErrors\":" + String(tetherCrcErrors);
+#if HEBA_HAS_RTC
+  if (clockValid) {
+    DateTime now(clockNow());
+    char hms[9];
+    snprintf(hms, sizeof(hms), "%02d:%02d:%02d", now.hour(), now.minute(), now.second());
+    json += ",\"time\":\"" + String(hms) + "\"";
+    json += ",\"clockPpm\":" + String(clockDriftPpm, 2);
+    json += ",\"clockErrUs\":" + String(clockLastErrUs);
+    json += ",\"clockI2c\":" + String(clockReads);
+    if (clockRejects) json += ",\"clockRejects\":" + String(clockRejects);
+  }
+#endif
+  json += "}";
+  return json;
+}
+
+// Playback progress for the UI / scripts: /status
+void handleStatus() {
+  server.send(200, "application/json", statusJson());
+}
+
+// Servo control: /servo?ch=0-6&ang=0-180, 0.1 degree steps (or idx=&angle= from the web UI)
+void handleServo() {
+  String chArg  = server.hasArg("ch") ? "ch" : "idx";
+  String angArg = server.hasArg("ang") ? "ang" : "angle";
+  int ch  = server.hasArg(chArg) ? server.arg(chArg).toInt() : -1;
+  int pos = server.hasArg(angArg) ? parsePos(server.arg(angArg)) : DEG(90);
+  if (ch < 0 || ch >= NUM_SERVOS) {
+    server.send(400, "text/plain", "bad channel");
+    return;
+  }
+  setServo(ch, pos);
+  server.send(200, "text/plain", "OK servo");
+}
+
+// Play: /play?mode=water (arm: /play)
+// An uploaded mission for the mode takes precedence over taught frames
+void handlePlay() {
+  int slot = NUM_SLOTS == 1 ? 0 : slotFromName(server.hasArg("mode") ? server.arg("mode") : "");
+  if (slot < 0) {
+    server.send(400, "text/plain", "bad mode");
+    return;
+  }
+  runSlot(slot);
+  if (motionActive()) server.send(200, "text/plain", "Play triggered");
+  else                server.send(400, "text/plain", "No positions captured!");
+}
+
+// Continue an interrupted sequence from the nearest frame: /resume[?mode=]
+void handleResume() {
+  int slot = server.hasArg("mode") ? slotFromName(server.arg("mode")) : (playSlot >= 0 ? playSlot : 0);
+  if (slot < 0 || seqLen[slot] == 0) {
+    server.send(400, "text/plain", "No positions captured!");
+    return;
+  }
+  resumePlay(slot);
+  server.send(200, "text/plain", "Resuming at position " + String(playIndex + 1));
+}
+
+void handleStop() {
+  stopAll();
+  releaseAllServos();
+  server.send(200, "text/plain", "OK");
+}
+
+// Emergency stop: /estop trips, /estop?reset=1 re-arms, /estop?status=1 only reports
+// (the UDP message on ESTOP_UDP_PORT doesn't wait for loop(), this does)
+void handleEstop() {
+  static const char* const sources[] = {"pin", "udp", "remote", "http", "tether"};
+  if (server.hasArg("reset")) {
+    if (!estopReset()) {
+      server.send(409, "text/plain", "switch still pressed");
+      return;
+    }
+  } else if (!server.hasArg("status")) {
+    estopTrip(ESTOP_HTTP);
+  }
+  String msg = "latched=" + String(estopLatched ? 1 : 0);
+  msg += " source=" + String(sources[estopSource]);
+  msg += " trips=" + String(estopCount);
+  msg += " motor_us=" + String(estopMotorUs);
+  msg += " outputs_us=" + String(estopOutputsUs);
+  msg += " worst_us=" + String(estopWorstUs);
+  msg += " bound_us=" + String(estopBoundUs);
+  server.send(200, "text/plain", msg);
+}
+
+// Starts / stops a periodic wave; without arguments lists the running ones.
+// Servo center/amp in degrees, "turn" (drive base) in speed units.
+void handleWave() {
+  static const char* const shapes[] = {"sine", "triangle", "trapezoid"};
+  if (!server.hasArg("target")) {
+    String msg;
+    for (int i=0;i<NUM_WAVES;i++) {
+      const Wave &w = waves[i];
+      if (!w.active) continue;
+      msg += "target=" + (w.target == WAVE_CHASSIS ? String("turn") : String(w.target));
+      msg += " shape=" + String(shapes[w.shape]);
+      msg += " center=" + String(w.center) + " amp=" + String(w.amplitude);
+      msg += " period=" + String(w.periodMs) + "\n";
+    }
+    server.send(200, "text/plain", msg.length() ? msg : String("no waves\n"));
+    return;
+  }
+
+  String t = server.arg("target");
+  uint8_t target;
+  if (t == "turn") target = WAVE_CHASSIS;
+#if HEBA_HAS_WIPER
+  else if (t == "wiper") target = SERVO_WIPER;
+#endif
+  else target = t.toInt();
+  if ((target >= NUM_SERVOS && target != WAVE_CHASSIS) || (target == WAVE_CHASSIS && !HEBA_HAS_CHASSIS)) {
+    server.send(400, "text/plain", "bad target");
+    return;
+  }
+  if (server.hasArg("stop")) {
+    waveStop(target);
+    server.send(200, "text/plain", "Wave stopped");
+    return;
+  }
+
+  uint8_t shape = WAVE_SINE;
+  for (int i=0;i<WAVE_SHAPES;i++) {
+    if (server.arg("shape") == shapes[i]) shape = i;
+  }
+  bool chassis = target == WAVE_CHASSIS;
+  int16_t center = chassis ? server.arg("center").toInt() : server.hasArg("center") ? parsePos(server.arg("center")) : DEG(90);
+  int16_t amp    = chassis ? server.arg("amp").toInt() : parsePos(server.arg("amp"));
+  long period    = server.hasArg("period") ? server.arg("period").toInt() : 2000;
+  uint16_t phase = (uint16_t)(server.arg("phase").toInt() * 65536L / 360);
+  if (period < TRANSITION_TICK_MS * 4 || period > UINT16_MAX || estopLatched) {
+    server.send(400, "text/plain", estopLatched ? "e-stop latched" : "bad period");
+    return;
+  }
+  if (!waveStart(target, shape, center, amp, period, phase)) {
+    server.send(409, "text/plain", "all waves busy");
+    return;
+  }
+  server.send(200, "text/plain", "Wave started");
+}
+
+// Servo power: /power[?budget=mA]
+void handlePower() {
+  if (server.hasArg("budget")) {
+    servoBudgetMa = constrain(server.arg("budget").toInt(), 500, 10000);
+  }
+  int pending = 0;
+  for (int j=0;j<NUM_SERVOS;j++) if (movePending[j]) pending++;
+  static const char* const stateNames[] = {"active", "idle", "sleep"};
+  String msg = "budget_ma=" + String(servoBudgetMa);
+  msg += " estimate_ma=" + String(servoCurrentMa(millis()));
+  msg += " pending=" + String(pending);
+  msg += " state=" + String(stateNames[powerState]);
+  msg += " sleeps=" + String(sleepCount);
+  msg += " asleep_pct=" + String(sleptUs / 10.0 / max(millis(), 1UL), 1);
+  msg += " wake_ms=" + String(wakeLatencyMs);
+  msg += " wake_max_ms=" + String(wakeLatencyMax);
+  if (battOk) {
+    if (battCh[0] != 0xFF) {
+      msg += " vbat_mv=" + String(battPackMv);
+      msg += " vbat_dip_mv=" + String(battDipMv);
+      msg += " vbat_rest_mv=" + String(battRestMv);
+      msg += " sag_mv=" + String(battSagMv);
+      msg += " sag_max_mv=" + String(battSagMaxMv);
+      msg += " soc_pct=" + String(battSoc);
+    }
+    if (battCh[1] != 0xFF) msg += " vbuck_mv=" + String(battBuckMv);
+    msg += " throttle_pct=" + String(battThrottle * 100 / 255);
+    msg += " budget_now_ma=" + String(servoBudgetMa - (uint32_t)servoBudgetMa * battThrottle / 256);
+  }
+  server.send(200, "text/plain", msg);
+}
+
+// Loop timing under load (src/tools/heba_load.py): /perf[?reset=1]
+void handlePerf() {
+  String json = "{\"loops\":" + String(loopCount);
+  json += ",\"maxGapUs\":" + String(loopMaxGapUs);
+  json += ",\"late\":" + String(loopLate);
+  json += ",\"httpMaxUs\":" + String(httpMaxUs);
+  json += ",\"powerState\":" + String(powerState);
+  json += ",\"bucketUs\":32,\"hist\":[";
+  for (int b=0;b<LOOP_HIST_BUCKETS;b++) json += String(b ? "," : "") + String(loopHist[b]);
+  json += "],\"freeHeap\":" + String(ESP.getFreeHeap());
+  json += ",\"minFreeHeap\":" + String(ESP.getMinFreeHeap()) + "}";
+  if (server.hasArg("reset")) {
+    memset(loopHist, 0, sizeof(loopHist));
+    loopCount    = 0;
+    loopMaxGapUs = 0;
+    loopLate     = 0;
+    httpMaxUs    = 0;
+  }
+  server.send(200, "application/json", json);
+}
+
+// Sampling profiler (src/tools/heba_profile.py):
+// /prof?start=1[&hz=][&depth=], /prof?stop=1 (summary), /prof (stops, binary dump),
+// /prof?free=1 (gives the buffer back)
+void handleProf() {
+  if (server.hasArg("start")) {
+    uint16_t hz = server.hasArg("hz") ? server.arg("hz").toInt() : 1000;
+    uint8_t depth = server.hasArg("depth") ? server.arg("depth").toInt() : 8;
+    if (!profStart(hz, depth)) {
+      server.send(500, "text/plain", "no memory for the sample buffer");
+      return;
+    }
+    server.send(200, "text/plain", "profiling at " + String(profHz) + " Hz, depth " + String(profDepth));
+    return;
+  }
+  if (server.hasArg("free")) {
+    profFree();
+    server.send(200, "text/plain", "OK");
+    return;
+  }
+  profStop();
+  if (server.hasArg("stop")) {
+    uint32_t ticks = profSamples + profIdle;
+    String msg = "ms=" + String(profMs) + " hz=" + String(profHz) + " samples=" + String(profSamples);
+    msg += " idle=" + String(profIdle) + " lost=" + String(profLost) + " words=" + String(profLen);
+    if (ticks) msg += " busy=" + String(100.0f * profSamples / ticks, 1) + "%";
+    server.send(200, "text/plain", msg);
+    return;
+  }
+  if (!profBuf) {
+    server.send(404, "text/plain", "no profile, start one with /prof?start=1");
+    return;
+  }
+
+  ProfHeader h = {};
+  h.magic   = PROF_MAGIC;
+  h.version = PROF_VERSION;
+  h.board   = HEBA_BOARD;
+  h.depth   = profDepth;
+  h.hz      = profHz;
+  h.ms      = profMs;
+  h.samples = profSamples;
+  h.idle    = profIdle;
+  h.lost    = profLost;
+  h.words   = profLen;
+  memcpy(h.elfSha, esp_ota_get_app_description()->app_elf_sha256, sizeof(h.elfSha));
+  server.sendHeader("Content-Disposition", "attachment; filename=prof.bin");
+  server.setContentLength(sizeof(h) + profLen * sizeof(uint32_t));
+  server.send(200, "application/octet-stream", "");
+  server.sendContent((const char*)&h, sizeof(h));
+  server.sendContent((const char*)profBuf, profLen * sizeof(uint32_t));
+}
+
+// PCA9685 clock: /pca, /pca?osc=Hz, or /pca?measured=Hz with the output
+// frequency read off a scope / counter (the oscillator follows from it).
+// Chained boards: &board=n (default 0).
+void handlePca() {
+  int b = server.hasArg("board") ? server.arg("board").toInt() : 0;
+  if (b < 0 || b >= NUM_PCA) {
+    server.send(400, "text/plain", "bad board");
+    return;
+  }
+  if (server.hasArg("osc")) {
+    pcaSetOsc(b, server.arg("osc").toInt());
+  } else if (server.hasArg("measured")) {
+    pcaSetOsc(b, lroundf(server.arg("measured").toFloat() * PCA_COUNTS * (pcaPrescale[b] + 1)));
+  }
+  String msg;
+  for (int i=0;i<NUM_PCA;i++) {
+    msg += "board=" + String(i) + " addr=0x" + String(PCA_ADDR + i, HEX);
+    if (!(pcaMask & (1 << i))) {
+      msg += " missing\n";
+      continue;
+    }
+    msg += " osc_hz=" + String(pcaOscHz[i]);
+    msg += " pwm_hz=" + String(pcaHz[i], 2);
+    msg += " counts_per_ms=" + String(pcaCounts16[i] * 16000, 1) + "\n";
+  }
+  msg += "frames=" + String(pcaFlushes) + " errors=" + String(pcaFlushErrors);
+  msg += " precompiled=" + String(pcaCompiled) + " computed=" + String(pcaLive);
+  server.send(200, "text/plain", msg);
+}
+
+// Whole pose in one request: /pose?a=90,90,90,90,90,60[&l=&r=][&w=]
+// All joints are queued first and then started together by the scheduler.
+// &save=mode[&dur=ms] also appends the pose as a frame (one round trip per frame).
+void handlePose() {
+  int a[NUM_ARM_SERVOS];
+  if (!server.hasArg("a") || parsePosList(server.arg("a"), a, NUM_ARM_SERVOS) != NUM_ARM_SERVOS) {
+    server.send(400, "text/plain", "need a=" + String(NUM_ARM_SERVOS) + " angles");
+    return;
+  }
+  for (int j=0;j<NUM_ARM_SERVOS;j++) queueServo(j, a[j]);
+#if HEBA_HAS_WIPER
+  if (server.hasArg("w")) queueServo(SERVO_WIPER, parsePos(server.arg("w")));
+#endif
+  updateMotionScheduler();
+
+#if HEBA_HAS_CHASSIS
+  if (server.hasArg("l") || server.hasArg("r")) {
+    if (currentMode == MODE_OBSTACLE_STOP) {
+      server.send(200, "text/plain", "Obstacle - drive blocked");
+      return;
+    }
+    setMotors(constrain(server.arg("l").toInt(), -255, 255), constrain(server.arg("r").toInt(), -255, 255));
+  }
+#endif
+
+  if (server.hasArg("save")) {
+    int slot = NUM_SLOTS == 1 ? 0 : slotFromName(server.arg("save"));
+    int dur = server.hasArg("dur") ? server.arg("dur").toInt() : kTeachStepMs;
+    if (slot < 0 || !savePoseToSeq(slot, dur)) {
+      server.send(500, "text/plain", "Seq full or bad mode");
+      return;
+    }
+    server.send(200, "text/plain", "Pose set, frame " + String(seqLen[slot]) + " saved");
+    return;
+  }
+  server.send(200, "text/plain", "OK pose");
+}
+
+// Backup / provisioning: GET /backup[?mode=] downloads the binary image,
+// POST /backup (raw application/octet-stream body) restores it
+void handleBackupGet() {
+  int slot = -1;
+  if (server.hasArg("mode")) {
+    slot = NUM_SLOTS == 1 ? 0 : slotFromName(server.arg("mode"));
+    if (slot < 0) {
+      server.send(400, "text/plain", "bad mode");
+      return;
+    }
+  }
+  server.sendHeader("Content-Disposition", "attachment; filename=heba.bin");
+  server.setContentLength(imageSize(slot));
+  server.send(200, "application/octet-stream", "");
+  writeImage(slot, sendImageChunk);
+}
+
+void sendImageChunk(const uint8_t* data, size_t len) {
+  server.sendContent((const char*)data, len);
+}
+
+// Body chunks as they arrive, parsed straight into the tmp files
+void handleBackupUpload() {
+  HTTPRaw &raw = server.raw();
+  if (raw.status == RAW_START) {
+    imageBegin();
+  } else if (raw.status == RAW_WRITE) {
+    imageFeed(raw.buf, raw.currentSize);
+  } else if (raw.status == RAW_ABORTED) {
+    img.state = IMG_ERROR;
+    imageFinish();
+  }
+}
+
+void handleBackupPost() {
+  int restored = imageFinish();
+  if (restored < 0) {
+    server.send(400, "text/plain", "bad image (size, board or CRC)");
+    return;
+  }
+  server.send(200, "text/plain", "Restored " + String(restored) + " slot(s)");
+}
+
+// Taught frames: /seq?mode=water (arm: /seq)
+// GET returns the Pose frames as hex, POST replaces them (heba_retime.py)
+void handleSeq() {
+  int slot = NUM_SLOTS == 1 ? 0 : slotFromName(server.hasArg("mode") ? server.arg("mode") : "");
+  if (slot < 0) {
+    server.send(400, "text/plain", "bad mode");
+    return;
+  }
+  uint16_t frames = storedLen(slot);
+  server.setContentLength(frames * sizeof(Pose) * 2);
+  server.send(200, "text/plain", "");
+  Pose buf[WINDOW_FRAMES];
+  for (int i=0; i<frames; i+=WINDOW_FRAMES) {
+    int n = readFrames(slot, i, buf, min(WINDOW_FRAMES, frames - i));
+    server.sendContent(bytesToHex((const uint8_t*)buf, n * sizeof(Pose)));
+  }
+}
+
+// A POST body is decoded as it arrives, a frame at a time into the slot's
+// tmp file, like a /backup upload: up to MAX_FRAMES frames (36 hex digits
+// each) never fit in RAM. Whitespace between the digits is skipped.
+struct SeqUpload {
+  File     file;
+  int8_t   slot = -1;
+  bool     ok;
+  bool     half;               // high nibble in, low one still to come
+  uint8_t  fill;               // bytes of the frame collected so far
+  uint32_t frames;
+  uint8_t  frame[sizeof(Pose)];
+};
+SeqUpload seqUp;
+
+int hexNibble(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c |= 0x20;
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+void seqUploadFeed(const uint8_t* data, size_t len) {
+  for (size_t i=0; seqUp.ok && i<len; i++) {
+    if (isspace(data[i])) continue;
+    int v = hexNibble(data[i]);
+    if (v < 0) {
+      seqUp.ok = false;
+    } else if (!seqUp.half) {
+      seqUp.frame[seqUp.fill] = v << 4;
+      seqUp.half = true;
+    } else {
+      seqUp.frame[seqUp.fill++] |= v;
+      seqUp.half = false;
+      if (seqUp.fill < sizeof(Pose)) continue;
+      seqUp.fill = 0;
+      seqUp.ok = ++seqUp.frames <= MAX_FRAMES && seqUp.file.write(seqUp.frame, sizeof(Pose)) == sizeof(Pose);
+    }
+  }
+}
+
+void handleSeqUpload() {
+  HTTPRaw &raw = server.raw();
+  if (raw.status == RAW_START) {
+    seqUp.slot   = NUM_SLOTS == 1 ? 0 : slotFromName(server.hasArg("mode") ? server.arg("mode") : "");
+    seqUp.half   = false;
+    seqUp.fill   = 0;
+    seqUp.frames = 0;
+    seqUp.ok     = false;
+    if (seqUp.slot < 0) return;
+    char tmp[16];
+    seqPath(seqUp.slot, "tmp", tmp);
+    seqUp.file = LittleFS.open(tmp, FILE_WRITE);
+    seqUp.ok   = seqUp.file;
+  } else if (raw.status == RAW_WRITE) {
+    seqUploadFeed(raw.buf, raw.currentSize);
+  } else if (raw.status == RAW_ABORTED) {
+    seqUp.ok = false;
+  }
+}
+
+void handleSeqPost() {
+  int slot = seqUp.slot;
+  seqUp.slot = -1;
+  if (slot < 0) {
+    server.send(400, "text/plain", "bad mode");
+    return;
+  }
+  seqUp.file.close();
+  bool ok = seqUp.ok && seqUp.fill == 0 && !seqUp.half;
+
+  if (ok && playSlot == slot) stopPlay();
+  commitSequence(slot, ok);
+  if (!ok) {
+    server.send(400, "text/plain", "bad sequence");
+    return;
+  }
+  interruptedIndex = -1;
+  windowInvalidate();
+  server.send(200, "text/plain", "Sequence stored (" + String(seqLen[slot]) + " frames)");
+}
+
+#if HEBA_HAS_SONAR
+// Ultrasonic table: /sonar
+// ?cm=120,400,... injects readings (one per sensor, in firing order) in
+// place of the echoes, ?sim=0 goes back to the real sensors
+void handleSonar() {
+  if (server.hasArg("cm")) {
+    int cm[NUM_SONARS];
+    int n = parseList(server.arg("cm"), cm, NUM_SONARS);
+    for (int i=0;i<n;i++) sonarSimCm[i] = constrain(cm[i], 0, SONAR_NO_ECHO_CM);
+    sonarSim = true;
+  }
+  if (server.hasArg("sim")) sonarSim = server.arg("sim") != "0";
+
+  static const char* const dirNames[] = {"front", "rear", "left", "right"};
+  unsigned long now = millis();
+  unsigned long upMs = max(now - sonarStartMs, 1UL);
+  uint32_t total = 0;
+
+  String json = "{\"sim\":" + String(sonarSim ? "true" : "false") + ",\"sensors\":[";
+  for (unsigned int i=0;i<NUM_SONARS;i++) {
+    const SonarState &st = sonar[i];
+    total += st.readings;
+    if (i) json += ",";
+    json += "{\"dir\":\"" + String(dirNames[kSonars[i].dir]) + "\"";
+    json += ",\"cm\":" + String(st.cm);
+    json += ",\"raw\":" + String(st.raw[(st.next + 2) % 3]);
+    json += ",\"ageMs\":" + String(now - st.updatedMs);
+    json += ",\"hz\":" + String(st.readings * 1000.0 / upMs, 1) + "}";
+  }
+  json += "],\"hz\":" + String(total * 1000.0 / upMs, 1);
+  json += ",\"obstacleCm\":" + String(lastDistanceCm) + "}";
+  server.send(200, "application/json", json);
+}
+#endif
+
+#if HEBA_HAS_CHASSIS
+// Manual drive: /drive?cmd=F/B/L/R/S
+void handleDrive() {
+  if (currentMode == MODE_OBSTACLE_STOP) {
+    server.send(200, "text/plain", "Obstacle - drive blocked");
+    return;
+  }
+
+  String cmd = server.hasArg("cmd") ? server.arg("cmd") : "";
+  if (cmd == "F") {
+    setMotors(200, 200);
+  } else if (cmd == "B") {
+    setMotors(-200, -200);
+  } else if (cmd == "L") {
+    setMotors(-150, 150);
+  } else if (cmd == "R") {
+    setMotors(150, -150);
+  } else {
+    setMotors(0, 0);
+  }
+  server.send(200, "text/plain", "OK drive " + cmd);
+}
+#endif
+
+#if HEBA_HAS_WEB_UI
+// ---------- Arm web UI ----------
+const char* const jointNames[NUM_ARM_SERVOS] = {"Base", "Shoulder", "Elbow", "Wrist", "Rotate", "Gripper"};
+
+String getHTML() {
+  String html = "<!DOCTYPE html><html><head>";
+  html += "<meta name='viewport' content='width=device-width, initial-scale=1'>";
+  html += "<style>";
+  html += "body{font-family:Arial;margin:0;padding:20px;background:#0a0a0a;color:#fff}";
+  html += ".container{max-width:800px;margin:0 auto}";
+  html += "h1{text-align:center;color:#00ff88;text-shadow:0 0 10px #00ff88}";
+  html += ".mode{display:flex;gap:10px;margin:20px 0}";
+  html += ".mode button{flex:1;padding:15px;font-size:18px;border:none;cursor:pointer;border-radius:8px}";
+  html += ".active{background:#00ff88;color:#000}";
+  html += ".inactive{background:#333;color:#fff}";
+  html += ".servo-control{background:#1a1a1a;padding:15px;margin:10px 0;border-radius:8px;border:1px solid #333}";
+  html += ".servo-name{color:#00ff88;font-size:20px;margin-bottom:10px}";
+  html += ".servo-value{color:#fff;font-size:24px;text-align:center;margin:10px 0}";
+  html += "input[type=range]{width:100%;height:40px;margin:10px 0}";
+  html += ".controls{display:grid;grid-template-columns:1fr 1fr;gap:10px;margin:20px 0}";
+  html += "button{background:#00ff88;border:none;color:#000;padding:15px;font-size:16px;";
+  html += "cursor:pointer;border-radius:8px;font-weight:bold}";
+  html += "button:hover{background:#00cc70}";
+  html += ".train-btn{background:#ff9500}";
+  html += ".train-btn:hover{background:#cc7700}";
+  html += ".danger{background:#ff3b30}";
+  html += ".danger:hover{background:#cc2f26}";
+  html += ".info{background:#1a1a1a;padding:15px;margin:20px 0;border-radius:8px;border:1px solid #00ff88}";
+  html += "</style></head><body>";
+  html += "<div class='container'>";
+  html += "<h1>🦾 5-DOF ROBOTIC ARM</h1>";
+
+  // Mode selection
+  html += "<div class='mode'>";
+  html += "<button class='" + String(isTraining ? "active" : "inactive") + "' onclick='setMode(\"train\")'>📝 TRAIN</button>";
+  html += "<button class='" + String(!isTraining ? "active" : "inactive") + "' onclick='setMode(\"control\")'>🎮 CONTROL</button>";
+  html += "</div>";
+
+  // Info panel
+  html += "<div class='info'>";
+  html += "<strong>Saved Positions:</strong> " + String(seqLen[0]);
+  html += "<br><strong>Status:</strong> <span id='status'>" + String(playing ? "Playing ▶️" : isTraining ? "Training 📝" : "Ready ✓") + "</span>";
+  html += "</div>";
+
+  // Servo controls
+  for (int i=0;i<NUM_ARM_SERVOS;i++) {
+    html += "<div class='servo-control'>";
+    html += "<div class='servo-name'>" + String(jointNames[i]) + "</div>";
+    String deg = String(currentServoAngles[i] / (float)POS_SCALE, 1);
+    html += "<div class='servo-value' id='val" + String(i) + "'>" + deg + "°</div>";
+    html += "<input type='range' min='0' max='180' step='0.1' value='" + deg + "' ";
+    html += "oninput='updateServo(" + String(i) + ",this.value)'>";
+    html += "</div>";
+  }
+
+  // Control buttons
+  html += "<div class='controls'>";
+  html += "<button onclick='home()'>🏠 HOME</button>";
+  html += "<button onclick='stopAll()'>⛔ STOP</button>";
+  html += "<button class='train-btn' onclick='capturePosition()'>📸 CAPTURE</button>";
+  html += "<button onclick='playSequence()'>▶️ PLAY</button>";
+  html += "<button onclick='resumeSequence()'>⏯️ RESUME</button>";
+  html += "<button onclick='saveSequence()'>💾 SAVE</button>";
+  html += "<button onclick='loadSequence()'>📂 LOAD</button>";
+  html += "<button class='danger' onclick='clearSequence()'>🗑️ CLEAR</button>";
+  html += "</div>";
+
+  html += "</div>";
+
+  html += "<script>";
+  html += "function updateServo(idx,val){";
+  html += "document.getElementById('val'+idx).innerText=val+'°';";
+  html += "fetch('/servo?idx='+idx+'&angle='+val);}";
+  html += "function setMode(m){fetch('/mode?m='+m).then(()=>location.reload());}";
+  html += "function home(){fetch('/home').then(()=>location.reload());}";
+  html += "function stopAll(){fetch('/stop').then(()=>location.reload());}";
+  html += "function capturePosition(){fetch('/capture').then(r=>r.text()).then(t=>alert(t));}";
+  html += "function playSequence(){if(confirm('Play sequence?')){fetch('/play');}}";
+  html += "function resumeSequence(){fetch('/resume');}";
+  html += "function saveSequence(){fetch('/save').then(()=>alert('Saved!'));}";
+  html += "function loadSequence(){fetch('/load').then(()=>location.reload());}";
+  html += "function clearSequence(){if(confirm('Clear all positions?')){fetch('/clear').then(()=>location.reload());}}";
+  html += "setInterval(()=>fetch('/status').then(r=>r.json()).then(s=>{";
+  html += "document.getElementById('status').innerText=s.playing?'Playing ▶️ '+(s.position+1)+'/'+s.length:s.training?'Training 📝':'Ready ✓';";
+  html += "}),1000);";
+  html += "</script></body></html>";
+
+  return html;
+}
+
+void handleRoot() {
+  server.send(200, "text/html", getHTML());
+}
+
+void handleMode() {
+  if (server.hasArg("m")) {
+    isTraining = (server.arg("m") == "train");
+    server.send(200, "text/plain", "OK");
+  }
+}
+
+void handleHome() {
+  moveAllToHome();
+  server.send(200, "text/plain", "OK");
+}
+
+void handleCapture() {
+  if (!savePoseToSeq(0, kTeachStepMs)) {
+    server.send(400, "text/plain", "Sequence full!");
+    return;
+  }
+  server.send(200, "text/plain", "Position " + String(seqLen[0]) + " captured!");
+}
+
+// Captures are written to flash as they are taken; SAVE/LOAD stay for the UI
+void handleSave() {
+  server.send(200, "text/plain", "OK");
+}
+
+void handleLoad() {
+  stopPlay();
+  countSequence(0);
+  interruptedIndex = -1;
+  server.send(200, "text/plain", "OK");
+}
+
+void handleClear() {
+  stopPlay();
+  clearSequence(0);
+  interruptedIndex = -1;
+  server.send(200, "text/plain", "OK");
+}
+
+#else
+// Save pose: /save?mode=water&dur=2000
+void handleSave() {
+  int slot = slotFromName(server.hasArg("mode") ? server.arg("mode") : "");
+  int dur = server.hasArg("dur") ? server.arg("dur").toInt() : kTeachStepMs;
+
+  if (slot >= 0 && savePoseToSeq(slot, dur)) {
+    server.send(200, "text/plain", "Saved frame");
+  } else {
+    server.send(500, "text/plain", "Seq full or bad mode");
+  }
+}
+
+#if HEBA_HAS_MISSIONS
+// Mission bytecode: /mission?mode=clean
+// GET returns hex, POST body = hex from heba_mission.py, &clear=1 deletes
+void handleMission() {
+  int slot = slotFromName(server.hasArg("mode") ? server.arg("mode") : "");
+  if (slot < 0) {
+    server.send(400, "text/plain", "bad mode");
+    return;
+  }
+
+  if (server.hasArg("clear")) {
+    if (missionSlotNow == slot) stopMission();
+    missionLen[slot] = 0;
+    saveMission(slot);
+    server.send(200, "text/plain", "Mission cleared");
+    return;
+  }
+
+  if (server.method() != HTTP_POST) {
+    if (missionLen[slot] == 0) {
+      server.send(404, "text/plain", "no mission");
+      return;
+    }
+    server.send(200, "text/plain", bytesToHex(missionProg[slot], missionLen[slot]));
+    return;
+  }
+
+  String body = server.arg("plain");
+  body.trim();
+  uint8_t code[MAX_MISSION_BYTES];
+  int len = hexToBytes(body, code, sizeof(code));
+  if (len < 0 || !verifyMission(code, len)) {
+    server.send(400, "text/plain", "bad mission");
+    return;
+  }
+  if (missionSlotNow == slot) stopMission();
+  memcpy(missionProg[slot], code, len);
+  missionLen[slot] = len;
+  saveMission(slot);
+  logEvent(EV_MISSION_STORED, slot, len);
+  server.send(200, "text/plain", "Mission stored (" + String(len) + " bytes)");
+}
+#endif
+
+// Root: help text
+void handleRoot() {
+  String msg = "HEBA Robot API:\n";
+#if HEBA_HAS_CHASSIS
+  msg += "/drive?cmd=F/B/L/R/S\n";
+#endif
+  msg += "/servo?ch=0-" + String(NUM_SERVOS - 1) + "&ang=0-180 (0.1 steps)\n";
+  msg += "/save?mode=water|med|garbage|clean&dur=ms\n";
+  msg += "/play?mode=water|med|garbage|clean\n";
+  msg += "/resume[?mode=...]\n";
+  msg += "/seq?mode=... [POST hex frames]\n";
+  msg += "/pose?a=a0,...,a5[&l=&r=][&w=][&save=mode&dur=ms]\n";
+  msg += "/pca[?board=n][&osc=Hz|measured=Hz]\n";
+  msg += "/backup[?mode=] [POST binary image]\n";
+  msg += "/stop\n";
+  msg += "/estop[?reset=1|status=1] (fast path: UDP \"ESTOP\" to port " + String(ESTOP_UDP_PORT) + ")\n";
+  msg += "/wave?target=0-" + String(NUM_SERVOS - 1) + "|wiper|turn&shape=sine|triangle|trapezoid&center=&amp=&period=ms[&phase=deg] [&stop=1]\n";
+  msg += "/status\n";
+#if HEBA_HAS_MISSIONS
+  msg += "/mission?mode=water|med|garbage|clean [POST hex] [&clear=1]\n";
+#endif
+  msg += "/power?budget=mA\n";
+  msg += "/perf[?reset=1] (loop timing)\n";
+  msg += "/prof?start=1[&hz=][&depth=] | stop=1 | free=1, /prof downloads (sampling profiler)\n";
+#if HEBA_HAS_SONAR
+  msg += "/sonar[?cm=a,b,...][&sim=0]\n";
+#endif
+  server.send(200, "text/plain", msg);
+}
+#endif
+
+// Every request except status polling counts as activity (wakes from IDLE)
+void onRoute(const char* path, void (*fn)()) {
+  server.on(path, [fn]() { markActivity(WAKE_HTTP); fn(); });
+}
+
+void setupRoutes() {
+  onRoute("/", handleRoot);
+  onRoute("/servo", handleServo);
+  onRoute("/play", handlePlay);
+  onRoute("/resume", handleResume);
+  onRoute("/stop", handleStop);
+  onRoute("/estop", handleEstop);
+  onRoute("/wave", handleWave);
+  server.on("/status", handleStatus);
+  onRoute("/save", handleSave);
+  server.on("/power", handlePower);
+  server.on("/perf", handlePerf);
+  server.on("/prof", handleProf);
+  onRoute("/pca", handlePca);
+  server.on("/seq", HTTP_POST, handleSeqPost, []() { markActivity(WAKE_HTTP); handleSeqUpload(); });
+  onRoute("/seq", handleSeq);
+  onRoute("/pose", handlePose);
+  server.on("/backup", HTTP_GET, []() { markActivity(WAKE_HTTP); handleBackupGet(); });
+  server.on("/backup", HTTP_POST, handleBackupPost, []() { markActivity(WAKE_HTTP); handleBackupUpload(); });
+#if HEBA_HAS_SONAR
+  onRoute("/sonar", handleSonar);
+#endif
+#if HEBA_HAS_CHASSIS
+  onRoute("/drive", handleDrive);
+#endif
+#if HEBA_HAS_MISSIONS
+  onRoute("/mission", handleMission);
+#endif
+#if HEBA_HAS_WEB_UI
+  onRoute("/mode", handleMode);
+  onRoute("/home", handleHome);
+  onRoute("/capture", handleCapture);
+  onRoute("/load", handleLoad);
+  onRoute("/clear", handleClear);
+#endif
+}
+#endif
+
+// ========== Warm restart ==========
+void checkpointSave() {
+  Checkpoint &c = ckpt[(ckptSeq + 1) & 1];
+  unsigned long now = millis();
+  __atomic_store_n(&c.magic, 0, __ATOMIC_RELEASE);
+
+  c.kind = CKPT_NONE;
+  if (playing) {
+    c.kind       = CKPT_PLAY;
+    c.slot       = playSlot;
+    c.frame      = playIndex;
+    c.elapsed[0] = transitioning || lastFrameIndex != playIndex ? 0 : now - frameStartTime;
+  }
+#if HEBA_HAS_MISSIONS
+  else if (missionRunning) {
+    c.kind       = CKPT_MISSION;
+    c.slot       = missionSlotNow;
+    c.missionLen = missionLen[missionSlotNow];
+    c.trackCount = missionTrackCount;
+    for (int t=0;t<missionTrackCount;t++) {
+      c.tracks[t]  = missionTracks[t];
+      c.elapsed[t] = now - missionTracks[t].waitStart;
+    }
+    for (int i=0;i<NUM_WAVES;i++) {
+      c.waves[i]       = waves[i];
+      c.waveElapsed[i] = now - waves[i].start;
+    }
+  }
+#endif
+  c.prescale = pcaPrescale[0];
+  c.attempt  = ckptAttempt;
+  c.left     = currentLeftSpeed;
+  c.right    = currentRightSpeed;
+#if HEBA_HAS_WIPER
+  c.wiper    = wiperOverride;
+#endif
+  for (int j=0;j<NUM_SERVOS;j++) c.servo[j] = outputValid[j] ? outputAngle[j] : currentServoAngles[j];
+  c.seq = ++ckptSeq;
+  __atomic_store_n(&c.magic, CKPT_MAGIC, __ATOMIC_RELEASE);
+
+  ckptSavedMs = now;
+  ckptDirty   = false;
+}
+
+// Called every loop: on each keyframe, then every CKPT_REFRESH_MS. Not while
+// paused for an obstacle: the checkpoint from before the pause is the one
+// to continue from.
+void updateCheckpoint() {
+  if (warmPending) return;   // the old run isn't back yet, keep its checkpoint
+  if (!motionActive()) {
+    if (!ckptIdle) {
+      ckptAttempt = 0;
+      checkpointSave();
+      ckptIdle = true;
+    }
+    return;
+  }
+  ckptIdle = false;
+  if (playbackPaused) return;
+  unsigned long now = millis();
+  if (ckptAttempt > 0 && now - warmResumedMs >= CKPT_STABLE_MS) ckptAttempt = 0;
+  if (ckptDirty || now - ckptSavedMs >= CKPT_REFRESH_MS) checkpointSave();
+}
+
+// Called in setup() before the servo driver is touched. Only a reset the
+// robot didn't ask for resumes: power-on, the EN button and ESP.restart() don't.
+void checkpointLoad() {
+  esp_reset_reason_t reason = esp_reset_reason();
+  bool crashed = reason == ESP_RST_BROWNOUT || reason == ESP_RST_PANIC || reason == ESP_RST_INT_WDT ||
+                 reason == ESP_RST_TASK_WDT || reason == ESP_RST_WDT;
+  int newest = -1;
+  for (int i=0;i<2;i++) {
+    if (ckpt[i].magic != CKPT_MAGIC) continue;
+    if (newest < 0 || (int32_t)(ckpt[i].seq - ckpt[newest].seq) > 0) newest = i;
+  }
+  if (!crashed || newest < 0) {
+    ckpt[0].magic = 0;
+    ckpt[1].magic = 0;
+    return;
+  }
+
+  const Checkpoint &c = ckpt[newest];
+  ckptSeq = c.seq;
+  if (c.kind == CKPT_NONE || c.slot < 0 || c.slot >= NUM_SLOTS) return;
+  if (c.attempt >= CKPT_MAX_ATTEMPTS) {
+    logEvent(EV_WARM_RESUME, c.kind, c.slot, c.frame, c.attempt, WARM_GAVE_UP);
+    return;
+  }
+  warmCkpt    = c;
+  warmPending = true;
+  ckptAttempt = c.attempt + 1;
+}
+
+// Joints of a warm restart: if the PCA kept running they are still held at
+// the checkpoint positions and nothing moves; otherwise the soft-start
+// homing brings them to those positions instead of home.
+void warmOutputs() {
+  for (int j=0;j<NUM_SERVOS;j++) currentServoAngles[j] = warmCkpt.servo[j];
+  if (!warmHeld) return;
+  for (int j=0;j<NUM_SERVOS;j++) {
+    outputAngle[j] = warmCkpt.servo[j];
+    outputValid[j] = true;
+    writeServo(j, outputAngle[j]);   // same pulse again, brings the shadow in line
+  }
+  pcaFlush();
+  homingJoint = -1;
+}
+
+// Continues the interrupted run once the flash is mounted and the joints
+// are where the checkpoint says; the rest of the boot carries on meanwhile.
+// A sequence goes through the usual transition into its frame (minus the
+// time that frame had already run); a mission gets its tracks back, each
+// wait shortened by what had passed and a keyframe move finishing from
+// wherever the arm is.
+void warmResume() {
+  if (!warmPending) return;
+  if (!__atomic_load_n(&storageReady, __ATOMIC_ACQUIRE) || homingJoint >= 0) return;
+  warmPending   = false;
+  warmResumedMs = millis();
+
+  const Checkpoint &c = warmCkpt;
+  uint8_t result = warmHeld ? WARM_HELD : WARM_HOMED;
+  if (estopLatched) {
+    result = WARM_DROPPED;
+  } else if (c.kind == CKPT_PLAY && c.frame < seqLen[c.slot]) {
+    startTransition(c.slot, c.frame);
+    playSkipMs = c.elapsed[0];
+  }
+#if HEBA_HAS_MISSIONS
+  else if (c.kind == CKPT_MISSION && c.missionLen == missionLen[c.slot]) {
+    startMission(c.slot);
+    if (missionRunning && missionTrackCount == c.trackCount) {
+      unsigned long now = millis();
+      for (int t=0;t<c.trackCount;t++) {
+        MissionTrack &m = missionTracks[t];
+        m = c.tracks[t];
+        if (m.waitOp == OP_MOVE) {
+          for (int j=0;j<NUM_ARM_SERVOS;j++) m.moveFrom[j] = currentServoAngles[j];
+          m.waitMs    = c.elapsed[t] < m.waitMs ? m.waitMs - c.elapsed[t] : 1;
+          m.waitStart = now;
+          m.lastTick  = 0;
+        } else {
+          m.waitStart = now - c.elapsed[t];
+        }
+      }
+      for (int i=0;i<NUM_WAVES;i++) {
+        waves[i]            = c.waves[i];
+        waves[i].start      = now - c.waveElapsed[i];
+        waves[i].lastCounts = 0xFFFF;
+        waves[i].lastSpeed  = INT16_MIN;
+      }
+#if HEBA_HAS_WIPER
+      wiperOverride = c.wiper;
+#endif
+      setMotors(c.left, c.right);
+    } else {
+      stopMission();
+      result = WARM_DROPPED;
+    }
+  }
+#endif
+  else {
+    result = WARM_DROPPED;
+  }
+
+  logEvent(EV_WARM_RESUME, c.kind, c.slot, c.kind == CKPT_PLAY ? c.frame : c.tracks[0].pc, c.attempt + 1, result);
+}
+
+// ========== Boot ==========
+// setup() only does the safety path: motors off, sonar, servo outputs off.
+// Everything slow or optional comes up afterwards, one stage per loop pass
+// (so the sonar and homing keep running), and a missing peripheral is
+// logged and left out instead of stopping the boot.
+bool i2cPresent(uint8_t addr) {
+  Wire.beginTransmission(addr);
+  return Wire.endTransmission() == 0;
+}
+
+// Taught sequences (only their length, frames stream from flash) and missions
+void storageTask(void* arg) {
+  if (!LittleFS.begin(true)) logEvent(EV_PERIPH_MISSING, PERIPH_FLASH);
+#if HEBA_BOARD == HEBA_BOARD_ROBOT
+  initDemoCleaningSequence();
+#endif
+  for (int s=0;s<NUM_SLOTS;s++) countSequence(s);
+#if HEBA_HAS_MISSIONS
+  loadMissions();
+#endif
+  __atomic_store_n(&storageReady, true, __ATOMIC_RELEASE);
+  vTaskDelete(NULL);
+}
+
+void bootStep() {
+  switch (bootStage) {
+  case BOOT_RTC:
+    // keeps running without it, just no schedule
+#if HEBA_HAS_RTC
+    rtcOk = rtc.begin();
+    if (!rtcOk) {
+      logEvent(EV_PERIPH_MISSING, PERIPH_RTC);
+    } else {
+      if (rtc.lostPower()) rtc.adjust(DateTime(F(__DATE__), F(__TIME__)));
+      // INT/SQW as alarm output only (wakes us from light sleep)
+      rtc.disable32K();
+      rtc.writeSqwPinMode(DS3231_OFF);
+      rtc.clearAlarm(1);
+      rtc.clearAlarm(2);
+      rtc.disableAlarm(2);
+      if (kPins.rtcInt >= 0) pinMode(kPins.rtcInt, INPUT);   // module has the pull-up
+      clockBegin();
+    }
+#endif
+    break;
+
+  case BOOT_LCD:
+#if HEBA_HAS_LCD
+    lcdOk = i2cPresent(LCD_ADDR);
+    if (lcdOk) {
+      lcd.init();
+      lcd.backlight();
+      showStatus("HEBA Booting...", "Please wait");
+    } else {
+      logEvent(EV_PERIPH_MISSING, PERIPH_LCD);
+    }
+#endif
+    break;
+
+  case BOOT_WIFI:
+    WiFi.mode(WIFI_AP);
+    WiFi.softAP(kSsid, kPassword);
+    xTaskCreatePinnedToCore(estopUdpTask, "estopUdp", 2560, NULL, configMAX_PRIORITIES - 2, NULL, 1);
+    break;
+
+  case BOOT_SERVICES:
+    // requests need the sequences counted
+    if (!__atomic_load_n(&storageReady, __ATOMIC_ACQUIRE)) return;
+#if HEBA_HAS_HTTP
+    setupRoutes();
+    server.begin();
+#endif
+#if HEBA_HAS_ROBOREMO
+    roboRemo.begin();
+#endif
+    break;
+
+  case BOOT_DONE:
+    if (homingJoint >= 0) return;
+    finishBoot();
+    return;
+  }
+  bootStage++;
+}
+
+void finishBoot() {
+  booted  = true;
+  readyMs = millis();
+  lastActivityMs = readyMs;
+  updateLEDs();
+  IPAddress ip = WiFi.softAPIP();
+#if HEBA_HAS_LCD
+  showStatus(kBanner, ip.toString().c_str());
+#endif
+  logEvent(EV_READY, ip[0], ip[1], ip[2], ip[3], min(readyMs, (uint32_t)INT16_MAX));
+}
+
+// ========== Setup ==========
+void setup() {
+  Serial.setRxBufferSize(TETHER_RX_BUF);
+  Serial.setTxBufferSize(TETHER_TX_BUF);
+  Serial.begin(HEBA_SERIAL_BAUD);
+  logBegin();
+  estopTaskBegin();
+  tetherBegin();         // ESTOP trips from the UART task, booted or not
+
+  // Pins
+#if HEBA_HAS_CHASSIS
+  pinMode(kPins.in1, OUTPUT);
+  pinMode(kPins.in2, OUTPUT);
+  pinMode(kPins.in3, OUTPUT);
+  pinMode(kPins.in4, OUTPUT);
+  if (kPins.ena >= 0) {
+    // PWM channels for ENA/ENB
+    ledcSetup(0, 1000, 8); // channel 0, 1kHz, 8-bit
+    ledcAttachPin(kPins.ena, 0);
+    ledcSetup(1, 1000, 8);
+    ledcAttachPin(kPins.enb, 1);
+  }
+  stopMotors();
+#endif
+#if HEBA_HAS_SONAR
+  sonarBegin();
+#endif
+#if HEBA_HAS_LEDS
+  pinMode(kPins.ledYellow, OUTPUT);
+  pinMode(kPins.ledGreen, OUTPUT);
+  pinMode(kPins.ledRed, OUTPUT);
+#endif
+
+  waveBegin();
+  batteryBegin();   // throttles the scheduler from the first move on
+
+  // I2C, servo driver: all outputs full-off until homing picks them up
+  Wire.begin(kPins.sda, kPins.scl);
+  pcaBegin();
+  checkpointLoad();
+  if (pcaOk) {
+    // still at our prescale: the chip ran on through the reset (a power-on leaves 30)
+    warmHeld = warmPending && !estopLatched && (pcaMask & 1) && pcaReadReg(0, PCA_PRESCALE) == warmCkpt.prescale;
+    pcaStart();
+    if (!warmHeld) releaseAllServos();
+  }   // no boards at all: no servos, the rest still works
+  estopBegin();
+  startHoming();
+  if (warmPending) warmOutputs();
+
+  // Flash mounts (and formats, first time) on core 0 meanwhile
+  seqLock = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(windowLoaderTask, "seqLoad", 3072, NULL, 2, &windowTask, 0);
+  xTaskCreatePinnedToCore(storageTask, "storage", 4096, NULL, 1, NULL, 0);
+  // RTC, LCD, WiFi and the servers follow from loop(), see bootStep()
+}
+
+// ========== Loop ==========
+void updateMotion() {
+  handlePlayback();        // play taught sequences
+#if HEBA_HAS_MISSIONS
+  runMission();            // or an uploaded mission
+#endif
+#if HEBA_HAS_WIPER
+  updateWiper();           // wiper (for cleaning mode)
+#endif
+  updateWaves();           // periodic sweeps (wiper, missions, /wave)
+  updateHoming();          // re-arm after an e-stop
+  updateMotionScheduler(); // start queued servo moves within the current budget
+  updateCheckpoint();      // progress into RTC memory (warm restart)
+}
+
+unsigned long lastLCDupdate = 0;
+
+void loop() {
+  estopService();          // a trip is already out on the pins, this stops the rest
+
+  if (!booted) {           // safety path only until everything is up
+#if HEBA_HAS_SONAR
+    updateSonars();
+    checkObstacle();
+#endif
+    updateHoming();        // soft-start, one joint after another
+    warmResume();          // after a crash: the interrupted run continues...
+    bootStep();            // next deferred init stage
+    if (motionActive()) updateMotion();   // ...while the boot catches up
+    return;
+  }
+
+  loopTiming();
+
+#if HEBA_HAS_HTTP
+  uint32_t httpUs = micros();
+  server.handleClient();   // WiFi commands
+  httpUs = micros() - httpUs;
+  if (httpUs > httpMaxUs) httpMaxUs = httpUs;
+#endif
+#if HEBA_HAS_ROBOREMO
+  handleRoboRemo();
+#endif
+  tetherService();         // serial setpoints, telemetry
+
+#if HEBA_HAS_SONAR
+  updateSonars();          // next ping / echo, never waits
+  checkObstacle();         // obstacle logic
+#endif
+#if HEBA_HAS_RTC
+  clockService();          // keep the wall clock on the DS3231 (rarely touches I2C)
+  handleSchedule();        // RTC-based schedules
+#endif
+  updateMotion();          // playback / missions, servo scheduler
+  updatePower();           // relax / light sleep when nothing happens
+
+#if HEBA_HAS_LCD
+  // LCD refresh every ~1s when not obstacle (dark while idle)
+  if (currentMode != MODE_OBSTACLE_STOP && powerState == PWR_ACTIVE) {
+    unsigned long now = millis();
+    if (now - lastLCDupdate > 1000) {
+      updateLCD();
+      lastLCDupdate = now;
+    }
+  }
+#endif
+
+  if (powerState != PWR_ACTIVE && !clockHunting()) {
+    uint32_t t0 = micros();
+    delay(IDLE_LOOP_MS);   // CPU waits in the idle task
+    if (loopLastUs) loopLastUs += micros() - t0;   // the pacing isn't jitter, the rest of the pass is
+  }
+}
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""Back up, restore and provision HEBA units with one request.
+
+The firmware's /backup endpoint sends and accepts a binary image holding
+every taught sequence and mission of the unit:
+
+    "HEBA" version board slots 0          8 byte header
+    slot 0 frames(u16) missionLen(u16)    per slot, then
+    <frames x 18 byte Pose> <mission>     the data
+    crc32                                 zlib crc of everything before
+
+Version 2 images (12 byte Pose, whole degrees) from older firmware are
+read too; what gets written or restored is always version 3.
+
+Usage:
+    python3 heba_backup.py backup  http://192.168.4.1 -o unit1.heba
+    python3 heba_backup.py restore http://192.168.4.1 unit1.heba
+    python3 heba_backup.py show    unit1.heba
+    python3 heba_backup.py pack -o new.heba water=water.json clean=clean.mission
+
+'pack' builds an image from sequence files (.json/.hex, as written by
+heba_retime.py) and mission sources (compiled with heba_mission.py).
+The robot only accepts images made for its own board (--board).
+"""
+
+import argparse
+import json
+import struct
+import sys
+import urllib.request
+import zlib
+
+import heba_mission
+import heba_retime
+
+MAGIC = b"HEBA"
+VERSION = 3
+HEADER = struct.Struct("<4sBBBx")
+SLOT = struct.Struct("<BxHH")
+POSES = {2: heba_retime.POSE_V1, 3: heba_retime.POSE}
+BOARDS = {"classic": 1, "robot": 2, "arm": 3}
+SLOT_NAMES = {1: ["water", "med", "garbage", "clean"],
+              2: ["water", "med", "garbage", "clean"],
+              3: ["arm"]}
+
+
+class ImageError(Exception):
+    pass
+
+
+def parse_image(data):
+    """Returns (board, {slot: (frames, mission bytes)})."""
+    if len(data) < HEADER.size + 4:
+        raise ImageError("too short")
+    if zlib.crc32(data[:-4]) != struct.unpack("<I", data[-4:])[0]:
+        raise ImageError("CRC mismatch")
+    magic, version, board, count = HEADER.unpack_from(data)
+    if magic != MAGIC or version not in POSES:
+        raise ImageError("not a version %s HEBA image" % "/".join(map(str, POSES)))
+    pose = POSES[version]
+
+    slots = {}
+    pos = HEADER.size
+    for _ in range(count):
+        slot, nframes, mis_len = SLOT.unpack_from(data, pos)
+        pos += SLOT.size
+        frames = heba_retime.frames_from_bytes(data[pos:pos + nframes * pose.size], pose)
+        pos += nframes * pose.size
+        slots[slot] = (frames, data[pos:pos + mis_len])
+        pos += mis_len
+    if pos != len(data) - 4:
+        raise ImageError("length mismatch")
+    return board, slots
+
+
+def build_image(board, slots):
+    out = bytearray(HEADER.pack(MAGIC, VERSION, board, len(slots)))
+    for slot in sorted(slots):
+        frames, mission = slots[slot]
+        out += SLOT.pack(slot, len(frames), len(mission))
+        out += heba_retime.frames_to_bytes(frames)
+        out += mission
+    out += struct.pack("<I", zlib.crc32(bytes(out)))
+    return bytes(out)
+
+
+def slot_name(board, slot):
+    names = SLOT_NAMES.get(board, [])
+    return names[slot] if slot < len(names) else str(slot)
+
+
+def show(data):
+    board, slots = parse_image(data)
+    name = {v: k for k, v in BOARDS.items()}.get(board, str(board))
+    print("board %s, %d bytes, CRC ok" % (name, len(data)))
+    for slot, (frames, mission) in sorted(slots.items()):
+        print("  %-8s %3d frames %6.1f s   mission %3d bytes" % (
+            slot_name(board, slot), len(frames), sum(f["ms"] for f in frames) / 1000.0, len(mission)))
+
+
+def pack(board, items):
+    names = SLOT_NAMES[board]
+    slots = {}
+    for item in items:
+        mode, _, path = item.partition("=")
+        if mode not in names or not path:
+            raise ImageError("'%s': use mode=file with mode one of %s" % (item, ", ".join(names)))
+        frames, mission = slots.get(names.index(mode), ([], b""))
+        src = open(path).read()
+        doc = json.loads(src) if path.endswith(".json") else None
+        if path.endswith(".hex") or (isinstance(doc, dict) and "frames" in doc):
+            frames = heba_retime.load_file(path)[1]          # taught sequence
+        else:
+            ops = heba_mission.parse_json(doc) if doc is not None else heba_mission.parse_text(src)
+            mission = heba_mission.compile_mission(ops)
+        slots[names.index(mode)] = (frames, mission)
+    return build_image(board, slots)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    b = sub.add_parser("backup", help="download the image from a robot")
+    b.add_argument("url")
+    b.add_argument("-o", "--output", required=True)
+    b.add_argument("--mode", help="only this slot")
+    r = sub.add_parser("restore", help="upload an image to a robot")
+    r.add_argument("url")
+    r.add_argument("image")
+    s = sub.add_parser("show", help="list what an image holds")
+    s.add_argument("image")
+    p = sub.add_parser("pack", help="build an image from sequence and mission files")
+    p.add_argument("items", nargs="+", metavar="mode=file")
+    p.add_argument("-o", "--output", required=True)
+    p.add_argument("--board", choices=sorted(BOARDS), default="robot")
+    args = ap.parse_args()
+
+    try:
+        if args.cmd == "backup":
+            url = args.url.rstrip("/") + "/backup" + ("?mode=" + args.mode if args.mode else "")
+            with urllib.request.urlopen(url, timeout=10) as resp:
+                data = resp.read()
+            parse_image(data)
+            with open(args.output, "wb") as f:
+                f.write(data)
+            show(data)
+        elif args.cmd == "restore":
+            data = build_image(*parse_image(open(args.image, "rb").read()))   # always current version
+            req = urllib.request.Request(args.url.rstrip("/") + "/backup", data=data, method="POST",
+                                         headers={"Content-Type": "application/octet-stream"})
+            with urllib.request.urlopen(req, timeout=10) as resp:
+                print(resp.read().decode())
+        elif args.cmd == "show":
+            show(open(args.image, "rb").read())
+        else:
+            data = pack(BOARDS[args.board], args.items)
+            with open(args.output, "wb") as f:
+                f.write(data)
+            show(data)
+    except (ImageError, heba_mission.MissionError, ValueError) as e:
+        sys.exit("error: %s" % e)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,307 @@
+#!/usr/bin/env python3
+"""Load-test a HEBA robot's HTTP API with realistic operator traffic.
+
+The robot's WebServer answers one client at a time from loop(), so every
+request also holds up playback, the sonars and the servo scheduler. This
+tool plays several simulated clients at once and reports what they saw
+(throughput, latency percentiles per endpoint) and what the robot saw:
+the gaps between loop() passes from /perf, i.e. the control loop jitter
+the web traffic caused (servo period: 20 ms). HTTP requests don't count
+as activity, so with nothing moving the robot stays idle and paces loop()
+at 10 ms; /perf leaves that pacing out of the gaps and reports the power
+state, shown next to each measurement.
+
+Clients, as kind=count:
+
+    slider     the arm web UI: a joint slider dragged for 1-3 s, one /servo
+               per input event (~20/s), then a pause
+    dashboard  building dashboard: /status every second, /power every 10 s
+    operator   opens the page (/) now and then, starts a sequence with
+               /play and stops it again
+    poll       /status back to back, as fast as the robot answers
+
+    python3 heba_load.py http://192.168.4.1 slider=3 dashboard=1 -t 60
+    python3 heba_load.py http://192.168.4.1 poll=4 --no-motion --json run.json
+
+The arm moves (slider, operator): keep clear, or use --no-motion, which
+sends the same number of requests to /status instead. Before the run the
+robot's idle loop is measured for --baseline seconds for comparison.
+"""
+
+import argparse
+import http.client
+import json
+import random
+import sys
+import threading
+import time
+import urllib.parse
+
+SLIDER_HZ = 20
+MODES = ["water", "med", "garbage", "clean"]
+POWER_STATES = ["active", "idle", "sleep"]
+
+
+class Recorder:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.samples = []                 # (endpoint, start, seconds, ok)
+        self.skipped = 0                  # slider events that came while the previous request was open
+
+    def add(self, endpoint, start, secs, ok):
+        with self.lock:
+            self.samples.append((endpoint, start, secs, ok))
+
+    def skip(self, n):
+        with self.lock:
+            self.skipped += n
+
+
+class Client(threading.Thread):
+    def __init__(self, base, rec, stop_at, seed, no_motion, joints):
+        super().__init__(daemon=True)
+        u = urllib.parse.urlsplit(base)
+        self.host = u.hostname
+        self.port = u.port or 80
+        self.rec = rec
+        self.stop_at = stop_at
+        self.rng = random.Random(seed)
+        self.no_motion = no_motion
+        self.joints = joints
+
+    def get(self, path):
+        endpoint = path.split("?", 1)[0]
+        if self.no_motion and endpoint in ("/servo", "/play", "/stop"):
+            path = endpoint = "/status"
+        t0 = time.monotonic()
+        ok = False
+        try:
+            conn = http.client.HTTPConnection(self.host, self.port, timeout=5)
+            conn.request("GET", path)
+            resp = conn.getresponse()
+            resp.read()
+            ok = resp.status < 500
+            conn.close()
+        except (OSError, http.client.HTTPException):
+            pass
+        self.rec.add(endpoint, t0, time.monotonic() - t0, ok)
+
+    def sleep(self, secs):
+        time.sleep(max(0.0, min(secs, self.stop_at - time.monotonic())))
+
+    def running(self):
+        return time.monotonic() < self.stop_at
+
+
+class Slider(Client):
+    def run(self):
+        angle = {j: 90.0 for j in range(self.joints)}
+        while self.running():
+            j = self.rng.randrange(self.joints)
+            step = self.rng.choice((-1, 1)) * self.rng.uniform(0.5, 3.0)
+            drag_end = time.monotonic() + self.rng.uniform(1.0, 3.0)
+            due = time.monotonic()
+            while self.running() and time.monotonic() < drag_end:
+                angle[j] = min(150.0, max(30.0, angle[j] + step))
+                self.get("/servo?idx=%d&angle=%.1f" % (j, angle[j]))
+                due += 1.0 / SLIDER_HZ
+                late = time.monotonic() - due
+                if late > 0:
+                    # input events that came while the request was open: one
+                    # connection per client here, so they are counted, not sent
+                    missed = int(late * SLIDER_HZ)
+                    self.rec.skip(missed)
+                    due += missed / SLIDER_HZ
+                self.sleep(due - time.monotonic())
+            self.sleep(self.rng.uniform(0.5, 3.0))
+
+
+class Dashboard(Client):
+    def run(self):
+        n = 0
+        self.sleep(self.rng.uniform(0, 1))
+        while self.running():
+            self.get("/status")
+            if n % 10 == 0:
+                self.get("/power")
+            n += 1
+            self.sleep(1.0)
+
+
+class Operator(Client):
+    def run(self):
+        while self.running():
+            self.get("/")
+            self.sleep(self.rng.uniform(5, 15))
+            self.get("/play?mode=%s" % self.rng.choice(MODES))
+            self.sleep(self.rng.uniform(3, 8))
+            self.get("/stop")
+            self.sleep(self.rng.uniform(5, 15))
+
+
+class Poll(Client):
+    def run(self):
+        while self.running():
+            self.get("/status")
+
+
+KINDS = {"slider": Slider, "dashboard": Dashboard, "operator": Operator, "poll": Poll}
+
+
+def fetch(base, path):
+    try:
+        u = urllib.parse.urlsplit(base)
+        conn = http.client.HTTPConnection(u.hostname, u.port or 80, timeout=5)
+        conn.request("GET", path)
+        resp = conn.getresponse()
+        body = resp.read()
+        conn.close()
+        return body if resp.status == 200 else None
+    except (OSError, http.client.HTTPException):
+        return None
+
+
+def fetch_json(base, path):
+    body = fetch(base, path)
+    try:
+        return json.loads(body) if body is not None else None
+    except ValueError:
+        return None
+
+
+def percentile(values, p):
+    values = sorted(values)
+    if not values:
+        return float("nan")
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def hist_percentile(perf, p):
+    """Upper bound (us) of the bucket holding the p-th percentile gap."""
+    total = sum(perf["hist"])
+    seen = 0
+    for b, n in enumerate(perf["hist"]):
+        seen += n
+        if total and seen >= total * p / 100.0:
+            return perf["bucketUs"] << b if b < len(perf["hist"]) - 1 else perf["maxGapUs"]
+    return 0
+
+
+def loop_summary(perf, secs):
+    return {
+        "loops_per_s": perf["loops"] / secs if secs else 0.0,
+        "gap_p50_us": hist_percentile(perf, 50),
+        "gap_p99_us": hist_percentile(perf, 99),
+        "gap_max_us": perf["maxGapUs"],
+        "gaps_over_servo_period": perf["late"],
+        "http_max_us": perf["httpMaxUs"],
+        "min_free_heap": perf["minFreeHeap"],
+        "power_state": POWER_STATES[perf["powerState"]] if "powerState" in perf else None,
+    }
+
+
+def measure_idle(base, secs):
+    if secs <= 0 or fetch_json(base, "/perf?reset=1") is None:
+        return None
+    time.sleep(secs)
+    perf = fetch_json(base, "/perf?reset=1")
+    return loop_summary(perf, secs) if perf else None
+
+
+def parse_clients(specs):
+    clients = []
+    for spec in specs:
+        kind, _, count = spec.partition("=")
+        if kind not in KINDS:
+            raise ValueError("'%s': kinds are %s" % (spec, ", ".join(KINDS)))
+        clients += [kind] * int(count or 1)
+    return clients
+
+
+def report(rec, secs, baseline, under_load):
+    by_endpoint = {}
+    for endpoint, _start, dt, ok in rec.samples:
+        by_endpoint.setdefault(endpoint, []).append((dt * 1000.0, ok))
+
+    result = {"seconds": secs, "endpoints": {}, "skipped_slider_events": rec.skipped}
+    print("%-10s %7s %6s %7s %8s %8s %8s %8s" % ("endpoint", "reqs", "errors", "req/s", "p50 ms", "p90 ms",
+                                                 "p99 ms", "max ms"))
+    for endpoint, s in sorted(by_endpoint.items()):
+        ms = [m for m, ok in s if ok]
+        errors = sum(1 for _, ok in s if not ok)
+        row = {"requests": len(s), "errors": errors, "per_s": len(s) / secs,
+               "p50_ms": percentile(ms, 50), "p90_ms": percentile(ms, 90),
+               "p99_ms": percentile(ms, 99), "max_ms": max(ms) if ms else float("nan")}
+        result["endpoints"][endpoint] = row
+        print("%-10s %7d %6d %7.1f %8.1f %8.1f %8.1f %8.1f" % (
+            endpoint, row["requests"], errors, row["per_s"], row["p50_ms"], row["p90_ms"], row["p99_ms"],
+            row["max_ms"]))
+    total = len(rec.samples)
+    print("total %d requests, %.1f req/s, %d slider events came while a request was open" % (
+        total, total / secs, rec.skipped))
+
+    if under_load:
+        result["loop"] = under_load
+        result["loop_idle"] = baseline
+        print("\nrobot loop()       %10s %10s" % ("idle", "under load"))
+        for key, label in (("loops_per_s", "passes/s"), ("gap_p50_us", "gap p50 us"), ("gap_p99_us", "gap p99 us"),
+                           ("gap_max_us", "gap max us"), ("gaps_over_servo_period", "gaps > 20 ms"),
+                           ("http_max_us", "request us"), ("min_free_heap", "min heap")):
+            idle = "%10.0f" % baseline[key] if baseline else "%10s" % "-"
+            print("  %-16s %s %10.0f" % (label, idle, under_load[key]))
+        idle = baseline["power_state"] if baseline else None
+        print("  %-16s %10s %10s" % ("power state", idle or "-", under_load["power_state"] or "-"))
+    else:
+        print("\n(no /perf on this robot: loop timing not available)")
+    return result
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("url", help="robot base URL")
+    ap.add_argument("clients", nargs="+", metavar="kind=count", help=", ".join(KINDS))
+    ap.add_argument("-t", "--seconds", type=float, default=30.0)
+    ap.add_argument("--baseline", type=float, default=5.0, help="idle loop measurement first, s (0 = skip)")
+    ap.add_argument("--no-motion", action="store_true", help="/status instead of /servo, /play and /stop")
+    ap.add_argument("--joints", type=int, default=6, help="slider joints 0..n-1")
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--json", help="write the results here too")
+    args = ap.parse_args()
+
+    try:
+        kinds = parse_clients(args.clients)
+    except ValueError as e:
+        sys.exit("error: %s" % e)
+    base = args.url.rstrip("/")
+    if fetch_json(base, "/status") is None:
+        sys.exit("error: no /status at %s" % base)
+
+    baseline = measure_idle(base, args.baseline)
+    has_perf = fetch_json(base, "/perf?reset=1") is not None
+
+    rec = Recorder()
+    start = time.monotonic()
+    stop_at = start + args.seconds
+    threads = [KINDS[k](base, rec, stop_at, args.seed + i, args.no_motion, args.joints)
+               for i, k in enumerate(kinds)]
+    for t in threads:
+        t.start()
+    try:
+        for t in threads:
+            t.join()
+    except KeyboardInterrupt:
+        for t in threads:
+            t.stop_at = time.monotonic()
+    secs = time.monotonic() - start
+
+    perf = fetch_json(base, "/perf") if has_perf else None
+    if not args.no_motion and any(k == "operator" for k in kinds):
+        fetch(base, "/stop")
+    result = report(rec, secs, baseline, loop_summary(perf, secs) if perf else None)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(result, f, indent=1)
+
+
+if __name__ == "__main__":
+    main()
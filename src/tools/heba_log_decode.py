@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""Decode the HEBA flight recorder stream.
+
+The firmware (src/HEBA/code/code.c) writes binary log frames on Serial:
+
+    0xA5 0x5A <20 byte LogRecord> <xor of the 20 record bytes>
+
+LogRecord is little-endian: uint32 seq, uint32 ms, uint8 id, uint8 boot,
+int16 arg[5]. Anything between frames is passed through as plain text
+(the ROM boot messages run at 115200, -b 115200 to read those).
+
+While a host drives the robot with heba_tether.py, the same records come
+wrapped in its COBS messages instead; heba_tether.py prints them.
+
+Usage:
+    python3 heba_log_decode.py /dev/ttyUSB0          # live (needs pyserial)
+    python3 heba_log_decode.py capture.bin           # raw capture file
+    cat capture.bin | python3 heba_log_decode.py -
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+SYNC = b"\xA5\x5A"
+RECORD = struct.Struct("<IIBB5h")
+FRAME_LEN = len(SYNC) + RECORD.size + 1
+
+RESET_REASONS = [
+    "unknown", "power-on", "external", "software", "panic", "int-wdt",
+    "task-wdt", "wdt", "deep-sleep", "brownout", "sdio",
+]
+MODES = ["Water", "Medicine", "Garbage", "Cleaning"]
+PERIPHERALS = ["PCA9685", "RTC", "LCD", "LittleFS", "Battery ADC"]
+SONAR_DIRS = ["front", "rear", "left", "right"]
+POWER_STATES = ["active", "idle (servos relaxed)", "light sleep"]
+WAKE_CAUSES = ["-", "HTTP", "RoboRemo", "RTC alarm", "sonar", "serial tether"]
+ESTOP_SOURCES = ["switch", "UDP", "RoboRemo", "HTTP", "serial tether"]
+WARM_RESULTS = ["servos held through the reset", "servos soft-started to the checkpoint",
+                "dropped (e-stop or program gone)", "gave up, it keeps resetting"]
+BATT_LEVELS = ["ok, motion at full rate", "sagging, motion throttled", "at the floor, one joint at a time"]
+
+
+def reset_reason(a):
+    return RESET_REASONS[a[0]] if 0 <= a[0] < len(RESET_REASONS) else str(a[0])
+
+
+def mode_name(v):
+    return MODES[v] if 0 <= v < len(MODES) else str(v)
+
+
+def periph_name(v):
+    return name_of(PERIPHERALS, v)
+
+
+def name_of(names, v):
+    return names[v] if 0 <= v < len(names) else str(v)
+
+
+def seq_info(a):
+    # The old CLAUDE sketch logs these without args (all slots at once)
+    if not any(a):
+        return "all slots"
+    return "%s, %d frames" % (mode_name(a[0]), a[1])
+
+
+def command_text(a):
+    raw = struct.pack("<5h", *a)
+    return raw.split(b"\0", 1)[0].decode("ascii", "replace")
+
+
+# Must match enum LogEvent in the firmware.
+EVENTS = {
+    0: lambda a: "(%d log records lost)" % a[0],
+    1: lambda a: "Boot #%d, reset reason: %s" % (a[1], reset_reason(a)),
+    2: lambda a: "Ready! IP: %d.%d.%d.%d" % tuple(a[:4]) + (", %d ms after reset" % a[4] if a[4] else ""),
+    3: lambda a: "CMD: %s" % command_text(a),
+    4: lambda a: "Teaching mode: %s" % mode_name(a[0]),
+    5: lambda a: "Recorded step: %d" % a[0],
+    6: lambda a: "Servos: %d %d %d %d %d" % tuple(a),
+    7: lambda a: "Servos (cont): %d %d" % tuple(a[:2]),
+    8: lambda a: "Teaching ended and saved: %s, %d steps" % (mode_name(a[0]), a[1]),
+    9: lambda a: "Playing: %s" % mode_name(a[0]),
+    10: lambda a: "Sequence saved: %s" % seq_info(a),
+    11: lambda a: "Sequence loaded: %s" % seq_info(a),
+    12: lambda a: "Playback done: %s" % mode_name(a[0]),
+    13: lambda a: "Playback stopped: %s at frame %d" % (mode_name(a[0]), a[1] + 1),
+    14: lambda a: "Resuming at frame %d (%d ms transition)" % (a[0] + 1, a[1]),
+    15: lambda a: "Obstacle at %d cm (%s)" % (a[0], SONAR_DIRS[a[1] & 3]),
+    16: lambda a: "Path clear after %d ms" % a[0],
+    17: lambda a: "Mission started: %s%s" % (mode_name(a[0]), ", %d tracks" % a[1] if a[1] > 1 else ""),
+    18: lambda a: "Mission ended: %s" % mode_name(a[0]),
+    19: lambda a: "Mission stored: %s, %d bytes" % (mode_name(a[0]), a[1]),
+    20: lambda a: "%s not found, running without it" % (
+        "PCA9685 board %d (0x%02X)" % (a[1], 0x40 + a[1]) if a[0] == 0 and a[1] else periph_name(a[0])),
+    21: lambda a: "Power: %s" % name_of(POWER_STATES, a[0]),
+    22: lambda a: "Woken by %s, moving after %d ms" % (name_of(WAKE_CAUSES, a[0]), a[1]),
+    23: lambda a: "EMERGENCY STOP (%s): motors off in %d us, servos %s in %d us (bound %d us)%s" % (
+        name_of(ESTOP_SOURCES, a[0]), a[1], "off" if a[4] else "not cut", a[2], a[3],
+        "  ** over the bound **" if a[2] > a[3] else ""),
+    24: lambda a: "E-stop reset (%d trips so far)" % a[0],
+    25: lambda a: "Warm restart #%d, %s %s at %s %d: %s" % (
+        a[3], "sequence" if a[0] == 1 else "mission", mode_name(a[1]), "frame" if a[0] == 1 else "pc",
+        a[2] + 1 if a[0] == 1 else a[2], name_of(WARM_RESULTS, a[4])),
+    26: lambda a: "Battery %s: %.2f V under load, %.2f V resting (%d%%)%s" % (
+        name_of(BATT_LEVELS, a[0]), a[1] / 1000.0, a[2] / 1000.0, a[4],
+        ", buck %.2f V" % (a[3] / 1000.0) if a[3] else ""),
+    27: lambda a: ("Serial tether: host connected" if a[0] else "Serial tether: host gone") + (
+        " (%d CRC errors, %d overruns so far)" % (a[1], a[2]) if a[1] or a[2] else ""),
+}
+
+
+def format_record(ms, ev, boot, args):
+    # Records replayed from RTC memory after a reset carry the older boot number
+    fmt = EVENTS.get(ev)
+    text = fmt(args) if fmt else "event %d %s" % (ev, list(args))
+    return "[%3d] %10.3f  %s" % (boot, ms / 1000.0, text)
+
+
+def decode(chunks, out):
+    buf = bytearray()
+    text = bytearray()
+
+    for chunk in chunks:
+        buf += chunk
+        while True:
+            i = buf.find(SYNC)
+            if i < 0:
+                # Keep a possible half sync byte for the next chunk
+                keep = 1 if buf.endswith(SYNC[:1]) else 0
+                text += buf[:len(buf) - keep]
+                del buf[:len(buf) - keep]
+                break
+            text += buf[:i]
+            del buf[:i]
+            if len(buf) < FRAME_LEN:
+                break
+
+            body = bytes(buf[2:2 + RECORD.size])
+            check = 0
+            for b in body:
+                check ^= b
+            if check != buf[FRAME_LEN - 1]:
+                # Not a frame after all
+                text += buf[:1]
+                del buf[:1]
+                continue
+            del buf[:FRAME_LEN]
+
+            if text:
+                out.write(text.decode("utf-8", "replace"))
+                text.clear()
+            _seq, ms, ev, boot, *args = RECORD.unpack(body)
+            out.write(format_record(ms, ev, boot, args) + "\n")
+        out.flush()
+
+    if text or buf:
+        out.write((text + buf).decode("utf-8", "replace"))
+
+
+def read_file(f):
+    while True:
+        data = f.read(4096)
+        if not data:
+            return
+        yield data
+
+
+def read_serial(port, baud):
+    try:
+        import serial
+    except ImportError:
+        sys.exit("pyserial is needed for live decoding: pip install pyserial")
+    with serial.Serial(port, baud, timeout=0.1) as s:
+        while True:
+            data = s.read(256)
+            if data:
+                yield data
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("source", help="serial port, capture file or - for stdin")
+    ap.add_argument("-b", "--baud", type=int, default=921600, help="HEBA_SERIAL_BAUD")
+    args = ap.parse_args()
+
+    try:
+        if args.source == "-":
+            decode(read_file(sys.stdin.buffer), sys.stdout)
+        elif os.path.isfile(args.source):
+            with open(args.source, "rb") as f:
+                decode(read_file(f), sys.stdout)
+        else:
+            decode(read_serial(args.source, args.baud), sys.stdout)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,484 @@
+#!/usr/bin/env python3
+"""Compile HEBA missions into the bytecode run by src/HEBA/code/code.c.
+
+Text missions, one op per line (# starts a comment):
+
+    pose 90 90 90 90 90 60     # arm joints 0..5, degrees
+    servo 6 120                # one joint (0..5 arm, 6 wiper), degrees
+    drive 140 140 1800         # left right (-255..255) and hold ms
+    wait 800                   # ms
+    wait_clear 25 5000         # wait until nothing within 25 cm, timeout ms (0 = forever)
+    repeat 3                   # ... up to the matching 'end'
+    end
+    wiper sweep                # 'sweep' or a fixed angle 0..180
+    move 90 45 120 90 90 30 800   # arm keyframe: get there in 800 ms
+    sync 1                     # meet the other tracks here
+    wave wiper sine 90 90 4000 # periodic motion: target shape center amp period_ms [phase_deg]
+    wave turn stop             # ...ends it (and the base stops)
+
+A wave keeps running while the mission goes on, until the same target
+gets a 'wave ... stop', a pose/move/servo/drive/wiper of its own, or the
+mission ends. Targets are a joint 0..6, 'wiper' or 'turn' (the drive base
+turning left/right around a 'center' speed, -255..255); servo center and
+amp are degrees. Shapes: sine, triangle, trapezoid.
+
+A mission can be split into tracks that run at the same time, each with
+its own timing, and only wait for each other at 'sync' points:
+
+    track base
+    drive 140 140 4000         # drive to the table...
+    sync 1
+    track arm
+    move 90 45 120 90 90 30 1500   # ...while the arm gets ready
+    sync 1                     # both there: now grab
+    move 90 60 100 90 90 80 600
+
+Arm ops (pose, move, servo 0..5) go in 'track arm', drive in 'track base',
+wiper and servo 6 in 'track wiper'; wait, wait_clear, repeat and sync go
+anywhere. A sync id is used at most once per track, not inside a repeat,
+and in the same order in every track. Without 'track' lines the mission is
+one track that does everything, as before.
+
+JSON missions are a list of ops with the same names and fields, e.g.
+{"op": "drive", "left": 140, "right": 140, "ms": 1800} or
+{"op": "repeat", "count": 3, "body": [...]}, or for tracks an object
+{"arm": [...], "base": [...], "wiper": [...]}.
+
+Usage:
+    python3 heba_mission.py clean.mission                 # print hex
+    python3 heba_mission.py clean.mission -o clean.bin    # write binary
+    python3 heba_mission.py clean.mission --disasm        # check what you get
+    python3 heba_mission.py deliver.mission --timing      # run time with / without tracks
+    python3 heba_mission.py clean.mission --upload http://192.168.4.1 --mode clean
+"""
+
+import argparse
+import json
+import struct
+import sys
+import urllib.request
+
+VERSION = 1            # one track
+VERSION_TRACKS = 2
+MAX_BYTES = 512
+MAX_DEPTH = 4
+NUM_ARM_SERVOS = 6
+NUM_SERVOS = 7
+WIPER_SWEEP = 255
+
+# Must match enum MissionOp in the firmware: opcode, operand layout, field names
+OPS = {
+    "end":        (0x00, "",    []),
+    "pose":       (0x01, "6B",  ["angles"]),
+    "drive":      (0x02, "hhH", ["left", "right", "ms"]),
+    "wait":       (0x03, "H",   ["ms"]),
+    "wait_clear": (0x04, "BH",  ["cm", "timeout"]),
+    "repeat":     (0x05, "B",   ["count"]),
+    "loop":       (0x06, "",    []),
+    "wiper":      (0x07, "B",   ["angle"]),
+    "servo":      (0x08, "BB",  ["ch", "angle"]),
+    "move":       (0x09, "6BH", ["angles", "ms"]),
+    "sync":       (0x0A, "B",   ["id"]),
+    "wave":       (0x0B, "BBhhHB", ["target", "shape", "center", "amp", "period", "phase"]),
+}
+TRACKS = {"arm": 1, "base": 2, "wiper": 3}   # enum TrackKind
+MAX_TRACKS = 3
+MAX_SYNC_ID = 31
+WAVE_CHASSIS = 0x80
+WAVE_SHAPES = ["sine", "triangle", "trapezoid"]   # enum WaveShape
+BY_CODE = {code: (name, fmt) for name, (code, fmt, _) in OPS.items()}
+
+
+class MissionError(Exception):
+    pass
+
+
+def arg_count(op):
+    fmt = "<" + OPS[op][1]
+    return len(struct.unpack(fmt, bytes(struct.calcsize(fmt))))
+
+
+def check_range(what, v, lo, hi):
+    if not lo <= v <= hi:
+        raise MissionError("%s %d out of range %d..%d" % (what, v, lo, hi))
+    return v
+
+
+def encode(op, args):
+    code, fmt, _ = OPS[op]
+    if op in ("pose", "move"):
+        if len(args) != NUM_ARM_SERVOS + (op == "move"):
+            raise MissionError("%s needs %d angles%s" % (op, NUM_ARM_SERVOS, " and ms" if op == "move" else ""))
+        for a in args[:NUM_ARM_SERVOS]:
+            check_range("angle", a, 0, 180)
+        if op == "move":
+            check_range("ms", args[-1], 1, 65535)
+    elif op == "sync":
+        check_range("sync id", args[0], 0, MAX_SYNC_ID)
+    elif op == "drive":
+        check_range("speed", args[0], -255, 255)
+        check_range("speed", args[1], -255, 255)
+        check_range("ms", args[2], 0, 65535)
+    elif op == "wait":
+        check_range("ms", args[0], 0, 65535)
+    elif op == "wait_clear":
+        check_range("cm", args[0], 1, 255)
+        check_range("timeout", args[1], 0, 65535)
+    elif op == "repeat":
+        check_range("count", args[0], 1, 255)
+    elif op == "wiper":
+        if args[0] != WIPER_SWEEP:
+            check_range("wiper angle", args[0], 0, 180)
+    elif op == "servo":
+        check_range("channel", args[0], 0, NUM_SERVOS - 1)
+        check_range("angle", args[1], 0, 180)
+    elif op == "wave":
+        if args[0] == WAVE_CHASSIS:
+            check_range("center speed", args[2], -255, 255)
+            check_range("amp", args[3], 0, 255)
+        else:
+            check_range("wave joint", args[0], 0, NUM_SERVOS - 1)
+            check_range("center", args[2], 0, 180)
+            check_range("amp", args[3], 0, 180)
+        check_range("shape", args[1], 0, len(WAVE_SHAPES) - 1)
+        check_range("period", args[4], 0, 65535)
+    return bytes([code]) + struct.pack("<" + fmt, *args)
+
+
+def wave_args(target, shape, center=0, amp=0, period=0, phase=0):
+    """'wave' operands from names / numbers; shape 'stop' = period 0."""
+    target = str(target).lower()
+    if target == "turn":
+        target = WAVE_CHASSIS
+    elif target == "wiper":
+        target = NUM_ARM_SERVOS
+    else:
+        target = int(target)
+    shape = str(shape).lower()
+    if shape == "stop":
+        return [target, 0, 0, 0, 0, 0]
+    if shape not in WAVE_SHAPES:
+        raise MissionError("wave shape is one of %s or stop" % ", ".join(WAVE_SHAPES))
+    if int(period) <= 0:
+        raise MissionError("wave period must be > 0 ms ('stop' ends a wave)")
+    return [target, WAVE_SHAPES.index(shape), int(center), int(amp), int(period),
+            int(round(float(phase) * 256 / 360)) % 256]
+
+
+def parse_text(src):
+    """Returns a flat list of (op, args) with repeat/loop pairs, or for a
+    mission with 'track' lines a dict track name -> such a list."""
+    tracks = {}
+    ops = []
+    depth = 0
+    for lineno, line in enumerate(src.splitlines(), 1):
+        words = line.split("#", 1)[0].split()
+        if not words:
+            continue
+        op, rest = words[0].lower(), words[1:]
+        try:
+            if op == "track":
+                name = rest[0].lower() if len(rest) == 1 else None
+                if name not in TRACKS:
+                    raise MissionError("track is one of %s" % ", ".join(TRACKS))
+                if name in tracks:
+                    raise MissionError("track %s given twice" % name)
+                if depth:
+                    raise MissionError("missing 'end' for repeat")
+                if ops and not tracks:
+                    raise MissionError("ops before the first 'track'")
+                ops = tracks[name] = []
+                continue
+            if op == "end":
+                if depth == 0:
+                    raise MissionError("'end' without 'repeat'")
+                depth -= 1
+                ops.append(("loop", []))
+                continue
+            if op == "wiper":
+                arg = rest[0].lower() if len(rest) == 1 else None
+                if arg is None:
+                    raise MissionError("wiper takes 'sweep' or an angle")
+                ops.append(("wiper", [WIPER_SWEEP if arg == "sweep" else int(arg)]))
+                continue
+            if op == "wave":
+                if len(rest) not in (2, 5, 6) or (len(rest) == 2) != (rest[1].lower() == "stop"):
+                    raise MissionError("wave takes target shape center amp period_ms [phase], or target stop")
+                ops.append(("wave", wave_args(*rest)))
+                continue
+            if op == "wait_clear" and len(rest) == 1:
+                rest.append("0")
+            if op not in OPS or op == "loop":
+                raise MissionError("unknown op '%s'" % op)
+            args = [int(w) for w in rest]
+            expected = arg_count(op)
+            if len(args) != expected:
+                raise MissionError("%s takes %d values" % (op, expected))
+            if op == "repeat":
+                depth += 1
+            ops.append((op, args))
+        except (MissionError, ValueError) as e:
+            raise MissionError("line %d: %s" % (lineno, e))
+    if depth:
+        raise MissionError("missing 'end' for repeat")
+    return tracks or ops
+
+
+def parse_json(items):
+    if isinstance(items, dict):
+        return {name: parse_json(track) for name, track in items.items()}
+    ops = []
+    for item in items:
+        op = item.get("op", "").lower()
+        if op == "repeat":
+            ops.append(("repeat", [int(item["count"])]))
+            ops += parse_json(item.get("body", []))
+            ops.append(("loop", []))
+        elif op == "wiper":
+            angle = item.get("angle", "sweep")
+            ops.append(("wiper", [WIPER_SWEEP if angle == "sweep" else int(angle)]))
+        elif op == "wave":
+            ops.append(("wave", wave_args(item["target"], item.get("shape", "sine"), item.get("center", 0),
+                                          item.get("amp", 0), item.get("period", 0), item.get("phase", 0))))
+        elif op == "wait_clear":
+            ops.append(("wait_clear", [int(item["cm"]), int(item.get("timeout", 0))]))
+        elif op in ("pose", "move"):
+            ops.append((op, [int(a) for a in item["angles"]] + ([int(item["ms"])] if op == "move" else [])))
+        elif op in OPS and op not in ("end", "loop"):
+            ops.append((op, [int(item[n]) for n in OPS[op][2]]))
+        else:
+            raise MissionError("unknown op %r" % item)
+    return ops
+
+
+def op_track(op, args):
+    """Track an op belongs to, None = any (matches missionOpTrack())."""
+    if op in ("pose", "move"):
+        return "arm"
+    if op == "drive":
+        return "base"
+    if op == "wiper":
+        return "wiper"
+    if op in ("servo", "wave"):
+        if op == "wave" and args[0] == WAVE_CHASSIS:
+            return "base"
+        return "arm" if args[0] < NUM_ARM_SERVOS else "wiper"
+    return None
+
+
+def compile_track(ops, track=None):
+    out = bytearray()
+    depth = 0
+    syncs = []
+    for op, args in ops:
+        owner = op_track(op, args)
+        if track and owner and owner != track:
+            raise MissionError("%s belongs in track %s, not %s" % (op, owner, track))
+        if op == "repeat":
+            depth += 1
+            if depth > MAX_DEPTH:
+                raise MissionError("repeat nested deeper than %d" % MAX_DEPTH)
+        elif op == "loop":
+            depth -= 1
+        elif op == "sync":
+            if depth:
+                raise MissionError("sync %d inside a repeat" % args[0])
+            if args[0] in syncs:
+                raise MissionError("sync %d used twice%s" % (args[0], " in track " + track if track else ""))
+            syncs.append(args[0])
+        out += encode(op, args)
+    out += encode("end", [])
+    return bytes(out), syncs
+
+
+def check_sync_order(syncs):
+    """Tracks meeting at the same ids in a different order would wait for each other forever.
+
+    Every track's consecutive syncs give 'a before b'; those have to fit one
+    common order (no cycle), the same rule as syncOrderOk() in the firmware.
+    """
+    after = {}
+    for ids in syncs.values():
+        for a, b in zip(ids, ids[1:]):
+            after.setdefault(a, set()).add(b)
+
+    def cycle(node, path):
+        if node in path:
+            return path[path.index(node):] + [node]
+        for nxt in sorted(after.get(node, ())):
+            found = cycle(nxt, path + [node])
+            if found:
+                return found
+        return None
+
+    for start in sorted(after):
+        found = cycle(start, [])
+        if found:
+            raise MissionError("tracks sync in a different order, they would wait forever (%s)" % (
+                " -> ".join(map(str, found))))
+
+
+def compile_mission(ops):
+    if isinstance(ops, dict):
+        if not 0 < len(ops) <= MAX_TRACKS:
+            raise MissionError("1..%d tracks" % MAX_TRACKS)
+        bodies, syncs = [], {}
+        for name, track_ops in ops.items():
+            if name not in TRACKS:
+                raise MissionError("unknown track '%s'" % name)
+            body, syncs[name] = compile_track(track_ops, name)
+            bodies.append((name, body))
+        check_sync_order(syncs)
+        out = bytearray([VERSION_TRACKS, len(bodies)])
+        start = 2 + 3 * len(bodies)
+        for name, body in bodies:
+            out += struct.pack("<BH", TRACKS[name], start)
+            start += len(body)
+        for _, body in bodies:
+            out += body
+    else:
+        body, _ = compile_track(ops)
+        out = bytearray([VERSION]) + body
+    if len(out) > MAX_BYTES:
+        raise MissionError("mission is %d bytes, the robot holds %d" % (len(out), MAX_BYTES))
+    return bytes(out)
+
+
+def decode_track(code, pc):
+    """Yields (pc, name, args) up to and including the track's 'end'."""
+    while pc < len(code):
+        name, fmt = BY_CODE[code[pc]]
+        size = struct.calcsize("<" + fmt)
+        args = struct.unpack("<" + fmt, code[pc + 1:pc + 1 + size])
+        yield pc, name, args
+        if name == "end":
+            return
+        pc += 1 + size
+
+
+def track_table(code):
+    """[(track name, start pc)]"""
+    if code[0] == VERSION:
+        return [("all", 1)]
+    names = {v: k for k, v in TRACKS.items()}
+    return [(names.get(code[2 + 3 * t], "?"), struct.unpack_from("<H", code, 3 + 3 * t)[0])
+            for t in range(code[1])]
+
+
+def disassemble(code):
+    lines = ["; version %d, %d bytes" % (code[0], len(code))]
+    for track, start in track_table(code):
+        if code[0] != VERSION:
+            lines.append("track %s" % track)
+        depth = 0
+        for pc, name, args in decode_track(code, start):
+            if name == "loop":
+                depth -= 1
+            shown = "sweep" if name == "wiper" and args[0] == WIPER_SWEEP else " ".join(map(str, args))
+            if name == "wave":
+                target = "turn" if args[0] == WAVE_CHASSIS else str(args[0])
+                shown = "%s stop" % target if args[4] == 0 else "%s %s %d %d %d %d" % (
+                    target, WAVE_SHAPES[args[1]], args[2], args[3], args[4], round(args[5] * 360 / 256))
+            lines.append(("%04x  %s%s %s" % (pc, "  " * depth, name, shown)).rstrip())
+            if name == "repeat":
+                depth += 1
+    return "\n".join(lines)
+
+
+def track_steps(code, start):
+    """A track unrolled into ('t', ms) and ('sync', id) steps. Timing only
+    counts what the mission says (drive/move/wait ms); servo travel after a
+    pose, wait_clear and starting a wave are taken as 0."""
+    ops = list(decode_track(code, start))
+    steps = []
+
+    def run(i, stop):
+        while i < stop:
+            _, name, args = ops[i]
+            if name == "repeat":
+                depth, j = 1, i + 1
+                while depth:
+                    depth += {"repeat": 1, "loop": -1}.get(ops[j][1], 0)
+                    j += 1
+                for _ in range(args[0]):
+                    run(i + 1, j - 1)
+                i = j
+                continue
+            if name in ("drive", "move", "wait"):
+                steps.append(("t", args[-1]))
+            elif name == "sync":
+                steps.append(("sync", args[0]))
+            i += 1
+
+    run(0, len(ops))
+    return steps
+
+
+def timing(code):
+    """(ms run one after another, ms with the tracks side by side)"""
+    tracks = [track_steps(code, start) for _, start in track_table(code)]
+    serial = sum(v for steps in tracks for kind, v in steps if kind == "t")
+
+    clock = [0] * len(tracks)
+    pos = [0] * len(tracks)
+    while True:
+        # run every track up to its next sync
+        for t, steps in enumerate(tracks):
+            while pos[t] < len(steps) and steps[pos[t]][0] == "t":
+                clock[t] += steps[pos[t]][1]
+                pos[t] += 1
+        waiting = [t for t, steps in enumerate(tracks) if pos[t] < len(steps)]
+        if not waiting:
+            return serial, max(clock)
+        sid = tracks[waiting[0]][pos[waiting[0]]][1]
+        members = [t for t in waiting if tracks[t][pos[t]][1] == sid]
+        meet = max(clock[t] for t in members)
+        for t in members:
+            clock[t] = meet
+            pos[t] += 1
+
+
+def upload(code, base_url, mode):
+    url = "%s/mission?mode=%s" % (base_url.rstrip("/"), mode)
+    req = urllib.request.Request(url, data=code.hex().encode(), method="POST",
+                                 headers={"Content-Type": "text/plain"})
+    with urllib.request.urlopen(req, timeout=10) as r:
+        return r.read().decode()
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("mission", help=".json or text mission file, - for stdin")
+    ap.add_argument("-o", "--output", help="write the binary here instead of printing hex")
+    ap.add_argument("--disasm", action="store_true", help="print a listing")
+    ap.add_argument("--timing", action="store_true", help="run time of the tracks one after another / together")
+    ap.add_argument("--upload", metavar="URL", help="robot base URL, e.g. http://192.168.4.1")
+    ap.add_argument("--mode", choices=["clean", "water", "med", "garbage"], default="clean")
+    args = ap.parse_args()
+
+    src = sys.stdin.read() if args.mission == "-" else open(args.mission).read()
+    try:
+        if args.mission.endswith(".json"):
+            code = compile_mission(parse_json(json.loads(src)))
+        else:
+            code = compile_mission(parse_text(src))
+    except MissionError as e:
+        sys.exit("%s: %s" % (args.mission, e))
+
+    if args.disasm:
+        print(disassemble(code))
+    if args.timing:
+        serial, together = timing(code)
+        print("%.1f s one after another, %.1f s with tracks (%.0f%% shorter)" % (
+            serial / 1000.0, together / 1000.0, 100.0 * (serial - together) / serial if serial else 0))
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(code)
+    if args.upload:
+        print(upload(code, args.upload, args.mode))
+    if not (args.disasm or args.timing or args.output or args.upload):
+        print(code.hex())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,358 @@
+#!/usr/bin/env python3
+"""Record and read a HEBA sampling profile: where does loop() spend its time?
+
+The firmware's /prof endpoint (HTTP boards) samples the loop() core with a
+timer interrupt: each tick records the PC the core was at and up to
+--depth callers, or just counts the tick when the core was idle. This tool
+starts a run, downloads the samples and matches them against the firmware
+ELF (the one the running build came from, e.g. from arduino-cli compile
+--export-binaries or the Arduino IDE's build folder):
+
+    python3 heba_profile.py record http://192.168.4.1 -t 20 -o idle.bin
+    python3 heba_profile.py report idle.bin --elf code.ino.elf
+    python3 heba_profile.py record http://192.168.4.1 -t 20 --elf code.ino.elf --svg load.svg
+
+The report has a flat profile (self = at the top of the stack, total = on
+the stack at all, in % of every tick, idle included), the loop() budget
+(each function loop() calls with what it and its callees cost), and on
+request the folded stacks (flamegraph.pl / speedscope input) and an SVG
+flame graph. Run heba_load.py alongside to profile the loop under traffic.
+
+Ticks in a critical section or flash write are taken when it ends, and
+stacks deeper than --depth are cut off at the bottom: "loop" missing from
+a stack usually means that.
+"""
+
+import argparse
+import bisect
+import hashlib
+import html
+import shutil
+import struct
+import subprocess
+import sys
+import time
+import urllib.error
+import urllib.request
+import zlib
+
+# Must match struct ProfHeader in the firmware.
+HEADER = struct.Struct("<IBBBBHHIIIII8s")
+MAGIC = 0x46525048
+VERSION = 1
+BOARDS = {1: "classic", 2: "robot", 3: "arm"}
+TASKS = ["loopTask", "other task"]
+IDLE = "[idle]"
+
+
+# ---------- Reading the dump ----------
+
+class Profile:
+    def __init__(self, data):
+        if len(data) < HEADER.size:
+            raise ValueError("too short for a profile")
+        (magic, version, self.board, self.depth, _, self.hz, _, self.ms, self.samples, self.idle, self.lost,
+         words, self.elf_sha) = HEADER.unpack_from(data)
+        if magic != MAGIC:
+            raise ValueError("not a HEBA profile")
+        if version != VERSION:
+            raise ValueError("profile version %d, this tool reads %d" % (version, VERSION))
+        raw = struct.unpack_from("<%dI" % words, data, HEADER.size)
+
+        self.stacks = []                  # (task, [pc leaf first])
+        i = 0
+        while i < len(raw):
+            n = raw[i] & 0xff
+            task = (raw[i] >> 8) & 0xff
+            if n == 0 or n > self.depth or i + 1 + n > len(raw):
+                raise ValueError("bad sample at word %d" % i)
+            self.stacks.append((task, list(raw[i + 1:i + 1 + n])))
+            i += 1 + n
+
+    def ticks(self):
+        return self.samples + self.idle
+
+
+def caller_pc(pc):
+    """Return address -> address of the call instruction.
+
+    A windowed call keeps the window increment in the top two bits of the
+    return address (see esp_cpu_process_stack_pc); call instructions are 3
+    bytes, so step back into the call to land on the caller's line.
+    """
+    if pc & 0x80000000:
+        pc = (pc & 0x3fffffff) | 0x40000000
+    return pc - 3
+
+
+# ---------- Symbols ----------
+
+class Symbols:
+    def __init__(self, path, demangle=True):
+        with open(path, "rb") as f:
+            data = f.read()
+        self.sha256 = hashlib.sha256(data).digest()
+        funcs = self._functions(data)
+        if demangle:
+            funcs = self._demangle(funcs)
+        funcs.sort()
+        self.addrs = [a for a, _, _ in funcs]
+        self.funcs = funcs
+        self.cache = {}
+
+    @staticmethod
+    def _functions(data):
+        if data[:4] != b"\x7fELF" or data[4] != 1 or data[5] != 1:
+            raise ValueError("not a 32-bit little-endian ELF")
+        shoff, = struct.unpack_from("<I", data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", data, 0x2e)
+        sections = [struct.unpack_from("<IIIIIIIIII", data, shoff + i * shentsize) for i in range(shnum)]
+        funcs = {}
+        for sh in sections:
+            if sh[1] != 2:                # SHT_SYMTAB
+                continue
+            strtab = sections[sh[6]]
+            for off in range(sh[4], sh[4] + sh[5], sh[9] or 16):
+                name, value, size, info, _, shndx = struct.unpack_from("<IIIBBH", data, off)
+                if info & 0xf != 2 or value == 0 or shndx == 0:   # STT_FUNC, defined
+                    continue
+                start = strtab[4] + name
+                end = data.index(b"\0", start)
+                funcs.setdefault(value, (value, size, data[start:end].decode("ascii", "replace")))
+        if not funcs:
+            raise ValueError("no symbol table (stripped ELF?)")
+        return list(funcs.values())
+
+    @staticmethod
+    def _demangle(funcs):
+        tool = shutil.which("xtensa-esp32-elf-c++filt") or shutil.which("c++filt")
+        if not tool:
+            return funcs
+        try:
+            out = subprocess.run([tool], input="\n".join(n for _, _, n in funcs), capture_output=True,
+                                 text=True, check=True).stdout.split("\n")
+        except (OSError, subprocess.CalledProcessError):
+            return funcs
+        if len(out) < len(funcs):
+            return funcs
+        return [(a, s, out[i]) for i, (a, s, _) in enumerate(funcs)]
+
+    def name(self, pc):
+        if pc not in self.cache:
+            i = bisect.bisect_right(self.addrs, pc) - 1
+            name = None
+            if i >= 0:
+                addr, size, fn = self.funcs[i]
+                next_addr = self.addrs[i + 1] if i + 1 < len(self.addrs) else addr + max(size, 1)
+                if pc < (addr + size if size else next_addr):
+                    name = fn
+            if name is None:
+                name = ("[rom 0x%08x]" if 0x40000000 <= pc < 0x40070000 else "[0x%08x]") % pc
+            self.cache[pc] = name
+        return self.cache[pc]
+
+
+class Raw:
+    """No ELF: addresses only."""
+    def name(self, pc):
+        return "0x%08x" % pc
+
+
+def symbolize(prof, syms):
+    """Stacks as function names, root first."""
+    out = []
+    for task, pcs in prof.stacks:
+        names = [syms.name(pcs[0])] + [syms.name(caller_pc(pc)) for pc in pcs[1:]]
+        out.append((task, names[::-1]))
+    return out
+
+
+# ---------- Reports ----------
+
+def folded(prof, stacks):
+    counts = {}
+    for task, names in stacks:
+        key = ";".join([TASKS[task] if task < len(TASKS) else "task %d" % task] + names)
+        counts[key] = counts.get(key, 0) + 1
+    if prof.idle:
+        counts[IDLE] = prof.idle
+    return counts
+
+
+def flat(prof, stacks, top, out):
+    ticks = prof.ticks() or 1
+    self_n, total_n = {}, {}
+    for _task, names in stacks:
+        self_n[names[-1]] = self_n.get(names[-1], 0) + 1
+        for fn in set(names):
+            total_n[fn] = total_n.get(fn, 0) + 1
+    out.write("%7s %6s %7s %6s  %s\n" % ("self", "%", "total", "%", "function"))
+    out.write("%7d %5.1f%% %7d %5.1f%%  %s\n" % (prof.idle, 100.0 * prof.idle / ticks, prof.idle,
+                                                 100.0 * prof.idle / ticks, IDLE))
+    for fn, n in sorted(self_n.items(), key=lambda kv: (-kv[1], kv[0]))[:top]:
+        out.write("%7d %5.1f%% %7d %5.1f%%  %s\n" % (n, 100.0 * n / ticks, total_n[fn], 100.0 * total_n[fn] / ticks,
+                                                     fn))
+
+
+def budget(prof, stacks, out):
+    """What each function loop() calls costs, callees included."""
+    ticks = prof.ticks() or 1
+    per, in_loop, cut = {}, 0, 0
+    for task, names in stacks:
+        if task != 0:
+            continue
+        if "loop" not in names:
+            cut += 1
+            continue
+        in_loop += 1
+        i = names.index("loop")
+        callee = names[i + 1] if i + 1 < len(names) else "loop (itself)"
+        per[callee] = per.get(callee, 0) + 1
+    out.write("\nloop() budget: %.1f%% of the core in loop(), %.1f%% idle, %.1f%% other tasks and interrupts\n" % (
+        100.0 * in_loop / ticks, 100.0 * prof.idle / ticks,
+        100.0 * sum(1 for t, _ in stacks if t != 0) / ticks))
+    if cut:
+        out.write("  (%d loopTask samples without loop() on the stack: deeper than --depth, or outside it)\n" % cut)
+    for fn, n in sorted(per.items(), key=lambda kv: -kv[1]):
+        out.write("  %5.1f%%  %7.0f us/s  %s\n" % (100.0 * n / ticks, 1e6 * n / ticks, fn))
+
+
+def svg(counts, path, title):
+    """A minimal flame graph: root at the bottom, width = share of ticks."""
+    root = {"n": 0, "kids": {}}
+    for stack, n in counts.items():
+        node = root
+        node["n"] += n
+        for fn in stack.split(";"):
+            node = node["kids"].setdefault(fn, {"n": 0, "kids": {}})
+            node["n"] += n
+
+    def depth(node):
+        return 1 + max((depth(k) for k in node["kids"].values()), default=0)
+
+    width, row = 1200.0, 17
+    levels = depth(root) - 1
+    height = (levels + 2) * row + 10
+    total = root["n"] or 1
+    parts = ['<svg xmlns="http://www.w3.org/2000/svg" width="%d" height="%d" font-family="monospace" '
+             'font-size="11">' % (width, height),
+             '<text x="4" y="13">%s</text>' % html.escape(title)]
+
+    def draw(node, name, x, level):
+        w = width * node["n"] / total
+        if w < 0.5:
+            return
+        y = height - (level + 1) * row
+        hue = 0 if name == IDLE else zlib.crc32(name.encode()) % 40 + 10
+        label = "%s (%d, %.1f%%)" % (name, node["n"], 100.0 * node["n"] / total)
+        parts.append('<g><title>%s</title><rect x="%.1f" y="%d" width="%.1f" height="%d" fill="hsl(%d,85%%,%d%%)" '
+                     'stroke="white" stroke-width="0.5"/>' % (html.escape(label), x, y, w, row - 1, hue,
+                                                            75 if name == IDLE else 60))
+        if w > 40:
+            parts.append('<text x="%.1f" y="%d">%s</text>' % (x + 3, y + row - 5,
+                                                              html.escape(name[:int(w / 7)])))
+        parts.append("</g>")
+        for kid_name, kid in sorted(node["kids"].items()):
+            draw(kid, kid_name, x, level + 1)
+            x += width * kid["n"] / total
+
+    x = 0.0
+    for name, node in sorted(root["kids"].items()):
+        draw(node, name, x, 0)
+        x += width * node["n"] / total
+    parts.append("</svg>")
+    with open(path, "w") as f:
+        f.write("\n".join(parts) + "\n")
+
+
+def report(prof, args, out):
+    syms = Raw()
+    if args.elf:
+        syms = Symbols(args.elf, not args.no_demangle)
+        if any(prof.elf_sha) and syms.sha256[:8] != prof.elf_sha:
+            out.write("warning: %s is not the ELF of the running build (sha256 %s, robot has %s...)\n" % (
+                args.elf, syms.sha256[:8].hex(), prof.elf_sha.hex()))
+    stacks = symbolize(prof, syms)
+    ticks = prof.ticks()
+    out.write("%s board, %.1f s at %d Hz, depth %d: %d ticks, %d samples, %d idle%s\n\n" % (
+        BOARDS.get(prof.board, "board %d" % prof.board), prof.ms / 1000.0, prof.hz, prof.depth, ticks, prof.samples,
+        prof.idle, ", %d LOST (buffer full, use a lower --hz or --depth)" % prof.lost if prof.lost else ""))
+    flat(prof, stacks, args.top, out)
+    budget(prof, stacks, out)
+
+    counts = folded(prof, stacks)
+    if args.folded:
+        with open(args.folded, "w") as f:
+            for stack, n in sorted(counts.items()):
+                f.write("%s %d\n" % (stack, n))
+    if args.svg:
+        svg(counts, args.svg, "HEBA %s, %.1f s at %d Hz, %d ticks" % (
+            BOARDS.get(prof.board, "?"), prof.ms / 1000.0, prof.hz, ticks))
+
+
+# ---------- Recording ----------
+
+def get(base, path, timeout=10):
+    with urllib.request.urlopen(base + path, timeout=timeout) as resp:
+        return resp.read()
+
+
+def record(args):
+    base = args.url.rstrip("/")
+    try:
+        print(get(base, "/prof?start=1&hz=%d&depth=%d" % (args.hz, args.depth)).decode())
+        try:
+            time.sleep(args.seconds)
+        except KeyboardInterrupt:
+            pass
+        data = get(base, "/prof", timeout=30)
+        if args.free:
+            get(base, "/prof?free=1")
+    except urllib.error.HTTPError as e:
+        sys.exit("error: %s %s" % (e.code, e.read().decode("ascii", "replace")))
+    except OSError as e:
+        sys.exit("error: %s" % e)
+    with open(args.output, "wb") as f:
+        f.write(data)
+    print("%d bytes to %s" % (len(data), args.output))
+    return data
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+
+    rec = sub.add_parser("record", help="profile the robot, then report if --elf is given")
+    rec.add_argument("url", help="robot base URL")
+    rec.add_argument("-t", "--seconds", type=float, default=10.0)
+    rec.add_argument("--hz", type=int, default=1000, help="samples per second (max 5000)")
+    rec.add_argument("--depth", type=int, default=8, help="frames per sample (max 16)")
+    rec.add_argument("-o", "--output", default="prof.bin")
+    rec.add_argument("--free", action="store_true", help="give the sample buffer back afterwards")
+
+    rep = sub.add_parser("report", help="symbolize a recorded profile")
+    rep.add_argument("profile")
+
+    for p in (rec, rep):
+        p.add_argument("--elf", help="firmware ELF of the running build")
+        p.add_argument("--top", type=int, default=30, help="flat profile rows")
+        p.add_argument("--folded", help="write folded stacks here")
+        p.add_argument("--svg", help="write a flame graph here")
+        p.add_argument("--no-demangle", action="store_true")
+    args = ap.parse_args()
+
+    if args.cmd == "record":
+        data = record(args)
+        if not args.elf and not args.folded and not args.svg:
+            return
+    else:
+        with open(args.profile, "rb") as f:
+            data = f.read()
+    try:
+        report(Profile(data), args, sys.stdout)
+    except ValueError as e:
+        sys.exit("error: %s" % e)
+
+
+if __name__ == "__main__":
+    main()
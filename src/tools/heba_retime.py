@@ -0,0 +1,278 @@
+#!/usr/bin/env python3
+"""Retime taught HEBA sequences to the shortest feasible step durations.
+
+Teaching gives every frame a fixed duration (TEACH_STEP / capture use the
+board's kTeachStepMs, /save defaults to it too), so playback mostly waits
+for servos that arrived long ago. This tool works out how long each frame
+really needs and rewrites the durations:
+
+  * every joint follows a trapezoidal velocity profile limited by its
+    --vmax (deg/s) and --amax (deg/s^2);
+  * joints are started the way the firmware's motion scheduler does it,
+    heaviest first, within the servo current budget (--budget mA), so a
+    frame that moves many big joints can take longer than its slowest
+    joint alone. The budget counts every joint of the --board, the wiper
+    too: it holds its position during playback, and on the robot board it
+    sweeps (full moving current) while the cleaning sequence plays;
+  * --settle ms is added for the servo to stop hunting, and no frame gets
+    shorter than --min-ms (keeps deliberate gripper pauses sensible);
+  * frames that drive the wheels keep their time: the drive distance is
+    open-loop and depends on it.
+
+Frame 0 is reached by the firmware's own start transition, so it only
+needs --min-ms.
+
+Sequences come from the robot's /seq endpoint (hex of the 18-byte Pose
+frames) or from files written by this tool:
+
+    python3 heba_retime.py http://192.168.4.1 -o retimed/     # all modes
+    python3 heba_retime.py http://192.168.4.1 --upload        # write back
+    python3 heba_retime.py saved/*.json -j 8 -o retimed/ --board classic
+
+Files can be .json ({"mode": ..., "frames": [{"servo": [...], "left": 0,
+"right": 0, "ms": 1000}, ...]}, servo in degrees with 0.1 resolution) or
+.hex (the raw /seq response). Many sequences are retimed in parallel, one
+per worker process. Output files are named after the mode; when two
+sequences share a mode (several robots, or files from different
+directories) the robot's host or the file's directory is prefixed.
+"""
+
+import argparse
+import concurrent.futures
+import json
+import math
+import os
+import struct
+import sys
+import urllib.parse
+import urllib.request
+
+NUM_ARM_SERVOS = 6
+POSE = struct.Struct("<6hhhH")   # must match struct Pose in the firmware
+POSE_V1 = struct.Struct("<6BhhH")  # whole degrees, before the 0.1 degree Pose
+POS_SCALE = 10
+MODES = ["water", "med", "garbage", "clean"]
+
+# Arm defaults: 3x MG99x then 3x SG90 on every board (see Servos in code.c).
+# vmax is derated from the no-load figure for a loaded arm.
+DEFAULT_VMAX = [200, 200, 200, 400, 400, 400]
+DEFAULT_AMAX = [800, 800, 800, 2000, 2000, 2000]
+
+# Every joint of each board's layout (NUM_SERVOS): moving / holding mA, and
+# whether the wiper (joint 6, an SG90) sweeps while cleaning (kWiperSweeps)
+ARM_MOVE_MA = [1400, 1400, 1400, 650, 650, 650]
+ARM_HOLD_MA = [150, 150, 150, 60, 60, 60]
+BOARDS = {
+    "classic": (ARM_MOVE_MA + [650], ARM_HOLD_MA + [60], False),
+    "robot":   (ARM_MOVE_MA + [650], ARM_HOLD_MA + [60], True),
+    "arm":     (ARM_MOVE_MA, ARM_HOLD_MA, False),
+}
+SWEEP_MODE = "clean"
+
+
+class Limits:
+    def __init__(self, vmax, amax, move_ma, hold_ma, budget, settle, min_ms, sweeps=False):
+        self.vmax = vmax
+        self.amax = amax
+        self.move_ma = move_ma            # all joints, arm first
+        self.hold_ma = hold_ma
+        self.budget = budget
+        self.settle = settle
+        self.min_ms = min_ms
+        self.sweeps = sweeps              # wiper sweeps during the cleaning sequence
+
+
+def move_time(d, vmax, amax):
+    """Seconds to move d degrees from rest to rest."""
+    d = abs(d)
+    if d == 0:
+        return 0.0
+    if d >= vmax * vmax / amax:          # reaches vmax: accel, cruise, decel
+        return d / vmax + vmax / amax
+    return 2.0 * math.sqrt(d / amax)     # triangle profile
+
+
+def frame_time(prev, cur, lim, sweeping=False):
+    """Milliseconds until every joint of 'cur' has arrived, starting from 'prev'.
+
+    Mirrors updateMotionScheduler(): pending joints start heaviest first as
+    long as the estimated current of all joints stays inside the budget; one
+    joint always starts when nothing is moving. Joints beyond the arm (the
+    wiper) are not in the frames: they hold, or keep moving while 'sweeping'.
+    """
+    n = len(lim.move_ma)
+    busy = [j for j in range(len(cur), n)] if sweeping else []
+    dur = [move_time(cur[j] - prev[j], lim.vmax[j], lim.amax[j]) * 1000.0 if j < len(cur) else 0.0
+           for j in range(n)]
+    pending = sorted((j for j in range(n) if dur[j] > 0), key=lambda j: -lim.move_ma[j])
+    ends = {}                            # joint -> end of its move (ms)
+    now = 0.0
+
+    while pending:
+        moving = [j for j, e in ends.items() if e > now]
+        used = sum(lim.move_ma[j] if j in moving or j in busy else lim.hold_ma[j] for j in range(n))
+        started = False
+        for j in list(pending):
+            extra = lim.move_ma[j] - lim.hold_ma[j]
+            if used + extra > lim.budget and moving:
+                break                     # the firmware stops at the first one that doesn't fit
+            ends[j] = now + dur[j]
+            moving.append(j)
+            used += extra
+            pending.remove(j)
+            started = True
+        if not started or pending:
+            # wait for the next joint to arrive
+            later = [e for e in ends.values() if e > now]
+            if not later:
+                break
+            now = min(later)
+
+    done = max(ends.values()) if ends else 0.0
+    return done
+
+
+def retime(name, frames, lim, mode=None):
+    """Returns (name, new frames, old total ms, new total ms)."""
+    sweeping = lim.sweeps and mode == SWEEP_MODE
+    out = []
+    prev = None
+    for f in frames:
+        f = dict(f)
+        if f["left"] or f["right"]:
+            pass                          # driving: keep the taught time
+        elif prev is None:
+            f["ms"] = lim.min_ms
+        else:
+            need = frame_time(prev["servo"], f["servo"], lim, sweeping) + lim.settle
+            f["ms"] = int(math.ceil(max(need, lim.min_ms)))
+        out.append(f)
+        prev = f
+    return name, out, sum(f["ms"] for f in frames), sum(f["ms"] for f in out)
+
+
+# ---------- formats ----------
+def frames_from_bytes(data, pose=POSE):
+    if len(data) % pose.size:
+        raise ValueError("%d bytes is not a whole number of frames" % len(data))
+    scale = POS_SCALE if pose is POSE else 1
+    frames = []
+    for i in range(0, len(data), pose.size):
+        v = pose.unpack_from(data, i)
+        frames.append({"servo": [a / scale for a in v[:NUM_ARM_SERVOS]], "left": v[6], "right": v[7], "ms": v[8]})
+    return frames
+
+
+def frames_to_bytes(frames):
+    return b"".join(POSE.pack(*([int(round(a * POS_SCALE)) for a in f["servo"]] + [f["left"], f["right"], f["ms"]]))
+                    for f in frames)
+
+
+def load_file(path):
+    name = os.path.splitext(os.path.basename(path))[0]
+    with open(path) as f:
+        if path.endswith(".json"):
+            doc = json.load(f)
+            return doc.get("mode", name), doc["frames"]
+        return name, frames_from_bytes(bytes.fromhex(f.read().strip()))
+
+
+def fetch(base_url, mode):
+    url = "%s/seq?mode=%s" % (base_url.rstrip("/"), mode)
+    with urllib.request.urlopen(url, timeout=10) as r:
+        return frames_from_bytes(bytes.fromhex(r.read().decode().strip()))
+
+
+def upload(base_url, mode, frames):
+    url = "%s/seq?mode=%s" % (base_url.rstrip("/"), mode)
+    req = urllib.request.Request(url, data=frames_to_bytes(frames).hex().encode(), method="POST",
+                                 headers={"Content-Type": "text/plain"})
+    with urllib.request.urlopen(req, timeout=10) as r:
+        return r.read().decode()
+
+
+def output_names(jobs):
+    """File name (no extension) per job: the mode, qualified when two collide."""
+    modes = [mode for _, _, _, mode, _ in jobs]
+    names = list(modes)
+    for i, (_, _, url, mode, src) in enumerate(jobs):
+        if modes.count(mode) > 1:
+            where = urllib.parse.urlsplit(url).hostname if url else os.path.basename(os.path.dirname(
+                os.path.abspath(src)))
+            names[i] = "%s_%s" % (where, mode)
+    qualified = list(names)
+    seen = {}
+    for i, n in enumerate(qualified):
+        seen[n] = seen.get(n, 0) + 1
+        if qualified.count(n) > 1:
+            names[i] = "%s_%d" % (n, seen[n])
+    return names
+
+
+def per_joint(values, what):
+    v = [float(x) for x in values.split(",")]
+    if len(v) == 1:
+        v *= NUM_ARM_SERVOS
+    if len(v) != NUM_ARM_SERVOS or min(v) <= 0:
+        sys.exit("--%s needs 1 or %d positive values" % (what, NUM_ARM_SERVOS))
+    return v
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("sources", nargs="+", help="robot URL (all modes), .json or .hex files")
+    ap.add_argument("--modes", default=",".join(MODES), help="modes to fetch from a robot URL")
+    ap.add_argument("--board", choices=sorted(BOARDS), default="robot", help="joint layout for the current budget")
+    ap.add_argument("--vmax", default=",".join(map(str, DEFAULT_VMAX)), help="deg/s, 1 or 6 values")
+    ap.add_argument("--amax", default=",".join(map(str, DEFAULT_AMAX)), help="deg/s^2, 1 or 6 values")
+    ap.add_argument("--budget", type=int, default=2500, help="servo current budget, mA")
+    ap.add_argument("--settle", type=int, default=80, help="ms added after the last joint arrives")
+    ap.add_argument("--min-ms", type=int, default=150, help="shortest frame, ms")
+    ap.add_argument("-j", "--jobs", type=int, default=os.cpu_count(), help="worker processes")
+    ap.add_argument("-o", "--output", help="directory for retimed .json files")
+    ap.add_argument("--upload", action="store_true", help="write retimed sequences back to the robot")
+    args = ap.parse_args()
+
+    move_ma, hold_ma, sweeps = BOARDS[args.board]
+    lim = Limits(per_joint(args.vmax, "vmax"), per_joint(args.amax, "amax"),
+                 move_ma, hold_ma, args.budget, args.settle, args.min_ms, sweeps)
+
+    jobs = []                             # (name, frames, robot url or None, mode, source)
+    for src in args.sources:
+        if src.startswith("http://") or src.startswith("https://"):
+            for mode in args.modes.split(","):
+                frames = fetch(src, mode)
+                if frames:
+                    jobs.append(("%s/%s" % (src.rstrip("/"), mode), frames, src, mode, src))
+        else:
+            name, frames = load_file(src)
+            jobs.append((name, frames, None, name, src))
+    if not jobs:
+        sys.exit("nothing to retime")
+
+    with concurrent.futures.ProcessPoolExecutor(max_workers=args.jobs) as pool:
+        results = list(pool.map(retime, [j[0] for j in jobs], [j[1] for j in jobs],
+                                [lim] * len(jobs), [j[3] for j in jobs]))
+
+    total_old = total_new = 0
+    print("%-32s %6s %9s %9s %7s" % ("sequence", "frames", "before s", "after s", "saved"))
+    for (name, frames, old, new), (_, _, url, mode, _), out_name in zip(results, jobs, output_names(jobs)):
+        total_old += old
+        total_new += new
+        saved = 100.0 * (old - new) / old if old else 0.0
+        print("%-32s %6d %9.2f %9.2f %6.1f%%" % (name[-32:], len(frames), old / 1000.0, new / 1000.0, saved))
+
+        if args.output:
+            os.makedirs(args.output, exist_ok=True)
+            with open(os.path.join(args.output, out_name + ".json"), "w") as f:
+                json.dump({"mode": mode, "frames": frames}, f, indent=1)
+        if args.upload and url:
+            print("  " + upload(url, mode, frames))
+
+    if len(results) > 1 and total_old:
+        print("%-32s %6s %9.2f %9.2f %6.1f%%" % ("total", "", total_old / 1000.0, total_new / 1000.0,
+                                                100.0 * (total_old - total_new) / total_old))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Feed simulated ultrasonic readings to a running HEBA robot.
+
+The firmware's /sonar?cm=a,b,... replaces the echo of each sensor (in
+firing order) with the given value, so obstacle stops, resume and
+wait_clear can be tested on the bench without moving anything in front of
+the sensors. Readings still go through the robot's median filter and
+round-robin schedule. The sensors are switched back to real echoes
+(/sonar?sim=0) when the tool exits.
+
+One model per sensor, in firing order (front, rear, left, right):
+
+    static:CM                 constant distance
+    approach:CM:SPEED[:MIN]   starts at CM, moves SPEED cm/s (negative = closer)
+    pass:CM:AT:FOR            object at CM from AT s for FOR s, free otherwise
+    module.py:func            your own model, func(t, sensor) -> cm
+
+Noise and faults are added on top: --noise (gaussian sigma, cm),
+--dropout (probability of a missed echo) and --ghost (probability of a
+short crosstalk reading).
+
+    python3 heba_sonar_sim.py http://192.168.4.1 approach:150:-30:10
+    python3 heba_sonar_sim.py http://192.168.4.1 static:400 pass:15:3:2 --noise 2
+"""
+
+import argparse
+import importlib.util
+import json
+import random
+import sys
+import time
+import urllib.request
+
+NO_ECHO_CM = 400
+
+
+def make_model(spec):
+    kind, _, rest = spec.partition(":")
+    if kind.endswith(".py"):
+        mod_spec = importlib.util.spec_from_file_location("sonar_model", kind)
+        mod = importlib.util.module_from_spec(mod_spec)
+        mod_spec.loader.exec_module(mod)
+        return getattr(mod, rest or "model")
+
+    v = [float(x) for x in rest.split(":")] if rest else []
+    if kind == "static" and len(v) == 1:
+        return lambda t, i: v[0]
+    if kind == "approach" and len(v) in (2, 3):
+        low = v[2] if len(v) == 3 else 0.0
+        return lambda t, i: max(low, v[0] + v[1] * t)
+    if kind == "pass" and len(v) == 3:
+        return lambda t, i: v[0] if v[1] <= t < v[1] + v[2] else NO_ECHO_CM
+    raise ValueError("bad sensor model '%s'" % spec)
+
+
+def sample(model, t, i, args):
+    cm = model(t, i)
+    if random.random() < args.dropout:
+        return NO_ECHO_CM
+    if random.random() < args.ghost:
+        return random.randint(5, 60)
+    cm += random.gauss(0, args.noise) if args.noise else 0
+    return int(min(max(cm, 0), NO_ECHO_CM))
+
+
+def get(url, timeout=2):
+    with urllib.request.urlopen(url, timeout=timeout) as r:
+        return r.read().decode()
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("robot", help="robot base URL, e.g. http://192.168.4.1")
+    ap.add_argument("models", nargs="+", help="one model per sensor, see above")
+    ap.add_argument("--rate", type=float, default=10, help="updates per second")
+    ap.add_argument("--duration", type=float, default=30, help="seconds")
+    ap.add_argument("--noise", type=float, default=0, help="gaussian noise sigma, cm")
+    ap.add_argument("--dropout", type=float, default=0, help="missed echo probability")
+    ap.add_argument("--ghost", type=float, default=0, help="crosstalk reading probability")
+    ap.add_argument("--seed", type=int, help="random seed for repeatable runs")
+    args = ap.parse_args()
+
+    random.seed(args.seed)
+    try:
+        models = [make_model(m) for m in args.models]
+    except (ValueError, OSError, AttributeError) as e:
+        sys.exit(e)
+
+    base = args.robot.rstrip("/")
+    table = json.loads(get(base + "/sonar"))
+    if len(models) != len(table["sensors"]):
+        print("warning: robot has %d sensors, %d models given" % (len(table["sensors"]), len(models)))
+
+    start = time.monotonic()
+    last_print = -1
+    try:
+        while True:
+            t = time.monotonic() - start
+            if t >= args.duration:
+                break
+            values = [sample(m, t, i, args) for i, m in enumerate(models)]
+            table = json.loads(get("%s/sonar?cm=%s" % (base, ",".join(map(str, values)))))
+
+            if int(t) != last_print:
+                last_print = int(t)
+                status = json.loads(get(base + "/status"))
+                print("%5.1fs  sent %-20s filtered %-20s obstacle %3d cm  mode %s" % (
+                    t, ",".join(map(str, values)),
+                    ",".join(str(s["cm"]) for s in table["sensors"]),
+                    table["obstacleCm"], status["mode"]))
+            time.sleep(max(0.0, 1.0 / args.rate - (time.monotonic() - start - t)))
+    except KeyboardInterrupt:
+        pass
+    finally:
+        get(base + "/sonar?sim=0")
+
+
+if __name__ == "__main__":
+    main()
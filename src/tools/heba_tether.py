@@ -0,0 +1,402 @@
+#!/usr/bin/env python3
+"""Drive a HEBA robot over the USB serial tether.
+
+For bench tests and host-side planners: setpoints go out and the robot's
+state comes back over the USB UART at HEBA_SERIAL_BAUD (921600), fast
+and steady enough for closed-loop work at 100+ Hz, where WiFi HTTP is not.
+
+Every message is <type> <seq> <payload> <crc16 LE>, COBS-encoded and
+ended by 0x00 (CRC-16/CCITT-FALSE over type..payload). Host to robot:
+
+    PING      0x01                          -> PONG: protocol, board, joints, PCA boards
+    SETPOINT  0x02  mask u32, i16 per joint bit (0.1 deg), bit 31: left, right i16
+    TELEMETRY 0x03  period ms u16 (0 = off) -> ACK
+    COMMAND   0x04  a RoboRemo text line    -> ACK
+    ESTOP     0x05                          handled on arrival, not by loop()
+
+Robot to host: STATE 0x82 (see STATE below, then one i16 per joint, -1 =
+not driven yet), LOG 0x83 (a flight recorder record), ACK 0x84 (status
+0 ok, 1 bad length, 2 unknown type; setpoints are only acked when they
+fail) and ERROR 0x85 (CRC errors, overruns). The robot drops the tether
+and stops wheels it was driving after 250 ms without a message, so keep
+setpoints going or call keepalive().
+
+Library use:
+    with Tether("/dev/ttyUSB0") as t:
+        t.telemetry(10)
+        seq = t.setpoint({0: 90.0, 2: 45.5}, drive=(0, 0))
+        st = t.wait_state(seq)                 # first state with it applied
+
+CLI:
+    python3 heba_tether.py /dev/ttyUSB0 info
+    python3 heba_tether.py /dev/ttyUSB0 monitor --period 50
+    python3 heba_tether.py /dev/ttyUSB0 cmd PLAY:0
+    python3 heba_tether.py /dev/ttyUSB0 sine --joint 0 --amp 20 --rate 100 -t 10
+    python3 heba_tether.py /dev/ttyUSB0 estop
+
+'sine' is the closed-loop check: it streams a sine on one joint, matches
+each state to the setpoint it reflects and reports the achieved rate,
+round-trip latency and tracking error. Needs pyserial.
+"""
+
+import argparse
+import binascii
+import math
+import struct
+import sys
+import threading
+import time
+
+import heba_log_decode
+
+PING, SETPOINT, TELEMETRY, COMMAND, ESTOP = 0x01, 0x02, 0x03, 0x04, 0x05
+PONG, STATE_MSG, LOG, ACK, ERROR = 0x81, 0x82, 0x83, 0x84, 0x85
+DRIVE_BIT = 31
+POS_SCALE = 10
+TIMEOUT = 0.25
+
+# Must match struct TetherState in the firmware
+STATE = struct.Struct("<IIBBBBHHHhhHHBx")
+FLAGS = ["moving", "paused", "estop", "homing", "waves", "idle"]
+MODES = ["idle", "cleaning", "water", "medicine", "garbage", "arm", "obstacle stop"]
+BOARDS = {1: "classic", 2: "robot", 3: "arm"}
+ACK_STATUS = ["ok", "bad length", "unknown type"]
+
+
+class TetherError(Exception):
+    pass
+
+
+def crc16(data):
+    return binascii.crc_hqx(data, 0xFFFF)
+
+
+def cobs_encode(data):
+    out = bytearray(b"\0")
+    code = 0
+    run = 1
+    for i, b in enumerate(data):
+        if b:
+            out.append(b)
+            run += 1
+        if not b or run == 0xFF:
+            out[code] = run
+            run = 1
+            code = len(out)
+            if not b or i + 1 < len(data):
+                out.append(0)
+    if code < len(out):                   # not after a full block at the very end
+        out[code] = run
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        run = data[i]
+        if run == 0 or i + run > len(data):
+            raise ValueError("bad COBS")
+        out += data[i + 1:i + run]
+        i += run
+        if run != 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def frame(msg_type, seq, payload=b""):
+    raw = bytes([msg_type, seq & 0xFF]) + payload
+    return cobs_encode(raw + struct.pack("<H", crc16(raw))) + b"\0"
+
+
+def parse_state(payload):
+    v = STATE.unpack_from(payload)
+    st = dict(zip(("ms", "pending", "mode", "flags", "seq", "soc", "rest_mv", "load_mv",
+                   "obstacle_cm", "left", "right", "frames", "crc_errors", "joints"), v))
+    pos = struct.unpack_from("<%dh" % st["joints"], payload, STATE.size)
+    st["pos"] = [p / POS_SCALE if p >= 0 else None for p in pos]
+    st["flag_names"] = [f for i, f in enumerate(FLAGS) if st["flags"] & (1 << i)]
+    return st
+
+
+class Tether:
+    def __init__(self, port, baud=921600, on_log=None, handshake=True):
+        try:
+            import serial
+        except ImportError:
+            sys.exit("pyserial is needed: pip install pyserial")
+        # DTR/RTS drive EN and GPIO0 on the usual ESP32 USB bridges: leave
+        # them released, or opening the port resets the robot.
+        self.port = serial.Serial(None, baud, timeout=0.05)
+        self.port.port = port
+        self.port.dtr = False
+        self.port.rts = False
+        self.port.open()
+        self.handshake = handshake
+        self.on_log = on_log
+        self.seq = 0
+        self.info = None
+        self.errors = (0, 0)               # robot side: CRC errors, overruns
+        self.bad = 0                       # host side: messages that failed CRC
+        self.refused = 0                   # setpoints acked with an error
+        self._state = None
+        self._state_at = 0.0
+        self._acks = {}                    # replies someone waits for, by seq
+        self._waiting = set()
+        self._last_tx = 0.0
+        self._cond = threading.Condition()
+        self._tx = threading.Lock()
+        self._stop = False
+        self._reader = threading.Thread(target=self._read_loop, daemon=True)
+        self._reader.start()
+
+    def __enter__(self):
+        if self.handshake:
+            self.ping()
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def close(self):
+        if self.info is not None:
+            try:
+                self.telemetry(0)
+            except TetherError:
+                pass
+        self._stop = True
+        self._reader.join()
+        self.port.close()
+
+    # ---------- sending ----------
+    def send(self, msg_type, payload=b""):
+        with self._tx:
+            self.seq = (self.seq + 1) & 0xFF
+            seq = self.seq
+            self.port.write(frame(msg_type, seq, payload))
+            self._last_tx = time.monotonic()
+        return seq
+
+    def keepalive(self, every=0.1):
+        """Ping when nothing went out for a while; the robot drops a silent host."""
+        if time.monotonic() - self._last_tx >= every:
+            self.send(PING)
+
+    def _request(self, msg_type, payload=b"", timeout=TIMEOUT):
+        with self._cond:
+            seq = self.send(msg_type, payload)
+            self._waiting.add(seq)
+            ok = self._cond.wait_for(lambda: seq in self._acks, timeout)
+            self._waiting.discard(seq)
+            if not ok:
+                raise TetherError("no reply to message %d" % seq)
+            return self._acks.pop(seq)
+
+    def ping(self, tries=10):
+        # the robot may be in light sleep: the first few can get lost
+        for _ in range(tries):
+            try:
+                kind, payload = self._request(PING)
+                proto, board, joints, pcas = struct.unpack("<4B", payload)
+                self.info = {"protocol": proto, "board": BOARDS.get(board, board), "joints": joints, "pca": pcas}
+                return self.info
+            except TetherError:
+                continue
+        raise TetherError("robot doesn't answer on the tether")
+
+    def _ack(self, msg_type, payload=b""):
+        kind, data = self._request(msg_type, payload)
+        if kind != ACK or data[0] != 0:
+            raise TetherError("robot refused: %s" % heba_log_decode.name_of(ACK_STATUS, data[0]))
+
+    def telemetry(self, period_ms):
+        self._ack(TELEMETRY, struct.pack("<H", period_ms))
+
+    def command(self, line):
+        self._ack(COMMAND, line.encode("ascii"))
+
+    def estop(self):
+        self.send(ESTOP)
+
+    def setpoint(self, joints=None, drive=None):
+        """joints: {joint: degrees}; drive: (left, right) -255..255. Returns the seq."""
+        joints = joints or {}
+        mask = 0
+        body = b""
+        for j in sorted(joints):
+            mask |= 1 << j
+            body += struct.pack("<h", int(round(joints[j] * POS_SCALE)))
+        if drive is not None:
+            mask |= 1 << DRIVE_BIT
+            body += struct.pack("<hh", *drive)
+        return self.send(SETPOINT, struct.pack("<I", mask) + body)
+
+    # ---------- receiving ----------
+    def state(self):
+        """Latest STATE and its arrival time (time.monotonic())."""
+        with self._cond:
+            return self._state, self._state_at
+
+    def wait_state(self, seq=None, timeout=TIMEOUT):
+        """Next STATE; with seq, the first one that reflects that setpoint."""
+        with self._cond:
+            last = self._state
+            ok = self._cond.wait_for(lambda: self._state is not last and (
+                seq is None or self._state["seq"] == seq & 0xFF), timeout)
+            if not ok:
+                raise TetherError("no state (is telemetry on?)")
+            return self._state
+
+    def _read_loop(self):
+        buf = bytearray()
+        while not self._stop:
+            data = self.port.read(512)
+            if not data:
+                continue
+            buf += data
+            while True:
+                end = buf.find(b"\0")
+                if end < 0:
+                    break
+                msg = bytes(buf[:end])
+                del buf[:end + 1]
+                if msg:
+                    self._handle(msg)
+
+    def _handle(self, msg):
+        try:
+            raw = cobs_decode(msg)
+        except ValueError:
+            raw = b""
+        if len(raw) < 4 or crc16(raw[:-2]) != struct.unpack("<H", raw[-2:])[0]:
+            self.bad += 1                  # also raw log frames sent before the tether came up
+            return
+        kind, seq, payload = raw[0], raw[1], raw[2:-2]
+
+        if kind == LOG:
+            if self.on_log:
+                _seq, ms, ev, boot, *args = heba_log_decode.RECORD.unpack(payload)
+                self.on_log(heba_log_decode.format_record(ms, ev, boot, args))
+            return
+        with self._cond:
+            if kind == STATE_MSG:
+                self._state = parse_state(payload)
+                self._state_at = time.monotonic()
+            elif kind == ERROR:
+                self.errors = struct.unpack("<HH", payload)
+            elif kind in (PONG, ACK) and seq in self._waiting:
+                self._acks[seq] = (kind, payload)
+            elif kind == ACK and payload[:1] != b"\0":
+                self.refused += 1              # a setpoint the robot couldn't use
+            self._cond.notify_all()
+
+
+# ---------- CLI ----------
+def show_state(st):
+    pos = " ".join("%5.1f" % p if p is not None else "   - " for p in st["pos"])
+    print("%9.3f  %-8s [%s]  L%4d R%4d  %3d cm  %4.2f V %3d%%  %s" % (
+        st["ms"] / 1000.0, heba_log_decode.name_of(MODES, st["mode"]), pos, st["left"], st["right"],
+        st["obstacle_cm"], st["rest_mv"] / 1000.0, st["soc"], ",".join(st["flag_names"])))
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))] if values else float("nan")
+
+
+def run_sine(t, args):
+    period = max(5, int(1000 / args.rate / 2))   # states at least twice per setpoint
+    t.telemetry(period)
+    first = t.wait_state()
+    center = args.center
+    if center is None:
+        center = first["pos"][args.joint] if first["pos"][args.joint] is not None else 90.0
+
+    sent = {}                                   # seq -> (time, degrees)
+    latency = []
+    error = []
+    last_seen = None
+    start = time.monotonic()
+    tick = start
+    count = 0
+    while time.monotonic() - start < args.seconds:
+        now = time.monotonic()
+        deg = center + args.amp * math.sin(2 * math.pi * (now - start) / args.period)
+        seq = t.setpoint({args.joint: deg})
+        sent[seq] = (now, deg)
+        count += 1
+
+        st, st_at = t.state()
+        if st and st["seq"] != last_seen and st["seq"] in sent:
+            last_seen = st["seq"]
+            at, target = sent.pop(st["seq"])
+            latency.append((st_at - at) * 1000.0)
+            if st["pos"][args.joint] is not None:
+                error.append(abs(st["pos"][args.joint] - target))
+
+        tick += 1.0 / args.rate
+        time.sleep(max(0.0, tick - time.monotonic()))
+
+    elapsed = time.monotonic() - start
+    t.telemetry(0)
+    print("%d setpoints in %.2f s: %.1f Hz (asked %.0f)" % (count, elapsed, count / elapsed, args.rate))
+    print("round trip  p50 %.1f ms  p95 %.1f ms  max %.1f ms  (%d matched)" % (
+        percentile(latency, 50), percentile(latency, 95), max(latency or [float("nan")]), len(latency)))
+    print("tracking    mean %.2f deg  max %.2f deg (driven vs commanded)" % (
+        sum(error) / len(error) if error else float("nan"), max(error or [float("nan")])))
+    print("robot CRC errors %d, overruns %d; refused setpoints %d; host bad messages %d" % (
+        t.errors + (t.refused, t.bad)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("port")
+    ap.add_argument("-b", "--baud", type=int, default=921600, help="HEBA_SERIAL_BAUD")
+    ap.add_argument("--logs", action="store_true", help="print the flight recorder records")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    sub.add_parser("info", help="protocol version, board, joints")
+    m = sub.add_parser("monitor", help="print the state until Ctrl-C")
+    m.add_argument("--period", type=int, default=100, help="ms")
+    c = sub.add_parser("cmd", help="send a RoboRemo text command")
+    c.add_argument("line")
+    sub.add_parser("estop", help="emergency stop")
+    s = sub.add_parser("sine", help="closed-loop sine on one joint, reports rate and latency")
+    s.add_argument("--joint", type=int, default=0)
+    s.add_argument("--center", type=float, help="degrees, default where the joint is")
+    s.add_argument("--amp", type=float, default=15.0, help="degrees")
+    s.add_argument("--period", type=float, default=2.0, help="s per cycle")
+    s.add_argument("--rate", type=float, default=100.0, help="setpoints per second")
+    s.add_argument("-t", "--seconds", type=float, default=10.0)
+    args = ap.parse_args()
+
+    on_log = print if args.logs or args.cmd == "monitor" else None
+    try:
+        # estop goes out the moment the port is open: no PING first, which
+        # a busy or still booting robot may take a while to answer
+        with Tether(args.port, args.baud, on_log, handshake=args.cmd != "estop") as t:
+            if args.cmd == "info":
+                print("protocol %(protocol)d, board %(board)s, %(joints)d joints, %(pca)d PCA9685" % t.info)
+            elif args.cmd == "cmd":
+                t.command(args.line)
+            elif args.cmd == "estop":
+                t.estop()
+            elif args.cmd == "monitor":
+                t.telemetry(args.period)
+                while True:
+                    t.keepalive()
+                    try:
+                        show_state(t.wait_state(timeout=0.1))
+                    except TetherError:
+                        pass
+            else:
+                if not 0 <= args.joint < t.info["joints"]:
+                    raise TetherError("the robot has joints 0..%d" % (t.info["joints"] - 1))
+                run_sine(t, args)
+    except TetherError as e:
+        sys.exit("error: %s" % e)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()